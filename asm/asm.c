@@ -1,223 +1,1654 @@
-#define _CRT_SECURE_NO_WARNINGS
+#define _CRT_SECURE_NO_WARNINGS
 #define _CRT_SECURE_NO_DEPRECATE
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdarg.h>
 #include <ctype.h>
 
-#define MAX_LINE_LENGTH 500
-#define MAX_LABEL_LENGTH 50
-#define MAX_LABEL_COUNT 100
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #define MAX_INSTRUCTIONS 4096
 #define MAX_DMEM_SIZE 4096
+#define SYMBOL_BUCKETS_INITIAL 1024 // power of 2, doubled when half full
+#define SECTOR_SIZE 128
+#define DISK_SIZE 128
+
+// Binary memory image, read by the simulator in place of imemin/dmemin/diskin (see load_image() in sim.c).
+// Little-endian: a header, then sections of non-empty word ranges, each a section header and its words.
+// The checksum is FNV-1a over everything after the header.
+#define IMAGE_MAGIC "SIMP"
+#define IMAGE_VERSION 1
+#define IMAGE_GAP 4 // zero runs shorter than a section header (4 words) stay inside the section
+
+enum { IMAGE_IMEM = 1, IMAGE_DMEM, IMAGE_DISK }; // imem words are 8 bytes, dmem and disk words 4
+
+typedef struct {
+    char magic[4];
+    uint16_t version;
+    uint16_t sectionCount;
+    uint32_t checksum;
+    uint32_t size; // of the whole file
+} ImageHeader;
+
+typedef struct {
+    uint32_t type;
+    uint32_t start; // first word, disk words count sector * SECTOR_SIZE + line
+    uint32_t count;
+    uint32_t reserved;
+} ImageSection;
+
+typedef struct {
+    unsigned char *data;
+    size_t size, capacity;
+    int sectionCount;
+} ImageBuffer;
+
+typedef struct {
+    const char *name; // points into the source buffer, not terminated
+    int length;
+    int address; // -1 until the label is defined
+    int global;  // .global: visible to the other objects of a link
+} Symbol;
+
+// labels, hashed by name with open addressing
+typedef struct {
+    Symbol *symbols;  // in order of first appearance
+    int count, capacity;
+    int *buckets;     // symbol index + 1, 0 if empty
+    int bucketCount;
+} SymbolTable;
+
+enum { FIXUP_IMM1, FIXUP_IMM2, FIXUP_WORD };
+
+// reference to a label not defined yet, patched at the end. In an object file every label
+// reference is one, the linker patches them once the code is placed.
+typedef struct {
+    int kind;
+    int index; // instruction, or dmem address of a FIXUP_WORD
+    int symbol;
+    int line, column;
+} Fixup;
+
+typedef struct {
+    Fixup *fixups;
+    int count, capacity;
+} FixupList;
 
+// position in the mapped source
 typedef struct {
-    char label[MAX_LABEL_LENGTH];
-    int address;
-} Label;
+    const char *filename;
+    const char *cursor, *end;
+    const char *lineStart;
+    int line;
+} Lexer;
 
+// word of the source, in place
 typedef struct {
-    char opcode[10];
-    char rd[10], rs[10], rt[10], rm[10];
-    char imm1[50], imm2[50];
+    const char *start;
+    int length;
+} Token;
+
+typedef struct {
+    int opcode;
+    int rd, rs, rt, rm;
+    int imm1, imm2;
 } Instruction;
 
+// one source file or object, before encoding
+typedef struct {
+    Instruction instructions[MAX_INSTRUCTIONS];
+    int instructionCount;
+    int dataMemory[MAX_DMEM_SIZE];
+    unsigned char dataSet[MAX_DMEM_SIZE]; // written by a .word
+    SymbolTable table;
+    FixupList fixups;
+    int relocatable; // -c and -O: keep every label reference as a fixup
+} Program;
+
+// Relocatable object file written by -c and read by -link, little-endian: the header, the encoded
+// code with label fields 0, the .word entries, the symbols, the fixups and the symbol names.
+#define OBJECT_MAGIC "SIMO"
+#define OBJECT_VERSION 1
+
+typedef struct {
+    char magic[4];
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t codeCount, dataCount, symbolCount, fixupCount, stringSize;
+} ObjectHeader;
+
+typedef struct {
+    uint32_t address;
+    int32_t value;
+} ObjectData;
+
+typedef struct {
+    uint32_t nameOffset, nameLength;
+    int32_t address; // relative to the object's code, -1 if undefined here
+    uint32_t global;
+} ObjectSymbol;
+
+typedef struct {
+    uint32_t kind, index, symbol;
+} ObjectFixup;
+
+typedef struct {
+    const char *name;
+    int code;
+} NameCode;
+
+// Perfect hash tables, built offline: the multipliers were searched until the 22 mnemonics
+// and the 16 registers all landed in distinct slots. See opcodeSlot() and registerSlot().
+static const NameCode opcodeTable[32] = {
+    {"in", 19}, {"bgt", 12}, {"beq", 9}, {"add", 0}, {NULL, -1}, {"mac", 2}, {NULL, -1}, {NULL, -1},
+    {"bne", 10}, {"sw", 17}, {"jal", 15}, {"or", 4}, {"ble", 13}, {NULL, -1}, {NULL, -1}, {"halt", 21},
+    {NULL, -1}, {NULL, -1}, {"and", 3}, {"srl", 8}, {"bge", 14}, {"sra", 7}, {"xor", 5}, {NULL, -1},
+    {"blt", 11}, {NULL, -1}, {"lw", 16}, {"sub", 1}, {"reti", 18}, {"out", 20}, {"sll", 6}, {NULL, -1}
+};
+
+static const NameCode registerTable[16] = {
+    {"$s0", 10}, {"$zero", 0}, {"$t2", 9}, {"$t0", 7}, {"$ra", 15}, {"$a1", 5}, {"$imm1", 1}, {"$gp", 13},
+    {"$s1", 11}, {"$v0", 3}, {"$sp", 14}, {"$t1", 8}, {"$a2", 6}, {"$a0", 4}, {"$imm2", 2}, {"$s2", 12}
+};
+
 // Function prototypes
-void processWordDirective(char *line, int *dataMemory);
-int parseInstruction(char *line, Instruction *instr);
-unsigned long long encodeInstruction(const Instruction *instr, Label labels[], int labelCount);
-int resolveImmediate(const char *imm, Label labels[], int labelCount);
+const char *mapSource(const char *filename, size_t *size);
+void unmapSource(const char *data, size_t size);
+void lexError(const Lexer *lexer, const char *at, const char *format, ...);
+int nextToken(Lexer *lexer, Token *token);
+const char *skipBlanks(const Lexer *lexer);
+void endLine(Lexer *lexer);
+int parseNumber(const Token *token, int allowOctal, int *value);
+void processWordDirective(Lexer *lexer, Program *program);
+void processGlobalDirective(Lexer *lexer, Program *program);
+void parseInstruction(Lexer *lexer, const Token *mnemonic, Program *program, int index);
+unsigned long long encodeInstruction(const Instruction *instr);
+void encodeProgram(const Program *program, unsigned long long *instructions);
+int resolveImmediate(Lexer *lexer, const Token *imm, Program *program, int kind, int index);
 void writeImemFile(const unsigned long long *instructions, int instructionCount, const char *filename);
 void writeDmemFile(const int *dataMemory, const char *filename);
-int getOpcode(const char *mnemonic);
-int getRegister(const char *reg);
-int readLabels(FILE *inputFile, Label labels[], int *labelCount);
-void secondPass(const char *inputFilename, const char *imemFilename, const char *dmemFilename, Label labels[], int labelCount);
-
-// First pass to read labels
-int readLabels(FILE *inputFile, Label labels[], int *labelCount) {
-    char line[MAX_LINE_LENGTH];
-    int lineAddress = 0;
-    *labelCount = 0;
-
-    while (fgets(line, MAX_LINE_LENGTH, inputFile)) {
-        char *comment = strchr(line, '#');
-        if (comment) *comment = '\0';
-
-        char *trimmedLine = line;
-        while (isspace(*trimmedLine)) trimmedLine++;
-        if (*trimmedLine == '\0') continue;
-
-        char *colon = strchr(trimmedLine, ':');
-        if (colon) {
-            *colon = '\0';
-            char *labelName = trimmedLine;
-
-            char *end = labelName + strlen(labelName) - 1;
-            while (end > labelName && isspace(*end)) *end-- = '\0';
-
-            if (*labelCount >= MAX_LABEL_COUNT) {
-                fprintf(stderr, "Error: Too many labels\n");
-                return 1;
-            }
+int getOpcode(const Token *mnemonic);
+int getRegister(const Token *reg);
+unsigned int hashName(const char *name, int length);
+int findSymbol(SymbolTable *table, const char *name, int length, int create);
+void defineLabel(Lexer *lexer, SymbolTable *table, const Token *name, int address);
+void addFixup(FixupList *fixups, const Lexer *lexer, const Token *imm, int kind, int index, int symbol);
+void backpatch(Program *program, const char *filename);
+void initSymbols(SymbolTable *table);
+void freeSymbols(SymbolTable *table);
+const char *parseSource(const char *inputFilename, Program *program, size_t *size);
+void assemble(const char *inputFilename, const char *imemFilename, const char *dmemFilename, const char *imageFilename, const char *diskFilename, int optimize);
+void optimizeProgram(Program *program, const char *filename);
+void estimateProgram(const Program *program, const char *filename);
+const char *loadProgram(const char *inputFilename, Program *program, size_t *size, int optimize);
+void estimate(const char *inputFilename, int optimize);
+void writeObjectFile(const Program *program, const char *filename);
+void linkObjects(char **objectFilenames, int objectCount, const char *imemFilename, const char *dmemFilename, const char *imageFilename);
+void imageAppend(ImageBuffer *image, const void *data, size_t size);
+void imageAddSections(ImageBuffer *image, uint32_t type, const void *words, int wordSize, int count);
+void writeImageFile(const unsigned long long *instructions, int instructionCount, const int *dataMemory, const uint32_t *disk, const char *filename);
+void readDiskFile(uint32_t *disk, const char *filename);
 
-            strncpy(labels[*labelCount].label, labelName, MAX_LABEL_LENGTH - 1);
-            labels[*labelCount].label[MAX_LABEL_LENGTH - 1] = '\0';
-            labels[*labelCount].address = lineAddress;
-            (*labelCount)++;
-        } else if (strstr(trimmedLine, ".word") == NULL) {
-            lineAddress++; // Count only instructions, not .word
+// Map the whole source read-only, the lexer works on it in place
+const char *mapSource(const char *filename, size_t *size) {
+    *size = 0;
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "Error opening input file: %s\n", filename);
+        exit(1);
+    }
+    LARGE_INTEGER fileSize;
+    GetFileSizeEx(file, &fileSize);
+    *size = (size_t)fileSize.QuadPart;
+    if (*size == 0) {
+        CloseHandle(file);
+        return "";
+    }
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    const char *data = mapping ? (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if (mapping) CloseHandle(mapping);
+    CloseHandle(file);
+    if (!data) {
+        fprintf(stderr, "Error mapping input file: %s\n", filename);
+        exit(1);
+    }
+    return data;
+#else
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror("Error opening input file");
+        exit(1);
+    }
+    *size = (size_t)st.st_size;
+    if (*size == 0) {
+        close(fd);
+        return "";
+    }
+    void *data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("Error mapping input file");
+        exit(1);
+    }
+    return (const char *)data;
+#endif
+}
+
+void unmapSource(const char *data, size_t size) {
+    if (size == 0) return;
+#ifdef _WIN32
+    UnmapViewOfFile(data);
+#else
+    munmap((void *)data, size);
+#endif
+}
+
+// Print "file:line:column: Error: ..." for the character at
+void lexError(const Lexer *lexer, const char *at, const char *format, ...) {
+    va_list args;
+    fprintf(stderr, "%s:%d:%d: Error: ", lexer->filename, lexer->line, (int)(at - lexer->lineStart) + 1);
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fputc('\n', stderr);
+}
+
+// Next word of the line, operands are separated by spaces, tabs and commas. 0 at the end of the line or a comment.
+int nextToken(Lexer *lexer, Token *token) {
+    const char *p = lexer->cursor;
+    while (p < lexer->end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == ',')) p++;
+    lexer->cursor = p;
+    if (p == lexer->end || *p == '\n' || *p == '#') return 0;
+
+    token->start = p;
+    while (p < lexer->end && *p != ' ' && *p != '\t' && *p != '\r' && *p != ',' && *p != '\n' && *p != '#' && *p != ':') p++;
+    token->length = (int)(p - token->start);
+    lexer->cursor = p;
+    if (token->length == 0) {
+        lexError(lexer, p, "Unexpected ':'");
+        exit(1);
+    }
+    return 1;
+}
+
+// First character after the blanks at the cursor, a label may have blanks before its ':'
+const char *skipBlanks(const Lexer *lexer) {
+    const char *p = lexer->cursor;
+    while (p < lexer->end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+    return p;
+}
+
+// Check nothing but a comment is left and move to the next line
+void endLine(Lexer *lexer) {
+    Token extra;
+    if (nextToken(lexer, &extra)) {
+        lexError(lexer, extra.start, "Unexpected '%.*s'", extra.length, extra.start);
+        exit(1);
+    }
+    const char *newline = memchr(lexer->cursor, '\n', lexer->end - lexer->cursor);
+    lexer->cursor = newline ? newline + 1 : lexer->end;
+    lexer->lineStart = lexer->cursor;
+    lexer->line++;
+}
+
+// Signed hex (0x) or decimal number, or octal with a leading 0 if allowOctal. 0 if token is not a number.
+int parseNumber(const Token *token, int allowOctal, int *value) {
+    const char *p = token->start, *end = token->start + token->length;
+    int negative = 0, base = 10;
+    unsigned long long result = 0;
+
+    if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+    if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+        base = 16;
+        p += 2;
+    } else if (allowOctal && end - p > 1 && p[0] == '0') {
+        base = 8;
+        p++;
+    }
+    if (p == end) return 0;
+    for (; p < end; p++) {
+        int digit;
+        if (*p >= '0' && *p <= '9') digit = *p - '0';
+        else if (*p >= 'a' && *p <= 'f') digit = *p - 'a' + 10;
+        else if (*p >= 'A' && *p <= 'F') digit = *p - 'A' + 10;
+        else return 0;
+        if (digit >= base) return 0;
+        result = result * base + digit;
+    }
+    *value = (int)(negative ? 0 - result : result);
+    return 1;
+}
+
+// FNV-1a
+unsigned int hashName(const char *name, int length) {
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Index of the symbol called name, added as undefined if create is set, or -1
+int findSymbol(SymbolTable *table, const char *name, int length, int create) {
+    unsigned int mask = table->bucketCount - 1;
+    unsigned int i = hashName(name, length) & mask;
+
+    while (table->buckets[i]) {
+        int index = table->buckets[i] - 1;
+        if (table->symbols[index].length == length && memcmp(table->symbols[index].name, name, length) == 0) return index;
+        i = (i + 1) & mask;
+    }
+    if (!create) return -1;
+
+    if (table->count == table->capacity) {
+        table->capacity = table->capacity ? 2 * table->capacity : SYMBOL_BUCKETS_INITIAL / 2;
+        table->symbols = realloc(table->symbols, table->capacity * sizeof(Symbol));
+        if (!table->symbols) {
+            perror("Error allocating symbol table");
+            exit(1);
+        }
+    }
+    int index = table->count++;
+    table->symbols[index].name = name;
+    table->symbols[index].length = length;
+    table->symbols[index].address = -1;
+    table->symbols[index].global = 0;
+    table->buckets[i] = index + 1;
+
+    if (2 * table->count > table->bucketCount) {
+        // rehash into twice the buckets
+        free(table->buckets);
+        table->bucketCount *= 2;
+        table->buckets = calloc(table->bucketCount, sizeof(int));
+        if (!table->buckets) {
+            perror("Error allocating symbol table");
+            exit(1);
+        }
+        mask = table->bucketCount - 1;
+        for (int j = 0; j < table->count; j++) {
+            i = hashName(table->symbols[j].name, table->symbols[j].length) & mask;
+            while (table->buckets[i]) i = (i + 1) & mask;
+            table->buckets[i] = j + 1;
         }
     }
+    return index;
+}
 
+void defineLabel(Lexer *lexer, SymbolTable *table, const Token *name, int address) {
+    int index = findSymbol(table, name->start, name->length, 1);
+    if (table->symbols[index].address != -1) {
+        lexError(lexer, name->start, "Duplicate label '%.*s'", name->length, name->start);
+        exit(1);
+    }
+    table->symbols[index].address = address;
+}
+
+void addFixup(FixupList *fixups, const Lexer *lexer, const Token *imm, int kind, int index, int symbol) {
+    if (fixups->count == fixups->capacity) {
+        fixups->capacity = fixups->capacity ? 2 * fixups->capacity : 256;
+        fixups->fixups = realloc(fixups->fixups, fixups->capacity * sizeof(Fixup));
+        if (!fixups->fixups) {
+            perror("Error allocating fixups");
+            exit(1);
+        }
+    }
+    Fixup *fixup = &fixups->fixups[fixups->count++];
+    fixup->kind = kind;
+    fixup->index = index;
+    fixup->symbol = symbol;
+    fixup->line = lexer->line;
+    fixup->column = (int)(imm->start - lexer->lineStart) + 1;
+}
+
+// Fill in the forward references once all labels are known
+void backpatch(Program *program, const char *filename) {
+    for (int i = 0; i < program->fixups.count; i++) {
+        const Fixup *fixup = &program->fixups.fixups[i];
+        const Symbol *symbol = &program->table.symbols[fixup->symbol];
+        if (symbol->address == -1) {
+            fprintf(stderr, "%s:%d:%d: Error: Undefined immediate or label '%.*s'\n",
+                filename, fixup->line, fixup->column, symbol->length, symbol->name);
+            exit(1);
+        }
+        if (fixup->kind == FIXUP_IMM1) program->instructions[fixup->index].imm1 = symbol->address;
+        else if (fixup->kind == FIXUP_IMM2) program->instructions[fixup->index].imm2 = symbol->address;
+        else program->dataMemory[fixup->index] = symbol->address;
+    }
+}
+
+void initSymbols(SymbolTable *table) {
+    table->bucketCount = SYMBOL_BUCKETS_INITIAL;
+    table->buckets = calloc(table->bucketCount, sizeof(int));
+    if (!table->buckets) {
+        perror("Error allocating symbol table");
+        exit(1);
+    }
+}
+
+void freeSymbols(SymbolTable *table) {
+    free(table->symbols);
+    free(table->buckets);
+}
+
+// Single pass over the mapped source: labels are defined as they are met, references to later labels are
+// left as fixups. The source stays mapped for the symbol names, the caller unmaps it.
+const char *parseSource(const char *inputFilename, Program *program, size_t *size) {
+    const char *source = mapSource(inputFilename, size);
+    Lexer lexer = {inputFilename, source, source + *size, source, 1};
+
+    initSymbols(&program->table);
+
+    while (lexer.cursor < lexer.end) {
+        Token token;
+        const char *colon;
+        int more = nextToken(&lexer, &token);
+
+        // Labels, an instruction may follow on the same line
+        while (more && (colon = skipBlanks(&lexer)) < lexer.end && *colon == ':') {
+            lexer.cursor = colon + 1;
+            defineLabel(&lexer, &program->table, &token, program->instructionCount);
+            more = nextToken(&lexer, &token);
+        }
+
+        if (more) {
+            if (token.length == 5 && memcmp(token.start, ".word", 5) == 0) {
+                processWordDirective(&lexer, program);
+            } else if (token.length == 7 && memcmp(token.start, ".global", 7) == 0) {
+                processGlobalDirective(&lexer, program);
+            } else {
+                if (program->instructionCount >= MAX_INSTRUCTIONS) {
+                    lexError(&lexer, token.start, "Too many instructions");
+                    exit(1);
+                }
+                parseInstruction(&lexer, &token, program, program->instructionCount);
+                program->instructionCount++;
+            }
+        }
+        endLine(&lexer);
+    }
+    return source;
+}
+
+// Parse and resolve a whole program, optimized with -O. Returns the mapped source, see parseSource().
+const char *loadProgram(const char *inputFilename, Program *program, size_t *size, int optimize) {
+    program->relocatable = optimize;
+    const char *source = parseSource(inputFilename, program, size);
+
+    backpatch(program, inputFilename);
+    if (optimize) {
+        optimizeProgram(program, inputFilename);
+        backpatch(program, inputFilename);
+    }
+    return source;
+}
+
+void assemble(const char *inputFilename, const char *imemFilename, const char *dmemFilename, const char *imageFilename, const char *diskFilename, int optimize) {
+    static Program program;
+    static unsigned long long instructions[MAX_INSTRUCTIONS];
+    size_t size;
+    const char *source = loadProgram(inputFilename, &program, &size, optimize);
+
+    encodeProgram(&program, instructions);
+    free(program.fixups.fixups);
+    freeSymbols(&program.table);
+    unmapSource(source, size);
+
+    if (imageFilename) {
+        static uint32_t disk[DISK_SIZE * SECTOR_SIZE];
+        if (diskFilename) readDiskFile(disk, diskFilename);
+        writeImageFile(instructions, program.instructionCount, program.dataMemory, disk, imageFilename);
+        return;
+    }
+    writeImemFile(instructions, program.instructionCount, imemFilename);
+    writeDmemFile(program.dataMemory, dmemFilename);
+}
+
+// -estimate: print the static cost estimate instead of writing the program
+void estimate(const char *inputFilename, int optimize) {
+    static Program program;
+    size_t size;
+    const char *source = loadProgram(inputFilename, &program, &size, optimize);
+
+    estimateProgram(&program, inputFilename);
+    free(program.fixups.fixups);
+    freeSymbols(&program.table);
+    unmapSource(source, size);
+}
+
+// Peephole optimizer (-O), run on the parsed program before encoding. Every instruction costs a cycle,
+// so it folds constants, threads branches to unconditional branches and drops redundant initializations,
+// branches that cannot matter and register writes overwritten before any read. It works inside basic
+// blocks, a label starts one since any label may be a jump target. Label references are all fixups
+// (the program is parsed relocatable), so the labels move with the code when instructions are removed.
+enum {
+    OP_ADD, OP_SUB, OP_MAC, OP_AND, OP_OR, OP_XOR, OP_SLL, OP_SRA, OP_SRL,
+    OP_BEQ, OP_BNE, OP_BLT, OP_BGT, OP_BLE, OP_BGE, OP_JAL, OP_LW, OP_SW, OP_RETI, OP_IN, OP_OUT, OP_HALT
+};
+
+#define REG_COUNT 16
+#define IRQHANDLER_REG 6
+#define THREAD_LIMIT 16 // unconditional branches followed from one branch
+
+enum { KEPT, REMOVED_REDUNDANT, REMOVED_DEAD, REMOVED_BRANCH };
+
+static int isAlu(int opcode) { return opcode >= OP_ADD && opcode <= OP_SRL; }
+static int isBranch(int opcode) { return opcode >= OP_BEQ && opcode <= OP_BGE; }
+static int isControl(int opcode) { return (opcode >= OP_BEQ && opcode <= OP_JAL) || opcode == OP_RETI || opcode == OP_HALT; }
+static int signExtend12(int value) { return (int)((unsigned)(value & 0xFFF) ^ 0x800) - 0x800; }
+static int fitsImmediate(int32_t value) { return value >= -2048 && value <= 2047; }
+
+// Registers read by an instruction, as a bit mask. Immediates and $zero count, the masks are and-ed out by the callers.
+static unsigned readMask(const Instruction *instr) {
+    unsigned rs = 1u << instr->rs, rt = 1u << instr->rt, rm = 1u << instr->rm;
+    switch (instr->opcode) {
+    case OP_SLL: case OP_SRA: case OP_SRL: case OP_IN: return rs | rt;
+    case OP_JAL: return rm;
+    case OP_SW: return rs | rt | rm | (1u << instr->rd);
+    case OP_RETI: case OP_HALT: return 0;
+    default: return rs | rt | rm;
+    }
+}
+
+// Register written, or 0 when none: $zero and the immediates are reloaded by every instruction
+static int writtenRegister(const Instruction *instr) {
+    if (!(isAlu(instr->opcode) || instr->opcode == OP_JAL || instr->opcode == OP_LW || instr->opcode == OP_IN)) return 0;
+    return instr->rd > 2 ? instr->rd : 0;
+}
+
+// Result of an ALU instruction as the simulator computes it, 0 if a shift is out of range
+static int evaluateAlu(int opcode, int32_t a, int32_t b, int32_t c, int32_t *result) {
+    switch (opcode) {
+    case OP_ADD: *result = (int32_t)((uint32_t)a + (uint32_t)b + (uint32_t)c); return 1;
+    case OP_SUB: *result = (int32_t)((uint32_t)a - (uint32_t)b - (uint32_t)c); return 1;
+    case OP_MAC: *result = (int32_t)((uint32_t)a * (uint32_t)b + (uint32_t)c); return 1;
+    case OP_AND: *result = a & b & c; return 1;
+    case OP_OR: *result = a | b | c; return 1;
+    case OP_XOR: *result = a ^ b ^ c; return 1;
+    }
+    if (b < 0 || b > 31) return 0;
+    *result = opcode == OP_SLL ? (int32_t)((uint32_t)a << b) : a >> b; // srl is arithmetic in the simulator too
+    return 1;
+}
+
+static int evaluateBranch(int opcode, int32_t a, int32_t b) {
+    switch (opcode) {
+    case OP_BEQ: return a == b;
+    case OP_BNE: return a != b;
+    case OP_BLT: return a < b;
+    case OP_BGT: return a > b;
+    case OP_BLE: return a <= b;
+    default: return a >= b;
+    }
+}
+
+// Rewrite instr as a constant load of value using the two immediates, 0 if value has no such form
+static int loadConstant(Instruction *instr, int32_t value) {
+    int rd = instr->rd;
+    memset(instr, 0, sizeof(*instr));
+    instr->rd = rd;
+    instr->rs = 1;
+    if (fitsImmediate(value)) {
+        instr->opcode = OP_ADD;
+        instr->imm1 = value;
+        return 1;
+    }
+    if (value >= -4096 && value <= 4094) {
+        instr->opcode = OP_ADD;
+        instr->rt = 2;
+        instr->imm1 = value < 0 ? -2048 : 2047;
+        instr->imm2 = value - instr->imm1;
+        return 1;
+    }
+    for (int shift = 1; shift < 32; shift++) {
+        if ((int32_t)((uint32_t)(value >> shift) << shift) == value && fitsImmediate(value >> shift)) {
+            instr->opcode = OP_SLL;
+            instr->rt = 2;
+            instr->imm1 = value >> shift;
+            instr->imm2 = shift;
+            return 1;
+        }
+    }
     return 0;
 }
 
-// Second pass: Process instructions and encode them
-void secondPass(const char *inputFilename, const char *imemFilename, const char *dmemFilename, Label labels[], int labelCount) {
-    FILE *inputFile = fopen(inputFilename, "r");
-    if (!inputFile) {
-        perror("Error opening input file");
+// Label target of a branch or jal through $imm1/$imm2, or -1 if it jumps through a register or to a number
+static int branchTarget(const Program *program, const int (*labelFixup)[2], int index) {
+    const Instruction *instr = &program->instructions[index];
+    if (!(isBranch(instr->opcode) || instr->opcode == OP_JAL) || instr->rm < 1 || instr->rm > 2) return -1;
+    int fixup = labelFixup[index][instr->rm - 1];
+    return fixup < 0 ? -1 : program->table.symbols[program->fixups.fixups[fixup].symbol].address;
+}
+
+void optimizeProgram(Program *program, const char *filename) {
+    static int labelFixup[MAX_INSTRUCTIONS][2]; // fixup of imm1/imm2, -1 if a number
+    static unsigned char leader[MAX_INSTRUCTIONS + 1], removed[MAX_INSTRUCTIONS]; // KEPT or why not
+    static int before[MAX_INSTRUCTIONS + 1];    // instructions kept below an address
+    Instruction *instructions = program->instructions;
+    int count = program->instructionCount, canRemove = 1, folded = 0, threaded = 0, i;
+    int reasons[4] = {0, 0, 0, 0};
+
+    memset(leader, 0, sizeof(leader));
+    memset(removed, 0, sizeof(removed));
+    for (i = 0; i < count; i++) labelFixup[i][0] = labelFixup[i][1] = -1;
+    for (i = 0; i < program->fixups.count; i++) {
+        const Fixup *fixup = &program->fixups.fixups[i];
+        if (fixup->kind != FIXUP_WORD) labelFixup[fixup->index][fixup->kind] = i;
+    }
+    for (i = 0; i < program->table.count; i++) {
+        if (program->table.symbols[i].address >= 0) leader[program->table.symbols[i].address] = 1;
+    }
+    leader[0] = 1;
+    for (i = 0; i < count; i++) {
+        const Instruction *instr = &instructions[i];
+        if (isControl(instr->opcode)) leader[i + 1] = 1;
+        // a code address given as a number would not follow the code, keep every instruction in place
+        if ((isBranch(instr->opcode) || instr->opcode == OP_JAL) && instr->rm >= 1 && instr->rm <= 2 && labelFixup[i][instr->rm - 1] < 0) canRemove = 0;
+        if (instr->opcode == OP_OUT && instr->rm >= 1 && instr->rm <= 2 && labelFixup[i][instr->rm - 1] < 0 &&
+            instr->rs <= 2 && instr->rt <= 2 && labelFixup[i][0] < 0 && labelFixup[i][1] < 0) {
+            int32_t value[3] = {0, signExtend12(instr->imm1), signExtend12(instr->imm2)};
+            if (value[instr->rs] + value[instr->rt] == IRQHANDLER_REG) canRemove = 0;
+        }
+    }
+
+    // Constant folding and redundant initializations, forward through each block
+    int known = 0; // bit mask of the registers holding a known value
+    int32_t value[REG_COUNT];
+    for (i = 0; i < count; i++) {
+        Instruction *instr = &instructions[i];
+        if (leader[i]) known = 1;
+        value[0] = 0;
+        value[1] = signExtend12(instr->imm1);
+        value[2] = signExtend12(instr->imm2);
+        known = (known & ~6) | (labelFixup[i][0] < 0 ? 2 : 0) | (labelFixup[i][1] < 0 ? 4 : 0);
+        unsigned reads = readMask(instr);
+        int allKnown = (reads & ~known) == 0;
+        int hasLabel = labelFixup[i][0] >= 0 || labelFixup[i][1] >= 0;
+
+        if (isAlu(instr->opcode) && instr->rd > 2) {
+            int32_t result;
+            if (!allKnown || !evaluateAlu(instr->opcode, value[instr->rs], value[instr->rt], value[instr->rm], &result)) {
+                known &= ~(1 << instr->rd);
+                continue;
+            }
+            if ((known >> instr->rd) & 1 && value[instr->rd] == result) {
+                if (canRemove) removed[i] = REMOVED_REDUNDANT;
+                continue;
+            }
+            // only worth it when a register operand goes away, which may leave its write dead
+            if ((reads & ~7u) && !hasLabel) {
+                Instruction constant = *instr;
+                if (loadConstant(&constant, result)) {
+                    *instr = constant;
+                    folded++;
+                }
+            }
+            known |= 1 << instr->rd;
+            value[instr->rd] = result;
+        } else if (isBranch(instr->opcode) && ((known >> instr->rs) & (known >> instr->rt) & 1) && branchTarget(program, labelFixup, i) >= 0) {
+            if (!evaluateBranch(instr->opcode, value[instr->rs], value[instr->rt])) {
+                if (canRemove) removed[i] = REMOVED_BRANCH;
+            } else if (instr->opcode != OP_BEQ || instr->rs != instr->rt) {
+                instr->opcode = OP_BEQ;
+                instr->rs = instr->rt = 0;
+                folded++;
+            }
+        } else if (writtenRegister(instr)) {
+            known &= ~(1 << writtenRegister(instr));
+        }
+    }
+
+    // Branch threading: a branch to an unconditional branch goes straight to its target
+    for (i = 0; i < count; i++) {
+        int target = branchTarget(program, labelFixup, i), steps = 0, symbol = -1;
+        if (target < 0 || removed[i]) continue;
+        while (steps++ < THREAD_LIMIT && target < count) {
+            const Instruction *jump = &instructions[target];
+            int next = branchTarget(program, labelFixup, target);
+            if (jump->opcode == OP_JAL || next < 0 || jump->rs != jump->rt ||
+                !(jump->opcode == OP_BEQ || jump->opcode == OP_BLE || jump->opcode == OP_BGE)) break;
+            if (next == i || next == target) break; // a branch to itself falls through
+            symbol = program->fixups.fixups[labelFixup[target][jump->rm - 1]].symbol;
+            target = next;
+        }
+        if (symbol >= 0) {
+            program->fixups.fixups[labelFixup[i][instructions[i].rm - 1]].symbol = symbol;
+            threaded++;
+        }
+        // a conditional branch to the next instruction does nothing
+        if (canRemove && isBranch(instructions[i].opcode) && target == i + 1) {
+            removed[i] = REMOVED_BRANCH;
+        }
+    }
+
+    // Dead writes, backward through each block: everything is live at the end of a block
+    unsigned live = ~0u;
+    for (i = count - 1; i >= 0 && canRemove; i--) {
+        const Instruction *instr = &instructions[i];
+        if (leader[i + 1]) live = ~0u;
+        if (removed[i]) continue;
+        int rd = writtenRegister(instr);
+        if (isAlu(instr->opcode) && rd && !((live >> rd) & 1)) {
+            removed[i] = REMOVED_DEAD;
+            continue;
+        }
+        if (rd) live &= ~(1u << rd);
+        live |= readMask(instr);
+    }
+
+    // Removing the whole body between a branch and its target would leave a branch to itself,
+    // which falls through in the simulator: keep the target instruction then
+    for (;;) {
+        int conflict = -1;
+        before[0] = 0;
+        for (i = 0; i < count; i++) before[i + 1] = before[i] + !removed[i];
+        for (i = 0; i < count && conflict < 0; i++) {
+            int target = branchTarget(program, labelFixup, i);
+            if (!removed[i] && target >= 0 && target != i && before[target] == before[i]) conflict = target;
+        }
+        if (conflict < 0) break;
+        removed[conflict] = KEPT;
+    }
+
+    // Move the code and the labels down over the removed instructions
+    int kept = 0;
+    for (i = 0; i < count; i++) {
+        reasons[removed[i]]++;
+        if (!removed[i]) instructions[kept++] = instructions[i];
+    }
+    for (i = 0; i < program->table.count; i++) {
+        Symbol *symbol = &program->table.symbols[i];
+        if (symbol->address >= 0 && symbol->address <= count) symbol->address = before[symbol->address];
+    }
+    int fixupCount = 0;
+    for (i = 0; i < program->fixups.count; i++) {
+        Fixup fixup = program->fixups.fixups[i];
+        if (fixup.kind != FIXUP_WORD) {
+            if (removed[fixup.index]) continue;
+            fixup.index = before[fixup.index];
+        }
+        program->fixups.fixups[fixupCount++] = fixup;
+    }
+    program->fixups.count = fixupCount;
+    program->instructionCount = kept;
+
+    printf("%s: optimizer saved %d of %d instructions (%d redundant initializations, %d dead writes, %d branches), "
+        "%d folded, %d threaded\n", filename, count - kept, count, reasons[REMOVED_REDUNDANT], reasons[REMOVED_DEAD], reasons[REMOVED_BRANCH], folded, threaded);
+    if (!canRemove) printf("%s: code addresses given as numbers, no instruction removed\n", filename);
+}
+
+// Static cost estimate (-estimate): a control-flow graph of basic blocks, split after branches, jal,
+// reti and halt and at branch targets. A function is the code reachable from address 0 or from a jal
+// target without following calls. Natural loops come from the back edges of the dominator tree and
+// get a trip count when their exit test compares an induction variable with a constant. Every block
+// costs its instructions, and a jal the cycles of the function it calls, once per iteration of each
+// enclosing loop; loops with an unknown trip count are counted once, so those estimates are minimums.
+#define DISKCMD_REG 14
+#define DISKSTATUS_REG 17
+#define DISK_CYCLES 1024   // a disk command keeps the disk busy this long (see sim.c)
+#define TRIP_LIMIT 1000000 // longer loops count as unknown
+
+typedef struct {
+    int start, end; // instructions [start, end)
+    int successors[2], successorCount;
+    int callee;     // function called by the jal ending the block, or -1
+} Block;
+
+typedef struct {
+    int entry;               // block
+    int *blocks, blockCount; // reachable from the entry, in reverse postorder
+    int *idom;               // immediate dominator, as a position in blocks
+    double *frequency;       // executions per call
+    unsigned writes;         // registers written, calls included
+    int state;               // 0 not estimated yet, 1 being estimated, 2 done
+    int inexact;             // an unknown trip count or a recursive call
+    double cycles, polling;  // per call, polling is the lower bound spent waiting on the disk
+} Function;
+
+typedef struct {
+    int function;
+    int header, latch;       // blocks, latch -1 if several back edges
+    int *blocks, blockCount;
+    long trips;              // -1 if unknown
+    int polls;               // reads diskstatus
+} Loop;
+
+typedef struct {
+    const Program *program;
+    Block *blocks;
+    int blockCount;
+    int *blockOf;            // instruction -> block
+    int *predecessors, *predecessorStart;
+    Function *functions;
+    int functionCount;
+    int *functionAt;         // block -> function entered there, or -1
+    Loop *loops;
+    int loopCount, loopCapacity;
+    int *position;           // block -> position in the function being analyzed, or -1
+    unsigned char *polling;  // instruction in a disk polling loop
+    int *waitDistance;       // most instructions from here to a polling loop, DISK_CYCLES if none
+} Cfg;
+
+static void *allocate(size_t count, size_t size) {
+    void *memory = calloc(count ? count : 1, size);
+    if (!memory) {
+        perror("Error allocating the control-flow graph");
         exit(1);
     }
+    return memory;
+}
+
+// Constant value of register reg as instr reads it, 0 if not a constant
+static int constantOperand(const Instruction *instr, int reg, int32_t *value) {
+    if (reg > 2) return 0;
+    *value = reg == 0 ? 0 : signExtend12(reg == 1 ? instr->imm1 : instr->imm2);
+    return 1;
+}
+
+// IO register addressed by an in or out through constants, or -1
+static int ioAddress(const Instruction *instr) {
+    int32_t a, b;
+    if (!constantOperand(instr, instr->rs, &a) || !constantOperand(instr, instr->rt, &b)) return -1;
+    return a + b;
+}
 
-    unsigned long long instructions[MAX_INSTRUCTIONS] = {0};
-    int dataMemory[MAX_DMEM_SIZE] = {0};
-    int instructionCount = 0;
+// Code address jumped to through a constant, or -1
+static int constantTarget(const Instruction *instr) {
+    int32_t target;
+    if (!constantOperand(instr, instr->rm, &target)) return -1;
+    return target & 0xFFF;
+}
+
+static void buildBlocks(Cfg *cfg) {
+    const Program *program = cfg->program;
+    const Instruction *instructions = program->instructions;
+    int count = program->instructionCount, i;
+    unsigned char *leader = allocate(count + 1, 1);
 
-    char line[MAX_LINE_LENGTH];
-    while (fgets(line, MAX_LINE_LENGTH, inputFile)) {
-        char *comment = strchr(line, '#');
-        if (comment) *comment = '\0';
+    leader[0] = 1;
+    for (i = 0; i < program->table.count; i++) {
+        int address = program->table.symbols[i].address;
+        if (address >= 0 && address < count) leader[address] = 1;
+    }
+    for (i = 0; i < count; i++) {
+        int target = constantTarget(&instructions[i]);
+        if (!isControl(instructions[i].opcode)) continue;
+        leader[i + 1] = 1;
+        if ((isBranch(instructions[i].opcode) || instructions[i].opcode == OP_JAL) && target >= 0 && target < count) leader[target] = 1;
+    }
 
-        if (strstr(line, ".word") != NULL) {
-            processWordDirective(line, dataMemory);
-            continue; // Skip processing as an instruction
+    cfg->blocks = allocate(count + 1, sizeof(Block));
+    cfg->blockOf = allocate(count + 1, sizeof(int));
+    for (i = 0; i < count; i++) {
+        if (leader[i]) {
+            cfg->blocks[cfg->blockCount].start = i;
+            cfg->blocks[cfg->blockCount++].callee = -1;
         }
+        cfg->blockOf[i] = cfg->blockCount - 1;
+        cfg->blocks[cfg->blockCount - 1].end = i + 1;
+    }
+    free(leader);
 
-        if (strchr(line, ':')) continue; // Skip label declarations
+    // Functions start at 0 and at the jal targets
+    cfg->functions = allocate(cfg->blockCount + 1, sizeof(Function));
+    cfg->functionAt = allocate(cfg->blockCount + 1, sizeof(int));
+    for (i = 0; i < cfg->blockCount; i++) cfg->functionAt[i] = -1;
+    for (i = -1; i < count; i++) {
+        int target = i < 0 ? 0 : constantTarget(&instructions[i]);
+        if (i >= 0 && instructions[i].opcode != OP_JAL) continue;
+        if (target < 0 || target >= count || cfg->functionAt[cfg->blockOf[target]] >= 0) continue;
+        cfg->functionAt[cfg->blockOf[target]] = cfg->functionCount;
+        cfg->functions[cfg->functionCount++].entry = cfg->blockOf[target];
+    }
 
-        Instruction instr = {0};
-        if (parseInstruction(line, &instr)) {
-            instructions[instructionCount++] = encodeInstruction(&instr, labels, labelCount);
+    // Edges, calls are not followed: a jal falls through to its return address
+    int edges = 0;
+    for (i = 0; i < cfg->blockCount; i++) {
+        Block *block = &cfg->blocks[i];
+        const Instruction *last = &instructions[block->end - 1];
+        int target = constantTarget(last), fallthrough = 1, taken = 0;
+        int32_t a, b;
+        if (isBranch(last->opcode) && target != block->end - 1) { // a branch to itself falls through
+            int always = 0, never = 0;
+            if (last->rs == last->rt) {
+                always = last->opcode == OP_BEQ || last->opcode == OP_BLE || last->opcode == OP_BGE;
+                never = !always;
+            } else if (constantOperand(last, last->rs, &a) && constantOperand(last, last->rt, &b)) {
+                always = evaluateBranch(last->opcode, a, b);
+                never = !always;
+            }
+            taken = target >= 0 && target < count && !never; // not through a register, that is a return
+            fallthrough = !always;
+        } else if (last->opcode == OP_JAL) {
+            if (target >= 0 && target < count) block->callee = cfg->functionAt[cfg->blockOf[target]];
+        } else if (last->opcode == OP_RETI || last->opcode == OP_HALT) {
+            fallthrough = 0;
+        }
+        if (taken) block->successors[block->successorCount++] = cfg->blockOf[target];
+        if (fallthrough && block->end < count && !(taken && cfg->blockOf[target] == i + 1)) block->successors[block->successorCount++] = i + 1;
+        edges += block->successorCount;
+    }
+    cfg->predecessorStart = allocate(cfg->blockCount + 1, sizeof(int));
+    cfg->predecessors = allocate(edges, sizeof(int));
+    for (i = 0; i < cfg->blockCount; i++) {
+        for (int j = 0; j < cfg->blocks[i].successorCount; j++) cfg->predecessorStart[cfg->blocks[i].successors[j] + 1]++;
+    }
+    for (i = 0; i < cfg->blockCount; i++) cfg->predecessorStart[i + 1] += cfg->predecessorStart[i];
+    int *fill = allocate(cfg->blockCount, sizeof(int));
+    for (i = 0; i < cfg->blockCount; i++) {
+        for (int j = 0; j < cfg->blocks[i].successorCount; j++) {
+            int successor = cfg->blocks[i].successors[j];
+            cfg->predecessors[cfg->predecessorStart[successor] + fill[successor]++] = i;
         }
     }
+    free(fill);
+}
 
-    fclose(inputFile);
+// Blocks reachable from the function entry, in reverse postorder, and the registers they write
+static void findFunctionBlocks(Cfg *cfg, Function *function) {
+    int *stack = allocate(cfg->blockCount, sizeof(int)), *next = allocate(cfg->blockCount, sizeof(int));
+    unsigned char *seen = allocate(cfg->blockCount, 1);
+    int depth = 0, count = 0;
 
-    writeImemFile(instructions, instructionCount, imemFilename);
-    writeDmemFile(dataMemory, dmemFilename);
+    function->blocks = allocate(cfg->blockCount, sizeof(int));
+    stack[depth++] = function->entry;
+    seen[function->entry] = 1;
+    while (depth) {
+        int b = stack[depth - 1];
+        if (next[b] < cfg->blocks[b].successorCount) {
+            int successor = cfg->blocks[b].successors[next[b]++];
+            if (!seen[successor]) {
+                seen[successor] = 1;
+                stack[depth++] = successor;
+            }
+            continue;
+        }
+        function->blocks[count++] = b;
+        depth--;
+    }
+    for (int i = 0; i < count / 2; i++) {
+        int b = function->blocks[i];
+        function->blocks[i] = function->blocks[count - 1 - i];
+        function->blocks[count - 1 - i] = b;
+    }
+    function->blockCount = count;
+    for (int i = 0; i < count; i++) {
+        const Block *block = &cfg->blocks[function->blocks[i]];
+        for (int j = block->start; j < block->end; j++) {
+            int rd = writtenRegister(&cfg->program->instructions[j]);
+            if (rd) function->writes |= 1u << rd;
+        }
+    }
+    free(stack);
+    free(next);
+    free(seen);
 }
 
-// Process `.word` directive
-void processWordDirective(char *line, int *dataMemory) {
-    char addressStr[50], valueStr[50];
-    int address, value;
+static void mapPositions(Cfg *cfg, const Function *function) {
+    for (int i = 0; i < cfg->blockCount; i++) cfg->position[i] = -1;
+    for (int i = 0; i < function->blockCount; i++) cfg->position[function->blocks[i]] = i;
+}
+
+// Does position a dominate position b
+static int dominates(const Function *function, int a, int b) {
+    while (b > a) b = function->idom[b];
+    return a == b;
+}
+
+// Cooper, Harvey and Kennedy: iterate over the reverse postorder until the dominators settle
+static void findDominators(Cfg *cfg, Function *function) {
+    int changed = 1;
+    function->idom = allocate(function->blockCount, sizeof(int));
+    for (int i = 0; i < function->blockCount; i++) function->idom[i] = -1;
+    function->idom[0] = 0;
+    while (changed) {
+        changed = 0;
+        for (int i = 1; i < function->blockCount; i++) {
+            int b = function->blocks[i], idom = -1;
+            for (int j = cfg->predecessorStart[b]; j < cfg->predecessorStart[b + 1]; j++) {
+                int p = cfg->position[cfg->predecessors[j]];
+                if (p < 0 || function->idom[p] < 0) continue;
+                if (idom < 0) {
+                    idom = p;
+                    continue;
+                }
+                while (idom != p) {
+                    while (idom > p) idom = function->idom[idom];
+                    while (p > idom) p = function->idom[p];
+                }
+            }
+            if (idom != function->idom[i]) {
+                function->idom[i] = idom;
+                changed = 1;
+            }
+        }
+    }
+}
 
-    while (isspace(*line)) line++; // Skip leading whitespace
-    if (strncmp(line, ".word", 5) == 0) {
-        line += 5; // Skip ".word"
-        while (isspace(*line)) line++;
+// Natural loops of a function: a back edge goes to a block that dominates its source
+static void findLoops(Cfg *cfg, int f) {
+    Function *function = &cfg->functions[f];
+    int *stack = allocate(cfg->blockCount, sizeof(int));
+    unsigned char *member = allocate(cfg->blockCount, 1);
 
-        if (sscanf(line, "%49s %49s", addressStr, valueStr) == 2) {
-            address = (int)strtol(addressStr, NULL, 0); // Supports hex and decimal
-            value = (int)strtol(valueStr, NULL, 0);
+    for (int i = 0; i < function->blockCount; i++) {
+        const Block *block = &cfg->blocks[function->blocks[i]];
+        for (int j = 0; j < block->successorCount; j++) {
+            int header = cfg->position[block->successors[j]];
+            if (!dominates(function, header, i)) continue;
 
-            if (address >= 0 && address < MAX_DMEM_SIZE) {
-                dataMemory[address] = value; // Store value in data memory
+            Loop *loop = NULL;
+            for (int k = 0; k < cfg->loopCount; k++) {
+                if (cfg->loops[k].function == f && cfg->loops[k].header == function->blocks[header]) loop = &cfg->loops[k];
+            }
+            if (loop) {
+                loop->latch = -1;
             } else {
-                fprintf(stderr, "Error: Address %d out of bounds for .word\n", address);
+                if (cfg->loopCount == cfg->loopCapacity) {
+                    cfg->loopCapacity = cfg->loopCapacity ? 2 * cfg->loopCapacity : 16;
+                    cfg->loops = realloc(cfg->loops, cfg->loopCapacity * sizeof(Loop));
+                    if (!cfg->loops) {
+                        perror("Error allocating the control-flow graph");
+                        exit(1);
+                    }
+                }
+                loop = &cfg->loops[cfg->loopCount++];
+                memset(loop, 0, sizeof(*loop));
+                loop->function = f;
+                loop->header = function->blocks[header];
+                loop->latch = function->blocks[i];
+                loop->trips = -1;
+                loop->blocks = allocate(function->blockCount, sizeof(int));
+                loop->blocks[loop->blockCount++] = loop->header;
+            }
+
+            // the body: everything reaching the back edge without going through the header
+            int depth = 0;
+            memset(member, 0, cfg->blockCount);
+            for (int k = 0; k < loop->blockCount; k++) member[loop->blocks[k]] = 1;
+            if (!member[function->blocks[i]]) {
+                member[function->blocks[i]] = 1;
+                stack[depth++] = function->blocks[i];
+            }
+            while (depth) {
+                int b = stack[--depth];
+                loop->blocks[loop->blockCount++] = b;
+                for (int k = cfg->predecessorStart[b]; k < cfg->predecessorStart[b + 1]; k++) {
+                    int p = cfg->predecessors[k];
+                    if (cfg->position[p] < 0 || member[p]) continue;
+                    member[p] = 1;
+                    stack[depth++] = p;
+                }
             }
-        } else {
-            fprintf(stderr, "Error: Invalid .word format: %s\n", line);
         }
-    } else {
-        fprintf(stderr, "Error: Line is not a valid .word directive: %s\n", line);
     }
+    free(stack);
+    free(member);
 }
 
-// Parse instruction into an `Instruction` struct
-int parseInstruction(char *line, Instruction *instr) {
-    while (isspace(*line)) line++;
+static int inLoop(const Loop *loop, int b) {
+    for (int i = 0; i < loop->blockCount; i++) {
+        if (loop->blocks[i] == b) return 1;
+    }
+    return 0;
+}
 
-    char *token = strtok(line, " ,");
-    if (!token) return 0;
-    strncpy(instr->opcode, token, sizeof(instr->opcode) - 1);
+// Value of reg at the end of a block, following the constants loaded in it
+static int valueAtEnd(const Cfg *cfg, int b, int reg, int32_t *result) {
+    int32_t value[REG_COUNT];
+    unsigned known = 1;
+    memset(value, 0, sizeof(value));
+    for (int i = cfg->blocks[b].start; i < cfg->blocks[b].end; i++) {
+        const Instruction *instr = &cfg->program->instructions[i];
+        int rd = writtenRegister(instr);
+        value[1] = signExtend12(instr->imm1);
+        value[2] = signExtend12(instr->imm2);
+        known |= 6;
+        if (!rd) continue;
+        if (isAlu(instr->opcode) && (readMask(instr) & ~known) == 0 &&
+            evaluateAlu(instr->opcode, value[instr->rs], value[instr->rt], value[instr->rm], &value[rd])) known |= 1u << rd;
+        else known &= ~(1u << rd);
+    }
+    *result = value[reg];
+    return (known >> reg) & 1;
+}
 
-    token = strtok(NULL, " ,");
-    if (token) strncpy(instr->rd, token, sizeof(instr->rd) - 1);
+// Trip count of a loop whose latch ends with the exit test, comparing a register stepped by a constant
+// once per iteration with a constant, starting from a constant loaded just before the loop
+static long tripCount(const Cfg *cfg, const Function *function, const Loop *loop) {
+    const Instruction *instructions = cfg->program->instructions;
+    if (loop->latch < 0) return -1;
+    const Block *latch = &cfg->blocks[loop->latch];
+    const Instruction *test = &instructions[latch->end - 1];
+    if (!isBranch(test->opcode) || latch->successorCount != 2) return -1;
+    int stayOnTaken = latch->successors[0] == loop->header, x, xFirst = 1;
+    int32_t limit, step = 0, start;
+    if (inLoop(loop, latch->successors[stayOnTaken])) return -1;
+    if (constantOperand(test, test->rt, &limit) && test->rs > 2) x = test->rs;
+    else if (constantOperand(test, test->rs, &limit) && test->rt > 2) x = test->rt, xFirst = 0;
+    else return -1;
 
-    token = strtok(NULL, " ,");
-    if (token) strncpy(instr->rs, token, sizeof(instr->rs) - 1);
+    // exactly one write of x in the loop, x += constant, in a block dominating the test
+    int writes = 0;
+    for (int i = 0; i < loop->blockCount; i++) {
+        const Block *block = &cfg->blocks[loop->blocks[i]];
+        if (block->callee >= 0 && (cfg->functions[block->callee].writes >> x) & 1) return -1;
+        for (int j = block->start; j < block->end; j++) {
+            const Instruction *instr = &instructions[j];
+            int32_t a, b;
+            if (writtenRegister(instr) != x) continue;
+            if (++writes > 1 || !dominates(function, cfg->position[loop->blocks[i]], cfg->position[loop->latch])) return -1;
+            if (instr->opcode == OP_SUB && instr->rs == x && constantOperand(instr, instr->rt, &a) && constantOperand(instr, instr->rm, &b)) {
+                step = -(a + b);
+            } else if (instr->opcode == OP_ADD) {
+                int operands[3] = {instr->rs, instr->rt, instr->rm}, uses = 0;
+                for (int k = 0; k < 3; k++) {
+                    if (operands[k] == x) uses++;
+                    else if (constantOperand(instr, operands[k], &a)) step += a;
+                    else return -1;
+                }
+                if (uses != 1) return -1;
+            } else {
+                return -1;
+            }
+        }
+    }
+    if (writes != 1 || step == 0) return -1;
 
-    token = strtok(NULL, " ,");
-    if (token) strncpy(instr->rt, token, sizeof(instr->rt) - 1);
+    // the one way in from outside the loop sets the start value
+    int preheader = -1;
+    for (int i = cfg->predecessorStart[loop->header]; i < cfg->predecessorStart[loop->header + 1]; i++) {
+        int p = cfg->predecessors[i];
+        if (cfg->position[p] < 0 || inLoop(loop, p)) continue;
+        if (preheader >= 0) return -1;
+        preheader = p;
+    }
+    if (preheader < 0 || !valueAtEnd(cfg, preheader, x, &start)) return -1;
 
-    token = strtok(NULL, " ,");
-    if (token) strncpy(instr->rm, token, sizeof(instr->rm) - 1);
+    long trips = 0;
+    int32_t value = start;
+    do {
+        value = (int32_t)((uint32_t)value + (uint32_t)step);
+        trips++;
+    } while ((xFirst ? evaluateBranch(test->opcode, value, limit) : evaluateBranch(test->opcode, limit, value)) == stayOnTaken &&
+        trips < TRIP_LIMIT);
+    return trips < TRIP_LIMIT ? trips : -1;
+}
 
-    token = strtok(NULL, " ,");
-    if (token) strncpy(instr->imm1, token, sizeof(instr->imm1) - 1);
+// Instructions in loops that read diskstatus poll the disk. From every instruction, the most instructions
+// that may run before reaching one of them (calls followed, returns and halts count as never), up to
+// DISK_CYCLES: a disk command issued just before waits at least the rest of DISK_CYCLES.
+static void findWaitDistances(Cfg *cfg) {
+    const Instruction *instructions = cfg->program->instructions;
+    int count = cfg->program->instructionCount, changed = 1;
 
-    token = strtok(NULL, " ,");
-    if (token) strncpy(instr->imm2, token, sizeof(instr->imm2) - 1);
+    cfg->polling = allocate(count, 1);
+    cfg->waitDistance = allocate(count + 1, sizeof(int));
+    for (int i = 0; i < cfg->loopCount; i++) {
+        Loop *loop = &cfg->loops[i];
+        for (int j = 0; j < loop->blockCount; j++) {
+            const Block *block = &cfg->blocks[loop->blocks[j]];
+            for (int k = block->start; k < block->end; k++) {
+                if (instructions[k].opcode == OP_IN && ioAddress(&instructions[k]) == DISKSTATUS_REG) loop->polls = 1;
+            }
+        }
+        for (int j = 0; j < loop->blockCount && loop->polls; j++) {
+            const Block *block = &cfg->blocks[loop->blocks[j]];
+            memset(cfg->polling + block->start, 1, block->end - block->start);
+        }
+    }
+    cfg->waitDistance[count] = DISK_CYCLES;
+    while (changed) {
+        changed = 0;
+        for (int i = count - 1; i >= 0; i--) {
+            const Block *block = &cfg->blocks[cfg->blockOf[i]];
+            int distance = 0;
+            if (cfg->polling[i]) {
+                distance = 0;
+            } else if (i < block->end - 1) {
+                distance = cfg->waitDistance[i + 1];
+            } else if (instructions[i].opcode == OP_JAL && constantTarget(&instructions[i]) >= 0 && constantTarget(&instructions[i]) < count) {
+                distance = cfg->waitDistance[constantTarget(&instructions[i])];
+            } else if (block->successorCount == 0) {
+                distance = DISK_CYCLES;
+            } else {
+                for (int j = 0; j < block->successorCount; j++) {
+                    int next = cfg->blocks[block->successors[j]].start;
+                    if (cfg->waitDistance[next] > distance) distance = cfg->waitDistance[next];
+                }
+            }
+            if (!cfg->polling[i]) distance = distance + 1 < DISK_CYCLES ? distance + 1 : DISK_CYCLES;
+            if (distance != cfg->waitDistance[i]) {
+                cfg->waitDistance[i] = distance;
+                changed = 1;
+            }
+        }
+    }
+}
 
-    return 1;
+static double blockCycles(const Cfg *cfg, int b) {
+    const Block *block = &cfg->blocks[b];
+    const Function *callee = block->callee >= 0 ? &cfg->functions[block->callee] : NULL;
+    return block->end - block->start + (callee && callee->state == 2 ? callee->cycles : 0); // a recursive call counts 0
+}
+
+// Cycles per call of a function and its callees, and the disk polling they can't avoid
+static void estimateFunction(Cfg *cfg, int f) {
+    Function *function = &cfg->functions[f];
+    if (function->state == 1) {
+        function->inexact = 1; // recursion: the inner calls are not counted
+        return;
+    }
+    if (function->state == 2) return;
+    function->state = 1;
+    for (int i = 0; i < function->blockCount; i++) {
+        int callee = cfg->blocks[function->blocks[i]].callee;
+        if (callee < 0) continue;
+        estimateFunction(cfg, callee);
+        if (cfg->functions[callee].inexact) function->inexact = 1;
+    }
+    for (int i = 0; i < function->blockCount; i++) {
+        int b = function->blocks[i];
+        const Block *block = &cfg->blocks[b];
+        double polling = block->callee >= 0 ? cfg->functions[block->callee].polling : 0;
+        for (int j = block->start; j < block->end; j++) {
+            const Instruction *instr = &cfg->program->instructions[j];
+            if (instr->opcode == OP_OUT && ioAddress(instr) == DISKCMD_REG) polling += DISK_CYCLES - cfg->waitDistance[j + 1];
+        }
+        function->cycles += function->frequency[i] * blockCycles(cfg, b);
+        function->polling += function->frequency[i] * polling;
+    }
+    function->state = 2;
+}
+
+static const char *addressName(const Program *program, int address, char *buffer) {
+    for (int i = 0; i < program->table.count; i++) {
+        const Symbol *symbol = &program->table.symbols[i];
+        if (symbol->address == address) {
+            snprintf(buffer, 64, "%.*s", symbol->length > 48 ? 48 : symbol->length, symbol->name);
+            return buffer;
+        }
+    }
+    snprintf(buffer, 64, "at %d", address);
+    return buffer;
+}
+
+void estimateProgram(const Program *program, const char *filename) {
+    Cfg cfg;
+    int f, i;
+    char name[64];
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.program = program;
+    if (program->instructionCount == 0) {
+        printf("%s: no instructions\n", filename);
+        return;
+    }
+    buildBlocks(&cfg);
+    cfg.position = allocate(cfg.blockCount, sizeof(int));
+    for (f = 0; f < cfg.functionCount; f++) findFunctionBlocks(&cfg, &cfg.functions[f]);
+    for (int changed = 1; changed;) {
+        changed = 0;
+        for (f = 0; f < cfg.functionCount; f++) {
+            Function *function = &cfg.functions[f];
+            unsigned writes = function->writes;
+            for (i = 0; i < function->blockCount; i++) {
+                int callee = cfg.blocks[function->blocks[i]].callee;
+                if (callee >= 0) writes |= cfg.functions[callee].writes;
+            }
+            changed |= writes != function->writes;
+            function->writes = writes;
+        }
+    }
+
+    // Dominators, loops, trip counts and block frequencies, one function at a time
+    for (f = 0; f < cfg.functionCount; f++) {
+        Function *function = &cfg.functions[f];
+        int first = cfg.loopCount;
+        mapPositions(&cfg, function);
+        findDominators(&cfg, function);
+        findLoops(&cfg, f);
+        function->frequency = allocate(function->blockCount, sizeof(double));
+        for (i = 0; i < function->blockCount; i++) function->frequency[i] = 1;
+        for (i = first; i < cfg.loopCount; i++) {
+            Loop *loop = &cfg.loops[i];
+            loop->trips = tripCount(&cfg, function, loop);
+            if (loop->trips < 0) function->inexact = 1;
+            for (int j = 0; j < loop->blockCount; j++) function->frequency[cfg.position[loop->blocks[j]]] *= loop->trips > 0 ? loop->trips : 1;
+        }
+    }
+    findWaitDistances(&cfg);
+    for (f = 0; f < cfg.functionCount; f++) estimateFunction(&cfg, f);
+
+    printf("%s: %d instructions, %d basic blocks, %d functions, %d loops\n",
+        filename, program->instructionCount, cfg.blockCount, cfg.functionCount, cfg.loopCount);
+    for (f = 0; f < cfg.functionCount; f++) {
+        const Function *function = &cfg.functions[f];
+        printf("function %s: %s%.0f cycles per call", addressName(program, cfg.blocks[function->entry].start, name),
+            function->inexact ? "at least " : "", function->cycles);
+        if (function->polling > 0) printf(", and at least %.0f polling the disk", function->polling);
+        printf("\n");
+
+        mapPositions(&cfg, function);
+        for (i = 0; i < cfg.loopCount; i++) {
+            const Loop *loop = &cfg.loops[i];
+            int first = program->instructionCount, last = 0;
+            double iteration = 0, entries;
+            if (loop->function != f) continue;
+            entries = function->frequency[cfg.position[loop->header]] / (loop->trips > 0 ? loop->trips : 1);
+            for (int j = 0; j < loop->blockCount; j++) {
+                const Block *block = &cfg.blocks[loop->blocks[j]];
+                if (block->start < first) first = block->start;
+                if (block->end - 1 > last) last = block->end - 1;
+                iteration += function->frequency[cfg.position[loop->blocks[j]]] / entries * blockCycles(&cfg, loop->blocks[j]);
+            }
+            if (loop->trips > 0) iteration /= loop->trips;
+            printf("    loop %s (%d-%d): ", addressName(program, cfg.blocks[loop->header].start, name), first, last);
+            if (loop->trips > 0) printf("%ld iterations of %.0f cycles, %.0f cycles", loop->trips, iteration, iteration * loop->trips);
+            else printf("unknown trip count, %.0f cycles per iteration", iteration);
+            printf("%s\n", loop->polls ? ", polls the disk" : "");
+        }
+    }
+    const Function *entry = &cfg.functions[0];
+    printf("program: %s%.0f cycles", entry->inexact ? "at least " : "", entry->cycles + entry->polling);
+    if (entry->polling > 0) printf(", of which at least %.0f waiting on the disk", entry->polling);
+    printf("\n");
+
+    for (f = 0; f < cfg.functionCount; f++) {
+        free(cfg.functions[f].blocks);
+        free(cfg.functions[f].idom);
+        free(cfg.functions[f].frequency);
+    }
+    for (i = 0; i < cfg.loopCount; i++) free(cfg.loops[i].blocks);
+    free(cfg.loops);
+    free(cfg.functions);
+    free(cfg.functionAt);
+    free(cfg.blocks);
+    free(cfg.blockOf);
+    free(cfg.predecessors);
+    free(cfg.predecessorStart);
+    free(cfg.position);
+    free(cfg.polling);
+    free(cfg.waitDistance);
+}
+
+// Process `.word` directive, the value may be a label
+void processWordDirective(Lexer *lexer, Program *program) {
+    Token addressToken, valueToken;
+    int address, value;
+
+    const char *at = lexer->cursor;
+    if (!nextToken(lexer, &addressToken) || !nextToken(lexer, &valueToken) || !parseNumber(&addressToken, 1, &address) ||
+        (!parseNumber(&valueToken, 1, &value) && (isdigit((unsigned char)valueToken.start[0]) || valueToken.start[0] == '-' || valueToken.start[0] == '+'))) {
+        lexError(lexer, at, "Invalid .word format");
+        while (lexer->cursor < lexer->end && *lexer->cursor != '\n') lexer->cursor++; // skip the rest of the line
+        return;
+    }
+
+    if (address >= 0 && address < MAX_DMEM_SIZE) {
+        program->dataMemory[address] = resolveImmediate(lexer, &valueToken, program, FIXUP_WORD, address); // Store value in data memory
+        program->dataSet[address] = 1;
+    } else {
+        lexError(lexer, addressToken.start, "Address %d out of bounds for .word", address);
+    }
+}
+
+// `.global` directive: the labels are visible to the other objects of a link
+void processGlobalDirective(Lexer *lexer, Program *program) {
+    Token name;
+    while (nextToken(lexer, &name)) {
+        int symbol = findSymbol(&program->table, name.start, name.length, 1);
+        program->table.symbols[symbol].global = 1;
+    }
+}
+
+// Parse the operands of an instruction, resolving registers and immediates
+void parseInstruction(Lexer *lexer, const Token *mnemonic, Program *program, int index) {
+    Instruction *instr = &program->instructions[index];
+    int *registers[4] = {&instr->rd, &instr->rs, &instr->rt, &instr->rm};
+    Token token;
+
+    instr->opcode = getOpcode(mnemonic);
+    if (instr->opcode < 0) {
+        lexError(lexer, mnemonic->start, "Invalid opcode '%.*s'", mnemonic->length, mnemonic->start);
+        exit(1);
+    }
+
+    for (int i = 0; i < 4; i++) {
+        if (!nextToken(lexer, &token)) {
+            lexError(lexer, lexer->cursor, "Invalid register ''");
+            exit(1);
+        }
+        *registers[i] = getRegister(&token);
+        if (*registers[i] < 0) {
+            lexError(lexer, token.start, "Invalid register '%.*s'", token.length, token.start);
+            exit(1);
+        }
+    }
+
+    // Missing immediates are 0
+    instr->imm1 = nextToken(lexer, &token) ? resolveImmediate(lexer, &token, program, FIXUP_IMM1, index) : 0;
+    instr->imm2 = nextToken(lexer, &token) ? resolveImmediate(lexer, &token, program, FIXUP_IMM2, index) : 0;
 }
 
 // Encode instruction
-unsigned long long encodeInstruction(const Instruction *instr, Label labels[], int labelCount) {
-    int opcodeBin = getOpcode(instr->opcode);
-    int rdBin = getRegister(instr->rd);
-    int rsBin = getRegister(instr->rs);
-    int rtBin = getRegister(instr->rt);
-    int rmBin = getRegister(instr->rm);
-
-    int imm1 = resolveImmediate(instr->imm1, labels, labelCount);
-    int imm2 = resolveImmediate(instr->imm2, labels, labelCount);
-
-    return ((unsigned long long)opcodeBin << 40) |
-           ((unsigned long long)rdBin << 36) |
-           ((unsigned long long)rsBin << 32) |
-           ((unsigned long long)rtBin << 28) |
-           ((unsigned long long)rmBin << 24) |
-           ((unsigned long long)(imm1 & 0xFFF) << 12) |
-           (unsigned long long)(imm2 & 0xFFF);
-}
-
-// Resolve immediate value
-int resolveImmediate(const char *imm, Label labels[], int labelCount) {
-    if (!imm || strlen(imm) == 0) return 0;
-
-    char trimmedImm[50];
-    strncpy(trimmedImm, imm, sizeof(trimmedImm) - 1);
-    trimmedImm[sizeof(trimmedImm) - 1] = '\0';
-
-    // Remove leading and trailing spaces
-    char *start = trimmedImm;
-    while (isspace(*start)) start++;
-    char *end = start + strlen(start) - 1;
-    while (end > start && isspace(*end)) *end-- = '\0';
+unsigned long long encodeInstruction(const Instruction *instr) {
+    return ((unsigned long long)instr->opcode << 40) |
+           ((unsigned long long)instr->rd << 36) |
+           ((unsigned long long)instr->rs << 32) |
+           ((unsigned long long)instr->rt << 28) |
+           ((unsigned long long)instr->rm << 24) |
+           ((unsigned long long)(instr->imm1 & 0xFFF) << 12) |
+           (unsigned long long)(instr->imm2 & 0xFFF);
+}
+
+void encodeProgram(const Program *program, unsigned long long *instructions) {
+    for (int i = 0; i < program->instructionCount; i++) {
+        instructions[i] = encodeInstruction(&program->instructions[i]);
+    }
+}
+
+// Resolve immediate value. A label not defined yet is 0 until backpatch() or the linker.
+int resolveImmediate(Lexer *lexer, const Token *imm, Program *program, int kind, int index) {
+    int value;
 
     // If the immediate is a number (hex or decimal)
-    if (isdigit(start[0]) || start[0] == '-' || start[0] == '+') {
-        if (strncmp(start, "0x", 2) == 0 || strncmp(start, "0X", 2) == 0) {
-            return (int)strtol(start, NULL, 16); // Hexadecimal
+    if (isdigit((unsigned char)imm->start[0]) || imm->start[0] == '-' || imm->start[0] == '+') {
+        if (!parseNumber(imm, 0, &value)) {
+            lexError(lexer, imm->start, "Invalid immediate '%.*s'", imm->length, imm->start);
+            exit(1);
+        }
+        return value;
+    }
+
+    // If the immediate is a label, resolve it, or leave it to backpatch()
+    int symbol = findSymbol(&program->table, imm->start, imm->length, 1);
+    if (program->table.symbols[symbol].address != -1 && !program->relocatable) return program->table.symbols[symbol].address;
+    addFixup(&program->fixups, lexer, imm, kind, index, symbol);
+    return 0;
+}
+
+// Write a relocatable object: code and .word data as assembled, label references as fixups
+void writeObjectFile(const Program *program, const char *filename) {
+    static unsigned long long instructions[MAX_INSTRUCTIONS];
+    ObjectHeader header;
+    uint32_t stringSize = 0;
+    int i;
+
+    encodeProgram(program, instructions);
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, OBJECT_MAGIC, 4);
+    header.version = OBJECT_VERSION;
+    header.codeCount = program->instructionCount;
+    for (i = 0; i < MAX_DMEM_SIZE; i++) header.dataCount += program->dataSet[i];
+    header.symbolCount = program->table.count;
+    header.fixupCount = program->fixups.count;
+    for (i = 0; i < program->table.count; i++) header.stringSize += program->table.symbols[i].length;
+
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        perror("Error opening object file");
+        exit(1);
+    }
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(instructions, sizeof(unsigned long long), program->instructionCount, file);
+    for (i = 0; i < MAX_DMEM_SIZE; i++) {
+        if (program->dataSet[i]) {
+            ObjectData data = {(uint32_t)i, program->dataMemory[i]};
+            fwrite(&data, sizeof(data), 1, file);
+        }
+    }
+    for (i = 0; i < program->table.count; i++) {
+        const Symbol *symbol = &program->table.symbols[i];
+        ObjectSymbol entry = {stringSize, (uint32_t)symbol->length, symbol->address, (uint32_t)symbol->global};
+        fwrite(&entry, sizeof(entry), 1, file);
+        stringSize += symbol->length;
+    }
+    for (i = 0; i < program->fixups.count; i++) {
+        const Fixup *fixup = &program->fixups.fixups[i];
+        ObjectFixup entry = {(uint32_t)fixup->kind, (uint32_t)fixup->index, (uint32_t)fixup->symbol};
+        fwrite(&entry, sizeof(entry), 1, file);
+    }
+    for (i = 0; i < program->table.count; i++) {
+        fwrite(program->table.symbols[i].name, 1, program->table.symbols[i].length, file);
+    }
+    if (ferror(file) || fclose(file) != 0) {
+        perror("Error writing object file");
+        exit(1);
+    }
+}
+
+// Place the objects one after the other in imem, in command line order, merge their dmem words,
+// resolve the fixups against their own labels or the .global labels of all objects
+void linkObjects(char **objectFilenames, int objectCount, const char *imemFilename, const char *dmemFilename, const char *imageFilename) {
+    static unsigned long long instructions[MAX_INSTRUCTIONS];
+    static int dataMemory[MAX_DMEM_SIZE];
+    static unsigned char dataSet[MAX_DMEM_SIZE];
+    const char **objects = calloc(objectCount, sizeof(char *));
+    size_t *sizes = calloc(objectCount, sizeof(size_t));
+    int *bases = calloc(objectCount, sizeof(int));
+    SymbolTable globals = {0};
+    int instructionCount = 0, i, j;
+
+    if (!objects || !sizes || !bases) {
+        perror("Error allocating objects");
+        exit(1);
+    }
+    initSymbols(&globals);
+
+    // Check the objects, place their code and collect the globals
+    for (i = 0; i < objectCount; i++) {
+        ObjectHeader header;
+        objects[i] = mapSource(objectFilenames[i], &sizes[i]);
+        if (sizes[i] >= sizeof(header)) memcpy(&header, objects[i], sizeof(header));
+        if (sizes[i] < sizeof(header) || memcmp(header.magic, OBJECT_MAGIC, 4) != 0 || header.version != OBJECT_VERSION ||
+            sizes[i] != sizeof(header) + (size_t)header.codeCount * sizeof(unsigned long long) + (size_t)header.dataCount * sizeof(ObjectData) +
+            (size_t)header.symbolCount * sizeof(ObjectSymbol) + (size_t)header.fixupCount * sizeof(ObjectFixup) + header.stringSize) {
+            fprintf(stderr, "Error: %s is not an object file\n", objectFilenames[i]);
+            exit(1);
+        }
+        if (header.codeCount > (uint32_t)(MAX_INSTRUCTIONS - instructionCount)) {
+            fprintf(stderr, "Error: Too many instructions in %s\n", objectFilenames[i]);
+            exit(1);
+        }
+        bases[i] = instructionCount;
+        memcpy(&instructions[instructionCount], objects[i] + sizeof(header), header.codeCount * sizeof(unsigned long long));
+        instructionCount += header.codeCount;
+
+        const char *data = objects[i] + sizeof(header) + header.codeCount * sizeof(unsigned long long);
+        const char *symbols = data + header.dataCount * sizeof(ObjectData);
+        const char *strings = symbols + header.symbolCount * sizeof(ObjectSymbol) + header.fixupCount * sizeof(ObjectFixup);
+        for (j = 0; j < (int)header.dataCount; j++) {
+            ObjectData entry;
+            memcpy(&entry, data + j * sizeof(entry), sizeof(entry));
+            if (entry.address >= MAX_DMEM_SIZE || (dataSet[entry.address] && dataMemory[entry.address] != entry.value)) {
+                fprintf(stderr, "Error: Conflicting .word at address %u in %s\n", entry.address, objectFilenames[i]);
+                exit(1);
+            }
+            dataMemory[entry.address] = entry.value;
+            dataSet[entry.address] = 1;
+        }
+        for (j = 0; j < (int)header.symbolCount; j++) {
+            ObjectSymbol entry;
+            memcpy(&entry, symbols + j * sizeof(entry), sizeof(entry));
+            if (!entry.global || entry.address == -1) continue;
+            if (entry.nameOffset + (size_t)entry.nameLength > header.stringSize) {
+                fprintf(stderr, "Error: %s is not an object file\n", objectFilenames[i]);
+                exit(1);
+            }
+            int index = findSymbol(&globals, strings + entry.nameOffset, entry.nameLength, 1);
+            if (globals.symbols[index].address != -1) {
+                fprintf(stderr, "Error: Duplicate global label '%.*s' in %s\n", (int)entry.nameLength, strings + entry.nameOffset, objectFilenames[i]);
+                exit(1);
+            }
+            globals.symbols[index].address = bases[i] + entry.address;
         }
-        return atoi(start); // Decimal
     }
 
-    // If the immediate is a label, resolve it
-    for (int i = 0; i < labelCount; i++) {
-        if (strcmp(labels[i].label, start) == 0) {
-            return labels[i].address;
+    // Patch the label references
+    for (i = 0; i < objectCount; i++) {
+        ObjectHeader header;
+        memcpy(&header, objects[i], sizeof(header));
+        const char *symbols = objects[i] + sizeof(header) + header.codeCount * sizeof(unsigned long long) + header.dataCount * sizeof(ObjectData);
+        const char *fixups = symbols + header.symbolCount * sizeof(ObjectSymbol);
+        const char *strings = fixups + header.fixupCount * sizeof(ObjectFixup);
+
+        for (j = 0; j < (int)header.fixupCount; j++) {
+            ObjectFixup fixup;
+            ObjectSymbol symbol;
+            int address;
+            memcpy(&fixup, fixups + j * sizeof(fixup), sizeof(fixup));
+            if (fixup.symbol >= header.symbolCount ||
+                fixup.index >= (fixup.kind == FIXUP_WORD ? (uint32_t)MAX_DMEM_SIZE : header.codeCount)) {
+                fprintf(stderr, "Error: %s is not an object file\n", objectFilenames[i]);
+                exit(1);
+            }
+            memcpy(&symbol, symbols + fixup.symbol * sizeof(symbol), sizeof(symbol));
+            if (symbol.nameOffset + (size_t)symbol.nameLength > header.stringSize) {
+                fprintf(stderr, "Error: %s is not an object file\n", objectFilenames[i]);
+                exit(1);
+            }
+            if (symbol.address != -1) {
+                address = bases[i] + symbol.address;
+            } else {
+                int index = findSymbol(&globals, strings + symbol.nameOffset, symbol.nameLength, 0);
+                if (index == -1) {
+                    fprintf(stderr, "Error: Undefined immediate or label '%.*s' in %s\n",
+                        (int)symbol.nameLength, strings + symbol.nameOffset, objectFilenames[i]);
+                    exit(1);
+                }
+                address = globals.symbols[index].address;
+            }
+            if (fixup.kind == FIXUP_WORD) dataMemory[fixup.index] = address;
+            else instructions[bases[i] + fixup.index] |= (unsigned long long)(address & 0xFFF) << (fixup.kind == FIXUP_IMM1 ? 12 : 0);
         }
     }
 
-    fprintf(stderr, "Error: Undefined immediate or label '%s'\n", start);
-    exit(1);
+    if (imageFilename) {
+        static uint32_t disk[DISK_SIZE * SECTOR_SIZE];
+        writeImageFile(instructions, instructionCount, dataMemory, disk, imageFilename);
+    } else {
+        writeImemFile(instructions, instructionCount, imemFilename);
+        writeDmemFile(dataMemory, dmemFilename);
+    }
+
+    freeSymbols(&globals);
+    for (i = 0; i < objectCount; i++) unmapSource(objects[i], sizes[i]);
+    free(objects);
+    free(sizes);
+    free(bases);
 }
 
 
@@ -255,82 +1686,153 @@ void writeDmemFile(const int *dataMemory, const char *filename) {
     fclose(file);
 }
 
-// Helper functions for registers and opcodes
-int getRegister(const char *reg) {
-    if (strcmp(reg, "$zero") == 0) return 0;
-    if (strcmp(reg, "$imm1") == 0) return 1;
-    if (strcmp(reg, "$imm2") == 0) return 2;
-    if (strcmp(reg, "$v0") == 0) return 3;
-    if (strcmp(reg, "$a0") == 0) return 4;
-    if (strcmp(reg, "$a1") == 0) return 5;
-    if (strcmp(reg, "$a2") == 0) return 6;
-    if (strcmp(reg, "$t0") == 0) return 7;
-    if (strcmp(reg, "$t1") == 0) return 8;
-    if (strcmp(reg, "$t2") == 0) return 9;
-    if (strcmp(reg, "$s0") == 0) return 10;
-    if (strcmp(reg, "$s1") == 0) return 11;
-    if (strcmp(reg, "$s2") == 0) return 12;
-    if (strcmp(reg, "$gp") == 0) return 13;
-    if (strcmp(reg, "$sp") == 0) return 14;
-    if (strcmp(reg, "$ra") == 0) return 15;
-    fprintf(stderr, "Error: Invalid register '%s'\n", reg);
-    exit(1);
-}
-
-int getOpcode(const char *mnemonic) {
-    if (strcmp(mnemonic, "add") == 0) return 0;
-    if (strcmp(mnemonic, "sub") == 0) return 1;
-    if (strcmp(mnemonic, "mac") == 0) return 2;
-    if (strcmp(mnemonic, "and") == 0) return 3;
-    if (strcmp(mnemonic, "or") == 0) return 4;
-    if (strcmp(mnemonic, "xor") == 0) return 5;
-    if (strcmp(mnemonic, "sll") == 0) return 6;
-    if (strcmp(mnemonic, "sra") == 0) return 7;
-    if (strcmp(mnemonic, "srl") == 0) return 8;
-    if (strcmp(mnemonic, "beq") == 0) return 9;
-    if (strcmp(mnemonic, "bne") == 0) return 10;
-    if (strcmp(mnemonic, "blt") == 0) return 11;
-    if (strcmp(mnemonic, "bgt") == 0) return 12;
-    if (strcmp(mnemonic, "ble") == 0) return 13;
-    if (strcmp(mnemonic, "bge") == 0) return 14;
-    if (strcmp(mnemonic, "jal") == 0) return 15;
-    if (strcmp(mnemonic, "lw") == 0) return 16;
-    if (strcmp(mnemonic, "sw") == 0) return 17;
-    if (strcmp(mnemonic, "reti") == 0) return 18;
-    if (strcmp(mnemonic, "in") == 0) return 19;
-    if (strcmp(mnemonic, "out") == 0) return 20;
-    if (strcmp(mnemonic, "halt") == 0) return 21;
-    fprintf(stderr, "Error: Invalid opcode '%s'\n", mnemonic);
-    exit(1);
+void imageAppend(ImageBuffer *image, const void *data, size_t size) {
+    if (image->size + size > image->capacity) {
+        image->capacity = 2 * (image->size + size);
+        image->data = realloc(image->data, image->capacity);
+        if (!image->data) {
+            perror("Error allocating image");
+            exit(1);
+        }
+    }
+    memcpy(image->data + image->size, data, size);
+    image->size += size;
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s <input.asm> <imemin.txt> <dmemin.txt>\n", argv[0]);
-        return 1;
+// One section per run of non-zero words
+void imageAddSections(ImageBuffer *image, uint32_t type, const void *words, int wordSize, int count) {
+    static const unsigned char zero[8] = {0};
+    const unsigned char *bytes = words;
+    int i = 0;
+
+    while (i < count) {
+        if (memcmp(bytes + (size_t)i * wordSize, zero, wordSize) == 0) {
+            i++;
+            continue;
+        }
+        int end = i + 1, last = i; // last non-zero word
+        while (end < count && end - last <= IMAGE_GAP) {
+            if (memcmp(bytes + (size_t)end * wordSize, zero, wordSize) != 0) last = end;
+            end++;
+        }
+        ImageSection section = {type, (uint32_t)i, (uint32_t)(last + 1 - i), 0};
+        imageAppend(image, &section, sizeof(section));
+        imageAppend(image, bytes + (size_t)i * wordSize, (size_t)section.count * wordSize);
+        image->sectionCount++;
+        i = last + 1;
     }
+}
 
-    const char *inputFilename = argv[1];
-    const char *imemFilename = argv[2];
-    const char *dmemFilename = argv[3];
+// Write the binary image, only the non-empty ranges of imem, dmem and disk
+void writeImageFile(const unsigned long long *instructions, int instructionCount, const int *dataMemory, const uint32_t *disk, const char *filename) {
+    ImageBuffer image = {0};
+    ImageHeader header;
 
-    Label labels[MAX_LABEL_COUNT];
-    int labelCount = 0;
+    // image words are little-endian, like the host
+    imageAddSections(&image, IMAGE_IMEM, instructions, sizeof(unsigned long long), instructionCount);
+    imageAddSections(&image, IMAGE_DMEM, dataMemory, sizeof(int), MAX_DMEM_SIZE);
+    imageAddSections(&image, IMAGE_DISK, disk, sizeof(uint32_t), DISK_SIZE * SECTOR_SIZE);
 
-    FILE *inputFile = fopen(inputFilename, "r");
-    if (!inputFile) {
-        perror("Error opening input file");
-        return 1;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IMAGE_MAGIC, 4);
+    header.version = IMAGE_VERSION;
+    header.sectionCount = (uint16_t)image.sectionCount;
+    header.checksum = hashName((const char *)image.data, (int)image.size); // FNV-1a
+    header.size = (uint32_t)(sizeof(header) + image.size);
+
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        perror("Error opening image file");
+        exit(1);
     }
+    if (fwrite(&header, sizeof(header), 1, file) != 1 || (image.size && fwrite(image.data, image.size, 1, file) != 1)) {
+        perror("Error writing image file");
+        exit(1);
+    }
+    fclose(file);
+    free(image.data);
+}
 
-    if (readLabels(inputFile, labels, &labelCount) != 0) {
-        fprintf(stderr, "Error processing labels in first pass.\n");
-        fclose(inputFile);
-        return 1;
+// Read a diskin.txt style file, one hex word per line
+void readDiskFile(uint32_t *disk, const char *filename) {
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        perror("Error opening disk file");
+        exit(1);
     }
-    fclose(inputFile);
+    for (int i = 0; i < DISK_SIZE * SECTOR_SIZE && fscanf(file, "%X", &disk[i]) == 1; i++)
+        ;
+    fclose(file);
+}
+
+// Helper functions for registers and opcodes: one probe of the perfect hash table, -1 if not found
+static unsigned int opcodeSlot(const char *s, int length) {
+    uint32_t key = (unsigned char)s[0] | (unsigned char)s[1] << 8 | (uint32_t)(unsigned char)s[length - 1] << 16;
+    return (key * 0x5af25c11u) >> 27;
+}
+
+static unsigned int registerSlot(const char *s, int length) {
+    // s is past the '$'
+    uint32_t key = (unsigned char)s[0] | (unsigned char)s[length - 1] << 8 | (uint32_t)length << 16;
+    return (key * 0x2d7a5633u) >> 28;
+}
 
-    secondPass(inputFilename, imemFilename, dmemFilename, labels, labelCount);
+int getRegister(const Token *reg) {
+    if (reg->length < 3 || reg->start[0] != '$') return -1;
+    const NameCode *entry = &registerTable[registerSlot(reg->start + 1, reg->length - 1)];
+    if ((int)strlen(entry->name) != reg->length || memcmp(entry->name, reg->start, reg->length) != 0) return -1;
+    return entry->code;
+}
+
+int getOpcode(const Token *mnemonic) {
+    if (mnemonic->length < 2) return -1;
+    const NameCode *entry = &opcodeTable[opcodeSlot(mnemonic->start, mnemonic->length)];
+    if (!entry->name || (int)strlen(entry->name) != mnemonic->length || memcmp(entry->name, mnemonic->start, mnemonic->length) != 0) return -1;
+    return entry->code;
+}
+
+int main(int argc, char *argv[]) {
+    int optimize = argc > 1 && strcmp(argv[1], "-O") == 0;
+    if (optimize) {
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+
+    if (argc == 4 && argv[1][0] != '-') {
+        assemble(argv[1], argv[2], argv[3], NULL, NULL, optimize);
+    } else if ((argc == 4 || argc == 5) && strcmp(argv[1], "-image") == 0) {
+        assemble(argv[2], NULL, NULL, argv[3], argc == 5 ? argv[4] : NULL, optimize);
+    } else if (argc == 3 && strcmp(argv[1], "-estimate") == 0) {
+        estimate(argv[2], optimize);
+    } else if (optimize) {
+        fprintf(stderr, "-O applies to a whole program, not to -c or -link\n");
+        return 1;
+    } else if (argc == 4 && strcmp(argv[1], "-c") == 0) {
+        static Program program;
+        size_t size;
+        program.relocatable = 1;
+        const char *source = parseSource(argv[2], &program, &size);
+        writeObjectFile(&program, argv[3]);
+        unmapSource(source, size);
+    } else if (argc >= 5 && strcmp(argv[1], "-link") == 0 && strcmp(argv[2], "-image") == 0) {
+        linkObjects(argv + 4, argc - 4, NULL, NULL, argv[3]);
+    } else if (argc >= 5 && strcmp(argv[1], "-link") == 0) {
+        linkObjects(argv + 4, argc - 4, argv[2], argv[3], NULL);
+    } else {
+        fprintf(stderr, "Usage: %s [-O] <input.asm> <imemin.txt> <dmemin.txt>\n", argv[0]);
+        fprintf(stderr, "       %s [-O] -image <input.asm> <image.bin> [diskin.txt]\n", argv[0]);
+        fprintf(stderr, "       %s -c <input.asm> <output.o>\n", argv[0]);
+        fprintf(stderr, "       %s -link <imemin.txt> <dmemin.txt> <input.o>...\n", argv[0]);
+        fprintf(stderr, "       %s -link -image <image.bin> <input.o>...\n", argv[0]);
+        fprintf(stderr, "       %s [-O] -estimate <input.asm>\n", argv[0]);
+        fprintf(stderr, "The binary image holds imem, dmem and optionally the disk, the simulator takes it as imemin, dmemin or diskin.\n");
+        fprintf(stderr, "-c writes a relocatable object, -link places the objects in command line order (the first one runs\n");
+        fprintf(stderr, "first) and resolves their references to each other's .global labels.\n");
+        fprintf(stderr, "-O runs the peephole optimizer and reports the instructions it saved.\n");
+        fprintf(stderr, "-estimate prints the cycles per function and per loop and the disk polling, from the code alone.\n");
+        return 1;
+    }
 
     return 0;
 }
@@ -0,0 +1,61 @@
+#!/bin/sh
+# Assembler output check.
+#
+# Usage: asmcheck.sh <asm>
+#
+# Assembles every shipped program and checks that imemin.txt and dmemin.txt
+# are byte-identical to the shipped ones. Each program is also assembled with
+# LF instead of CRLF line endings and with its labels rewritten to equivalent
+# spellings (blanks or tabs before the ':', the next instruction on the label
+# line); every spelling must give the same bytes.
+#
+# Environment:
+#   WORKDIR  scratch directory (default ./asmcheck_work)
+
+if [ $# -ne 1 ]; then
+    echo "Usage: $0 <asm>" >&2
+    exit 1
+fi
+
+ASM=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+WORKDIR=${WORKDIR:-./asmcheck_work}
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+
+mkdir -p "$WORKDIR"
+WORKDIR=$(cd "$WORKDIR" && pwd)
+failed=0
+
+# check <name> <source> <dir with the expected imemin.txt and dmemin.txt>
+check() {
+    if ! "$ASM" "$2" "$WORKDIR/imemin.txt" "$WORKDIR/dmemin.txt"; then
+        echo "FAIL $1: assembly failed" >&2
+        failed=1
+    elif ! cmp -s "$WORKDIR/imemin.txt" "$3/imemin.txt" || ! cmp -s "$WORKDIR/dmemin.txt" "$3/dmemin.txt"; then
+        echo "FAIL $1: output differs" >&2
+        failed=1
+    else
+        echo "ok   $1"
+    fi
+}
+
+label='^\([A-Za-z_][A-Za-z0-9_]*\):[ 	]*'
+for prog in binom circle mulmat disktest; do
+    src=$ROOT/$prog/$prog.asm
+    check "$prog" "$src" "$ROOT/$prog"
+
+    tr -d '\r' < "$src" > "$WORKDIR/lf.asm"
+    check "$prog LF" "$WORKDIR/lf.asm" "$ROOT/$prog"
+    src=$WORKDIR/lf.asm
+
+    sed "s/$label/\1 :/" "$src" > "$WORKDIR/space.asm"
+    check "$prog label :" "$WORKDIR/space.asm" "$ROOT/$prog"
+
+    sed "s/$label/  \1	 	:	/" "$src" > "$WORKDIR/tab.asm"
+    check "$prog label<tab>:" "$WORKDIR/tab.asm" "$ROOT/$prog"
+
+    # join each label with the line after it
+    sed "/$label\$/{N;s/\n/ /;}" "$src" > "$WORKDIR/join.asm"
+    check "$prog label: instruction" "$WORKDIR/join.asm" "$ROOT/$prog"
+done
+
+exit $failed
@@ -0,0 +1,228 @@
+#!/bin/sh
+# Simulator benchmark suite.
+#
+# Usage: bench.sh <sim> <asm> <results.csv>
+#
+# Runs the shipped programs (binom, mulmat, circle, disktest) and generated
+# synthetic programs (alu, branch, memory, iopoll, interrupt) with the trace on
+# and with -notrace. Every case is run WARMUP times untimed, then REPS times;
+# the median wall time is reported together with MIPS and output bytes/s.
+#
+# Environment:
+#   REPS    timed repetitions per case (default 5)
+#   WARMUP  untimed runs per case (default 1)
+#   SCALE   outer loop count of the synthetic programs, 1..2047 (default 40)
+#   WORKDIR scratch directory (default ./bench_work)
+#
+# Results are one CSV line per case:
+#   program,mode,cycles,median_s,mips,output_bytes,bytes_per_s
+# Compare two result files with compare.sh.
+
+if [ $# -ne 3 ]; then
+    echo "Usage: $0 <sim> <asm> <results.csv>" >&2
+    exit 1
+fi
+
+SIM=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+ASM=$(cd "$(dirname "$2")" && pwd)/$(basename "$2")
+RESULTS=$3
+REPS=${REPS:-5}
+WARMUP=${WARMUP:-1}
+SCALE=${SCALE:-40}
+WORKDIR=${WORKDIR:-./bench_work}
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+
+mkdir -p "$WORKDIR"
+WORKDIR=$(cd "$WORKDIR" && pwd)
+
+# ---------------------------------------------------------------------------
+# synthetic programs
+# ---------------------------------------------------------------------------
+
+gen_alu() {
+cat <<ASM
+    add \$s1, \$zero, \$imm1, \$zero, $SCALE, 0      # outer loop counter
+OUTER:
+    add \$s0, \$zero, \$imm1, \$zero, 1000, 0        # inner loop counter
+INNER:
+    add \$t0, \$t0, \$imm1, \$s0, 3, 0
+    sub \$t1, \$t0, \$s0, \$imm1, 7, 0
+    mac \$t2, \$t0, \$t1, \$imm1, 5, 0
+    and \$a0, \$t2, \$imm1, \$t0, 0x7ff, 0
+    or \$a1, \$a0, \$t1, \$zero, 0, 0
+    xor \$a2, \$a1, \$t2, \$imm1, 0x555, 0
+    sll \$v0, \$a2, \$imm1, \$zero, 3, 0
+    sra \$gp, \$v0, \$imm1, \$zero, 2, 0
+    srl \$t0, \$gp, \$imm1, \$zero, 1, 0
+    sub \$s0, \$s0, \$imm1, \$zero, 1, 0
+    bne \$zero, \$s0, \$zero, \$imm1, INNER, 0
+    sub \$s1, \$s1, \$imm1, \$zero, 1, 0
+    bne \$zero, \$s1, \$zero, \$imm1, OUTER, 0
+    halt \$zero, \$zero, \$zero, \$zero, 0, 0
+ASM
+}
+
+gen_branch() {
+cat <<ASM
+    add \$s1, \$zero, \$imm1, \$zero, $SCALE, 0      # outer loop counter
+OUTER:
+    add \$s0, \$zero, \$imm1, \$zero, 1000, 0        # inner loop counter
+INNER:
+    and \$t0, \$s0, \$imm1, \$zero, 1, 0
+    beq \$zero, \$t0, \$zero, \$imm1, EVEN, 0        # alternate taken / not taken
+    add \$t1, \$t1, \$imm1, \$zero, 1, 0
+    beq \$zero, \$zero, \$zero, \$imm1, NEXT, 0
+EVEN:
+    sub \$t1, \$t1, \$imm1, \$zero, 1, 0
+NEXT:
+    and \$t0, \$s0, \$imm1, \$zero, 7, 0
+    blt \$zero, \$t0, \$imm1, \$imm2, 3, SKIP        # taken 3 times out of 8
+    add \$t2, \$t2, \$t0, \$zero, 0, 0
+    bge \$zero, \$t2, \$imm1, \$imm2, 100, RESET
+    beq \$zero, \$zero, \$zero, \$imm1, SKIP, 0
+RESET:
+    add \$t2, \$zero, \$zero, \$zero, 0, 0
+SKIP:
+    sub \$s0, \$s0, \$imm1, \$zero, 1, 0
+    bne \$zero, \$s0, \$zero, \$imm1, INNER, 0
+    sub \$s1, \$s1, \$imm1, \$zero, 1, 0
+    bne \$zero, \$s1, \$zero, \$imm1, OUTER, 0
+    halt \$zero, \$zero, \$zero, \$zero, 0, 0
+ASM
+}
+
+gen_memory() {
+cat <<ASM
+    add \$s1, \$zero, \$imm1, \$zero, $SCALE, 0      # outer loop counter
+OUTER:
+    add \$s0, \$zero, \$imm1, \$zero, 1000, 0        # inner loop counter
+INNER:
+    lw \$t0, \$s0, \$imm1, \$zero, 0x400, 0          # sequential read
+    add \$t0, \$t0, \$s1, \$zero, 0, 0
+    sw \$zero, \$s0, \$imm1, \$t0, 0x400, 0          # sequential write back
+    mac \$t1, \$s0, \$imm1, \$zero, 37, 0            # scattered index
+    and \$t1, \$t1, \$imm1, \$zero, 0x3ff, 0
+    lw \$t2, \$t1, \$imm1, \$zero, 0x800, 0
+    add \$t2, \$t2, \$t0, \$zero, 0, 0
+    sw \$zero, \$t1, \$imm1, \$t2, 0x800, 0
+    sub \$s0, \$s0, \$imm1, \$zero, 1, 0
+    bne \$zero, \$s0, \$zero, \$imm1, INNER, 0
+    sub \$s1, \$s1, \$imm1, \$zero, 1, 0
+    bne \$zero, \$s1, \$zero, \$imm1, OUTER, 0
+    halt \$zero, \$zero, \$zero, \$zero, 0, 0
+ASM
+}
+
+gen_iopoll() {
+cat <<ASM
+    add \$s1, \$zero, \$imm1, \$zero, $SCALE, 0      # outer loop counter
+OUTER:
+    add \$s0, \$zero, \$imm1, \$zero, 8, 0           # sectors per outer iteration
+INNER:
+    out \$zero, \$imm1, \$zero, \$s0, 9, 0           # leds = sector
+    out \$zero, \$imm1, \$zero, \$s1, 10, 0          # display7seg = outer counter
+    out \$zero, \$imm1, \$zero, \$s0, 15, 0          # disksector = s0
+    out \$zero, \$imm1, \$zero, \$imm2, 16, 256      # diskbuffer = 256
+    out \$zero, \$imm1, \$zero, \$imm2, 14, 1        # diskcmd = read
+WAIT:
+    in \$t0, \$imm1, \$zero, \$zero, 17, 0           # t0 = diskstatus
+    bne \$zero, \$t0, \$zero, \$imm2, 0, WAIT
+    sub \$s0, \$s0, \$imm1, \$zero, 1, 0
+    bne \$zero, \$s0, \$zero, \$imm1, INNER, 0
+    sub \$s1, \$s1, \$imm1, \$zero, 1, 0
+    bne \$zero, \$s1, \$zero, \$imm1, OUTER, 0
+    halt \$zero, \$zero, \$zero, \$zero, 0, 0
+ASM
+}
+
+gen_interrupt() {
+cat <<ASM
+    out \$zero, \$imm1, \$zero, \$imm2, 6, HANDLER   # irqhandler = HANDLER
+    out \$zero, \$imm1, \$zero, \$imm2, 13, 20       # timermax = 20
+    out \$zero, \$imm1, \$zero, \$imm2, 0, 1         # irq0enable = 1
+    out \$zero, \$imm1, \$zero, \$imm2, 2, 1         # irq2enable = 1
+    out \$zero, \$imm1, \$zero, \$imm2, 11, 1        # timerenable = 1
+    add \$s1, \$zero, \$imm1, \$zero, $SCALE, 0      # outer loop counter
+OUTER:
+    add \$s0, \$zero, \$imm1, \$zero, 1000, 0        # inner loop counter
+INNER:
+    add \$t0, \$t0, \$s0, \$zero, 0, 0
+    sub \$s0, \$s0, \$imm1, \$zero, 1, 0
+    bne \$zero, \$s0, \$zero, \$imm1, INNER, 0
+    sub \$s1, \$s1, \$imm1, \$zero, 1, 0
+    bne \$zero, \$s1, \$zero, \$imm1, OUTER, 0
+    halt \$zero, \$zero, \$zero, \$zero, 0, 0
+HANDLER:
+    in \$t2, \$imm1, \$zero, \$zero, 8, 0            # t2 = clks
+    out \$zero, \$imm1, \$zero, \$t2, 9, 0           # leds = clks
+    out \$zero, \$imm1, \$zero, \$zero, 3, 0         # irq0status = 0
+    out \$zero, \$imm1, \$zero, \$zero, 5, 0         # irq2status = 0
+    reti \$zero, \$zero, \$zero, \$zero, 0, 0
+ASM
+}
+
+# irq2 every 97 cycles for the interrupt program, nothing for the others
+gen_irq2in() {
+    if [ "$1" = interrupt ]; then
+        awk -v n="$SCALE" 'BEGIN { for (c = 97; c < n * 3000; c += 97) print c }'
+    fi
+}
+
+# ---------------------------------------------------------------------------
+# runner
+# ---------------------------------------------------------------------------
+
+now_ns() {
+    date +%s%N
+}
+
+# run_case <name> <dir with imemin/dmemin/diskin/irq2in> <mode>
+run_case() {
+    name=$1; dir=$2; mode=$3
+    opts=
+    [ "$mode" = notrace ] && opts=-notrace
+    out=$WORKDIR/out/$name-$mode
+    mkdir -p "$out"
+
+    times=
+    i=0
+    while [ $i -lt $((WARMUP + REPS)) ]; do
+        rm -f "$out"/*
+        start=$(now_ns)
+        (cd "$out" && "$SIM" $opts "$dir/imemin.txt" "$dir/dmemin.txt" "$dir/diskin.txt" "$dir/irq2in.txt" \
+            dmemout.txt regout.txt trace.txt hwregtrace.txt cycles.txt leds.txt display7seg.txt \
+            diskout.txt monitor.txt monitor.yuv > /dev/null) || { echo "$name ($mode) failed" >&2; exit 1; }
+        end=$(now_ns)
+        [ $i -ge $WARMUP ] && times="$times $((end - start))"
+        i=$((i + 1))
+    done
+
+    cycles=$(cat "$out/cycles.txt")
+    bytes=$(cat "$out"/* | wc -c)
+    median=$(echo $times | tr ' ' '\n' | sort -n | awk '{ t[NR] = $1 } END { print t[int((NR + 1) / 2)] }')
+    echo "$name $mode $cycles $median $bytes" | awk '{
+        s = $4 / 1e9
+        printf "%s,%s,%d,%.6f,%.3f,%d,%.0f\n", $1, $2, $3, s, $3 / s / 1e6, $5, $5 / s
+    }' >> "$RESULTS"
+    tail -n 1 "$RESULTS"
+}
+
+echo "program,mode,cycles,median_s,mips,output_bytes,bytes_per_s" > "$RESULTS"
+
+for prog in binom mulmat circle disktest; do
+    for mode in trace notrace; do
+        run_case "$prog" "$ROOT/$prog" $mode
+    done
+done
+
+for prog in alu branch memory iopoll interrupt; do
+    dir=$WORKDIR/programs/$prog
+    mkdir -p "$dir"
+    gen_$prog > "$dir/$prog.asm"
+    gen_irq2in $prog > "$dir/irq2in.txt"
+    : > "$dir/diskin.txt"
+    "$ASM" "$dir/$prog.asm" "$dir/imemin.txt" "$dir/dmemin.txt" || exit 1
+    for mode in trace notrace; do
+        run_case "$prog" "$dir" $mode
+    done
+done
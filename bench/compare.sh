@@ -0,0 +1,32 @@
+#!/bin/sh
+# Compare two bench.sh result files.
+#
+# Usage: compare.sh <baseline.csv> <current.csv> [threshold_percent]
+#
+# Prints the MIPS change of every program/mode present in both files and
+# exits with status 1 if any case lost more than threshold_percent (default 5)
+# of its baseline MIPS, or if its cycle count changed.
+
+if [ $# -lt 2 ]; then
+    echo "Usage: $0 <baseline.csv> <current.csv> [threshold_percent]" >&2
+    exit 1
+fi
+
+awk -F, -v threshold="${3:-5}" '
+FNR == 1 { next }                       # header
+NR == FNR { base_mips[$1 "," $2] = $5; base_cycles[$1 "," $2] = $3; next }
+($1 "," $2) in base_mips {
+    key = $1 "," $2
+    change = base_mips[key] > 0 ? ($5 - base_mips[key]) * 100 / base_mips[key] : 0
+    status = "ok"
+    if ($3 != base_cycles[key]) {
+        status = "CYCLES CHANGED"
+        failed = 1
+    } else if (change < -threshold) {
+        status = "REGRESSION"
+        failed = 1
+    }
+    printf "%-10s %-8s %10.3f -> %10.3f MIPS %+7.1f%%  %s\n", $1, $2, base_mips[key], $5, change, status
+}
+END { exit failed }
+' "$1" "$2"
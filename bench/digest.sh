@@ -0,0 +1,69 @@
+#!/bin/sh
+# -digest oracle check.
+#
+# Usage: digest.sh <sim.c>
+#
+# Builds the simulator and runs every shipped program twice: once writing its
+# output files and once with -digest. Every '<xxh64> <bytes> <file>' line of the
+# digest run must match the XXH64 and size of the file the normal run wrote.
+# The reference XXH64 is the Python xxhash package, installed into WORKDIR at
+# run time when python3 can't import it already.
+#
+# Environment:
+#   CC        C compiler (default cc)
+#   CFLAGS    compiler flags (default -O2)
+#   WORKDIR   scratch directory (default ./digest_work)
+#   PIP_OPTS  extra pip install options, e.g. --no-index --find-links <dir> offline
+
+if [ $# -ne 1 ]; then
+    echo "Usage: $0 <sim.c>" >&2
+    exit 1
+fi
+
+SRC=$1
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+WORKDIR=${WORKDIR:-./digest_work}
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+
+mkdir -p "$WORKDIR"
+WORKDIR=$(cd "$WORKDIR" && pwd)
+failed=0
+
+if ! python3 -c "import xxhash" 2>/dev/null; then
+    python3 -m pip install --quiet --target "$WORKDIR/pylib" $PIP_OPTS xxhash ||
+        { echo "installing the xxhash Python package failed" >&2; exit 1; }
+    PYTHONPATH=$WORKDIR/pylib${PYTHONPATH:+:$PYTHONPATH}
+    export PYTHONPATH
+fi
+
+"$CC" $CFLAGS -o "$WORKDIR/sim" "$SRC" -lpthread || { echo "build failed" >&2; exit 1; }
+
+for prog in binom circle mulmat disktest; do
+    dir=$ROOT/$prog
+    out=$WORKDIR/$prog
+    mkdir -p "$out"
+    for mode in files digest; do
+        opts=
+        [ $mode = digest ] && opts=-digest
+        (cd "$out" && "$WORKDIR/sim" $opts "$dir/imemin.txt" "$dir/dmemin.txt" "$dir/diskin.txt" "$dir/irq2in.txt" \
+            dmemout.txt regout.txt trace.txt hwregtrace.txt cycles.txt leds.txt display7seg.txt diskout.txt \
+            monitor.txt monitor.yuv > "$WORKDIR/$prog.$mode")
+    done
+    # every line of the digest run against the written file
+    python3 - "$out" "$WORKDIR/$prog.digest" <<'PY' || failed=1
+import os, sys, xxhash
+out, lines = sys.argv[1], open(sys.argv[2]).read().split("\n")
+bad = 0
+for line in filter(None, lines):
+    digest, size, name = line.split()
+    data = open(os.path.join(out, name), "rb").read()
+    if (digest, int(size)) != (xxhash.xxh64(data).hexdigest(), len(data)):
+        print("FAIL %s: %s, file %s %d" % (out, line, xxhash.xxh64(data).hexdigest(), len(data)), file=sys.stderr)
+        bad = 1
+sys.exit(bad)
+PY
+    echo "$prog: $(wc -l < "$WORKDIR/$prog.digest") digests checked"
+done
+
+exit $failed
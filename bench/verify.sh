@@ -0,0 +1,105 @@
+#!/bin/sh
+# Fast engine verification.
+#
+# Usage: verify.sh <sim.c> <asm>
+#
+# Builds the simulator and runs -verify with every fast engine (fuse, memo,
+# lanes) on the shipped programs and a generated program; every run must match
+# the reference. Then builds it once per SIM_FAULT bug and checks that -verify
+# of the engine holding the bug reports the difference.
+#
+# Environment:
+#   CC       C compiler (default cc)
+#   CFLAGS   compiler flags (default -O2)
+#   WORKDIR  scratch directory (default ./verify_work)
+
+if [ $# -ne 2 ]; then
+    echo "Usage: $0 <sim.c> <asm>" >&2
+    exit 1
+fi
+
+SRC=$1
+ASM=$(cd "$(dirname "$2")" && pwd)/$(basename "$2")
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+WORKDIR=${WORKDIR:-./verify_work}
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+
+mkdir -p "$WORKDIR"
+WORKDIR=$(cd "$WORKDIR" && pwd)
+failed=0
+
+# a loop with a negative sra, an add+branch counter and a call -memo caches
+gen_engines() {
+cat <<ASM
+    add \$sp, \$zero, \$imm1, \$zero, 0x700, 0
+    add \$s1, \$zero, \$imm1, \$zero, 200, 0         # loop counter
+LOOP:
+    sub \$t0, \$zero, \$s1, \$imm1, 7, 0             # t0 = -s1 - 7
+    sra \$t1, \$t0, \$imm1, \$zero, 2, 0
+    add \$s0, \$s0, \$t1, \$zero, 0, 0
+    and \$a0, \$s1, \$imm1, \$imm2, 3, -1
+    jal \$ra, \$zero, \$zero, \$imm2, 0, SUM
+    add \$s2, \$s2, \$v0, \$zero, 0, 0
+    add \$s1, \$s1, \$imm1, \$zero, -1, 0
+    bne \$zero, \$s1, \$zero, \$imm2, 0, LOOP
+    sw \$s0, \$zero, \$imm1, \$zero, 0x100, 0
+    sw \$s2, \$zero, \$imm1, \$zero, 0x101, 0
+    halt \$zero, \$zero, \$zero, \$zero, 0, 0
+SUM:                                                # v0 = sum of 3 * v0 + i for i = a0 + 20 .. 1
+    sub \$sp, \$sp, \$imm1, \$zero, 1, 0
+    sw \$s0, \$sp, \$zero, \$zero, 0, 0
+    add \$v0, \$zero, \$zero, \$zero, 0, 0
+    add \$s0, \$a0, \$imm1, \$zero, 20, 0
+SUMLOOP:
+    mac \$v0, \$v0, \$imm1, \$s0, 3, 0
+    sub \$s0, \$s0, \$imm1, \$zero, 1, 0
+    bne \$zero, \$s0, \$zero, \$imm1, SUMLOOP, 0
+    lw \$s0, \$sp, \$zero, \$zero, 0, 0
+    add \$sp, \$sp, \$imm1, \$zero, 1, 0
+    beq \$zero, \$zero, \$zero, \$ra, 0, 0
+ASM
+}
+
+# build <binary> <fault>
+build() {
+    "$CC" $CFLAGS -DSIM_FAULT=$2 -o "$1" "$SRC" -lpthread || { echo "build with SIM_FAULT=$2 failed" >&2; exit 1; }
+}
+
+# run_verify <sim> <engine> <dir with imemin/dmemin/diskin/irq2in> <expected exit status>
+run_verify() {
+    "$1" -verify $2 "$3/imemin.txt" "$3/dmemin.txt" "$3/diskin.txt" "$3/irq2in.txt" > "$WORKDIR/out.txt"
+    status=$?
+    if [ $status -ne $4 ]; then
+        echo "FAIL $(basename "$1") -verify $2 $(basename "$3"): exit status $status, expected $4" >&2
+        cat "$WORKDIR/out.txt" >&2
+        failed=1
+    else
+        echo "ok   $(basename "$1") -verify $2 $(basename "$3"): $(head -n 1 "$WORKDIR/out.txt")"
+    fi
+}
+
+dir=$WORKDIR/engines
+mkdir -p "$dir"
+gen_engines > "$dir/engines.asm"
+: > "$dir/diskin.txt"
+: > "$dir/irq2in.txt"
+"$ASM" "$dir/engines.asm" "$dir/imemin.txt" "$dir/dmemin.txt" || exit 1
+
+build "$WORKDIR/sim" 0
+for engine in fuse memo lanes; do
+    for prog in binom mulmat disktest; do
+        run_verify "$WORKDIR/sim" $engine "$ROOT/$prog" 0
+    done
+    run_verify "$WORKDIR/sim" $engine "$dir" 0
+done
+
+# SIM_FAULT i plants its bug in engine i
+fault=1
+for engine in fuse lanes memo; do
+    build "$WORKDIR/sim_fault$fault" $fault
+    run_verify "$WORKDIR/sim_fault$fault" $engine "$dir" 1
+    fault=$((fault + 1))
+done
+
+exit $failed
@@ -3,6 +3,54 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#pragma comment(lib, "ws2_32.lib")
+#define THREAD_LOCAL __declspec(thread)
+typedef SOCKET sock_t;
+#define close_socket closesocket
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#define THREAD_LOCAL __thread
+typedef int sock_t;
+#define close_socket close
+#define INVALID_SOCKET (-1)
+#endif
+
+#ifdef SIM_HOSTPROF
+#ifdef _WIN32
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <time.h>
+#include <sys/resource.h>
+#endif
+#endif
+
+// SIM_FAULT plants a known bug in a fast engine, bench/verify.sh checks that -verify finds it:
+// 1 the fused add+branch adds imm2 for $imm1, 2 the -lanes sra shifts in zeros instead of the sign,
+// 3 a -memo cache hit counts one cycle less than the call took
+#ifndef SIM_FAULT
+#define SIM_FAULT 0
+#endif
 
 
 
@@ -11,17 +59,86 @@ enum IORegisters {
 	IRQ0ENABLE, IRQ1ENABLE, IRQ2ENABLE, IRQ0STATUS, IRQ1STATUS, IRQ2STATUS,
 	IRQHANDLER, IRQRETURN, CLKS, LEDS, DISPLAY7SEG, TIMERENABLE,
 	TIMERCURRENT, TIMERMAX, DISKCMD, DISKSECTOR, DISKBUFFER, DISKSTATUS, RESERVED0,  RESERVED1 ,
-	MONITORADDR, MONITORDATA, MONITORCMD
+	MONITORADDR, MONITORDATA, MONITORCMD, COREID, IRQ3ENABLE, IRQ3STATUS, IPISEND, MONITORLEN,
+	MONITORHEIGHT, MONITORSRC, DMASRC, DMADST, DMALEN, DMACMD, DMASTATUS, IRQ4ENABLE, IRQ4STATUS
+};
+
+// monitorcmd values
+enum MonitorCommands {
+	MONITOR_NONE, MONITOR_PIXEL, MONITOR_SPAN, MONITOR_RECT, MONITOR_BLIT
+};
+
+// binary image section types, imem words are 8 bytes, dmem and disk words 4
+enum ImageSections {
+	IMAGE_IMEM = 1, IMAGE_DMEM, IMAGE_DISK
+};
+
+// dmacmd values
+enum DmaCommands {
+	DMA_NONE, DMA_COPY, DMA_FILL
+};
+
+// fast engines -verify runs next to the reference execute_instruction() path
+enum VerifyEngines {
+	VERIFY_NONE, VERIFY_FUSE, VERIFY_MEMO, VERIFY_LANES,
+	VERIFY_ENGINE_COUNT
 };
 
 
 #define MEMORY_SIZE 4096
 #define REG_SIZE 16
-#define IO_REG_SIZE 23
+#define IO_REG_SIZE 37
 #define PC_ADDR_SIZE 1
 #define SECTOR_SIZE 128
 #define DISK_SIZE 128
 #define MONITOR_SIZE 256
+#define MONITOR_PORT_PIXELS 4 // pixels the monitor port moves per cycle, one d_mem word
+#define WS_WINDOW_DEFAULT 1024 // default working-set window, in cycles
+#define MEMPROF_HOT_COUNT 16   // number of hottest addresses listed in the profile summary
+#define HOSTPROF_SAMPLE_MASK 63 // -hostprof times the run loop phases on one cycle out of 64
+#define TRACE_LINE_SIZE 168     // a trace.txt line is 161 characters
+#define CHECKPOINT_DEFAULT (1UL << 20) // -diverge compares state hashes every 1M cycles by default
+#define CONTEXT_DEFAULT 8       // -diverge and -verify print 8 cycles before the first difference by default
+#define OPCODE_COUNT 22
+#define PAIRPROF_TOP 12         // number of hottest pairs and triples listed by -pairprof
+#define MAX_CORES 16
+#define QUANTUM_DEFAULT 1024    // -cores synchronizes the cores every 1024 cycles by default
+#define DISK_CYCLES 1024        // a disk command takes 1024 cycles, -quantum can't be longer
+#define DMA_BANDWIDTH_DEFAULT 1 // d_mem words the DMA engine moves per cycle
+#define LANE_MAX 16             // -lanes runs up to 16 machines, a register of all of them is one 512-bit vector
+#define LANE_BURST 256          // -lanes steps a lane or the SIMD group at most 256 times before scheduling again
+#define LANE_LAST_OPCODE 17     // -lanes executes add ... sw in the SIMD group, the others on the scalar engine
+#define SP_REG 14               // $sp, -memo keeps the stack stores of a call relative to its entry value
+#define MEMO_DEPTH 32           // -memo records up to 32 nested calls at once
+#define MEMO_READS 8            // d_mem words outside its stack frame a cached call may read
+#define MEMO_WRITES 256         // stack words a cached call may write
+#define MEMO_BUCKETS 4096
+#define MEMO_MASKS 4            // -memo looks a call up with the key registers of the last 4 entries of its pc
+#define MEMO_ENTRIES_MAX 65536  // -memo empties the cache when it holds this many calls
+#define MEMO_RETRIES 4          // -memo stops recording the calls of a pc after 4 impure ones in a row
+#define IRQ2_RING_SIZE 1024     // irq2in cycles buffered from a stream, its producer blocks while they are pending
+#define IRQ2_BATCH_SIZE 4096    // bytes read from an irq2in stream at once
+#define IMAGE_MAGIC "SIMP"      // binary memory image written by asm -image
+#define IMAGE_VERSION 1
+#define DCACHE_VALID 0x8000     // dcache tag entry: valid and dirty flags above the 12-bit line number
+#define DCACHE_DIRTY 0x4000
+#define DCACHE_LINE_MASK 0x0fff
+#define GDB_PACKET_SIZE 4096
+#define GDB_POLL_CYCLES 65536   // -gdb checks for a ^C from the debugger every 64K cycles while running
+#define GDB_DMEM_BASE 0x10000000 // -gdb address map: i_mem word i at 8 * i, d_mem word i at GDB_DMEM_BASE + 4 * i
+#define GDB_IO_BASE 0x20000000   // and I/O register i at GDB_IO_BASE + 4 * i, all little endian
+#define GDB_REG_COUNT (REG_SIZE + 1 + IO_REG_SIZE) // r0-r15, pc (as an i_mem address), I/O registers
+
+// XXH64 primitives used by -digest
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+#define XXH_ROTL64(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+#define xxh64_round(acc, input) (XXH_ROTL64((acc) + (input) * XXH_PRIME64_2, 31) * XXH_PRIME64_1)
+#define xxh_read64(p) ((uint64_t)(p)[0] | (uint64_t)(p)[1] << 8 | (uint64_t)(p)[2] << 16 | (uint64_t)(p)[3] << 24 | \
+    (uint64_t)(p)[4] << 32 | (uint64_t)(p)[5] << 40 | (uint64_t)(p)[6] << 48 | (uint64_t)(p)[7] << 56)
 
 
 struct log
@@ -40,7 +157,7 @@ struct log
 	{
 		unsigned long cycle;
 		uint8_t rw;    // read:1, write:2
-		uint8_t IOReg; // 0 <= IOReg <= 22
+		uint8_t IOReg; // 0 <= IOReg < IO_REG_SIZE
 		uint32_t data;
 		struct hw_access* next;
 
@@ -55,24 +172,376 @@ struct log
 	} *irq2in_head, *irq2in_tail;
 };
 
+// instruction fields decoded once per i_mem image by decode_imem()
+struct decoded_inst
+{
+    uint8_t opcode, rd, rs, rt, rm;
+    uint8_t fuse;       // superinstruction starting at this address, FUSE_NONE if none
+    int32_t imm1, imm2; // sign extended
+};
+
+// streaming XXH64 (seed 0) of an output file
+struct digest
+{
+    uint64_t v[4];
+    uint8_t buffer[32];
+    uint32_t buffered;
+    uint64_t total;
+};
+
+// output file, or its digest in -digest mode
+struct out_file
+{
+    FILE* f;
+    struct digest digest;
+};
+
+// binary memory image, little-endian: the header, then section_count sections of a struct image_section and
+// its words. checksum is FNV-1a of everything after the header. Written by writeImageFile() in asm.c.
+struct image_header
+{
+    char magic[4];
+    uint16_t version;
+    uint16_t section_count;
+    uint32_t checksum;
+    uint32_t size;
+};
+
+struct image_section
+{
+    uint32_t type;
+    uint32_t start; // first word, disk words count sector * SECTOR_SIZE + line
+    uint32_t count;
+    uint32_t reserved;
+};
+
+// architectural state of one machine, saved and restored by -diverge
+struct machine_state
+{
+    uint16_t pc;
+    uint8_t irq_busy;
+    uint8_t halted;
+    unsigned long disk_last_cmd_cycle;
+    unsigned long monitor_done_cycle;
+    unsigned long dma_done_cycle;
+    unsigned long cycles;
+    int32_t r[REG_SIZE];
+    uint32_t IORegister[IO_REG_SIZE];
+    uint64_t i_mem[MEMORY_SIZE];
+    int32_t d_mem[MEMORY_SIZE];
+    uint32_t disk[DISK_SIZE][SECTOR_SIZE];
+    uint8_t monitor[MONITOR_SIZE][MONITOR_SIZE];
+    struct irq2in* irq2in_head;
+};
+
+// monitor write of a core, applied to monitor at the end of its quantum
+struct monitor_write
+{
+    unsigned long cycle;
+    uint16_t addr;
+    uint8_t data;
+};
+
+// one core of -cores mode. Its pc, registers and d_mem view are the thread-local globals of its thread,
+// this is what the other threads see at the quantum barrier.
+struct core
+{
+    int32_t* d_mem;                         // private view of d_mem, reloaded from shared_d_mem every quantum
+    unsigned long write_cycle[MEMORY_SIZE]; // cycle of the last store to the address in this quantum
+    uint8_t is_dirty[MEMORY_SIZE];
+    uint16_t dirty[MEMORY_SIZE];            // addresses stored to in this quantum
+    uint32_t dirty_count;
+    struct monitor_write* monitor_writes;
+    uint32_t monitor_count, monitor_capacity;
+    uint8_t has_disk;                       // a disk command started in this quantum, at most one fits in it
+    unsigned long disk_cycle;
+    uint32_t disk_cmd, disk_sector, disk_buffer;
+    uint32_t disk_data[SECTOR_SIZE];        // the buffer of a disk write at the cycle of the command
+    uint32_t ipi_out;                       // mask of the cores ipisend interrupted in this quantum
+    uint8_t ipi_in;
+    uint8_t halted;
+    uint8_t failed;
+    int result;
+};
+
+// one machine of -lanes. Its registers are a column of lane_r, the rest of its state is swapped with the
+// globals of the scalar engine by lane_enter() and lane_leave().
+struct lane
+{
+    uint16_t pc;
+    uint8_t irq_busy;
+    uint8_t halted;
+    unsigned long cycles;
+    unsigned long quiet_until;  // first cycle end_cycle() may do more than count, see quiet_until()
+    unsigned long disk_last_cmd_cycle;
+    unsigned long monitor_done_cycle;
+    unsigned long dma_done_cycle;
+    uint32_t IORegister[IO_REG_SIZE];
+    int32_t d_mem[MEMORY_SIZE];
+    uint32_t disk[DISK_SIZE][SECTOR_SIZE];
+    uint8_t monitor[MONITOR_SIZE][MONITOR_SIZE];
+    struct log log;
+    struct out_file trace_out, hwregtrace_out, leds_out, display7seg_out;
+    char inputs[3][FILENAME_MAX]; // dmemin, diskin and irq2in of the lane
+};
+
+// register or stack word of a call recorded by -memo: the value register base had at the call entry plus
+// off, or base -1 for a value that depends only on the key registers and the words the call read. A
+// cache entry keeps such a value itself in off.
+struct memo_value
+{
+    int8_t base;
+    int32_t off;
+};
+
+struct memo_write
+{
+    uint16_t addr;              // d_mem address while recording
+    int32_t off;                // address relative to $sp at the call entry, always negative
+    struct memo_value value;
+};
+
+// effects of a pure call in the -memo cache. It applies to a call of pc through link whose key registers
+// (bits of mask) and read words have the same values, the stores go relative to $sp.
+struct memo_entry
+{
+    struct memo_entry* next;
+    uint16_t pc;
+    uint16_t ret_from;          // pc of the return, it falls through instead if it targets itself
+    uint8_t link;
+    uint16_t mask;
+    int32_t key[REG_SIZE];
+    uint32_t read_count;
+    uint16_t read_addr[MEMO_READS];
+    int32_t read_value[MEMO_READS];
+    struct memo_value regs[REG_SIZE];
+    unsigned long cycles;
+    uint32_t write_count;
+    struct memo_write writes[];
+};
+
+// call being recorded by -memo, from the cycle after its jal to its return
+struct memo_call
+{
+    uint16_t pc;
+    uint16_t ret_pc;            // link & 0xfff at the entry
+    uint8_t link;
+    uint8_t pure;               // 0 once the call did something the cache can't replay
+    uint8_t transient;          // it wasn't pure because of the I/O or an interrupt around it, not its code
+    uint8_t returning;          // the instruction being executed jumps to the entry value of link
+    uint16_t mask;              // registers the call depends on by value
+    int32_t entry[REG_SIZE];
+    unsigned long start_cycle;
+    unsigned long quiet;        // quiet_until() at the entry, the call is impure if it runs until then
+    struct memo_value regs[REG_SIZE];
+    uint32_t read_count, write_count;
+    uint16_t read_addr[MEMO_READS];
+    int32_t read_value[MEMO_READS];
+    struct memo_write writes[MEMO_WRITES];
+};
+
+// irq2in streamed from a named pipe or a Unix socket while the simulation runs. The text is the same as
+// irq2in.txt, increasing interrupt cycles, and "@<cycle>" tells that no interrupt comes before <cycle>.
+// A cycle is settled once a later one arrived. The simulator reads a batch only when the ring is empty
+// and blocks only on a cycle that is not settled yet, so the run doesn't depend on the producer's timing.
+struct irq2_stream
+{
+    int fd;                             // -1 if irq2in is a file
+    unsigned long ring[IRQ2_RING_SIZE]; // pending interrupt cycles
+    uint32_t head, count;
+    unsigned long settled;              // every interrupt before this cycle is in the ring or passed
+    uint8_t eof;
+    char text[IRQ2_BATCH_SIZE];         // read but not parsed yet
+    uint32_t text_start, text_len;
+    unsigned long events, stalls;       // interrupts received, reads blocked on
+};
+
+// set-associative timing model in front of d_mem (-dcache). It keeps tags only, the data stays in d_mem.
+struct dcache
+{
+    uint32_t size, line, ways, sets;  // size and line in words
+    uint32_t line_shift, set_mask;
+    uint8_t write_back;               // write-back with write allocate, else write-through without it
+    uint32_t penalty;                 // stall cycles of a miss, a dirty eviction or a write-through store
+    uint16_t* tags;                   // [sets][ways], most recently used first
+    uint32_t hits[MEMORY_SIZE];       // per pc
+    uint32_t misses[MEMORY_SIZE];
+    unsigned long writebacks;
+    unsigned long stalls;
+};
+
+struct mem_profile
+{
+    // per-address counters
+    uint32_t reads[MEMORY_SIZE];
+    uint32_t writes[MEMORY_SIZE];
+    uint32_t dma_reads[MEMORY_SIZE];  // disk write cmd read the address
+    uint32_t dma_writes[MEMORY_SIZE]; // disk read cmd wrote the address
+    unsigned long first_cycle[MEMORY_SIZE];
+    unsigned long last_cycle[MEMORY_SIZE];
+
+    // per-pc stride detection (lw/sw only)
+    uint32_t pc_accesses[MEMORY_SIZE];
+    uint16_t pc_last_addr[MEMORY_SIZE];
+    int16_t pc_stride[MEMORY_SIZE];
+    uint32_t pc_stride_changes[MEMORY_SIZE];
+    int16_t pc_major_stride[MEMORY_SIZE]; // majority-vote candidate among the strides
+    uint32_t pc_major_votes[MEMORY_SIZE];
+    uint32_t pc_major_hits[MEMORY_SIZE];  // strides equal to the candidate since it was chosen
+
+    // working set: distinct addresses touched in the last ws_window cycles, a window sliding by one cycle.
+    // The live addresses are kept oldest last access first, an address leaves ws_window cycles after its last access
+    unsigned long ws_window;
+    uint8_t ws_live[MEMORY_SIZE];
+    uint16_t ws_prev[MEMORY_SIZE + 1], ws_next[MEMORY_SIZE + 1]; // list of the live addresses, MEMORY_SIZE is its head
+    uint32_t ws_size;                // live addresses
+    unsigned long ws_cycle;          // cycles before ws_cycle are accounted for
+    uint32_t ws_min, ws_max, ws_peak; // ws_peak: max of the current ws_window cycles of ws_series
+    unsigned long ws_max_cycle;
+    uint64_t ws_sum;                 // ws_size summed over every cycle
+    uint32_t* ws_series;             // peak working set of every ws_window cycles
+    unsigned long ws_count, ws_capacity;
+};
+
+
+
+// host profiling phases, timed by -hostprof when built with SIM_HOSTPROF
+enum HostProfPhases {
+	HP_EXECUTE, HP_TRACE, HP_HWTRACE, HP_MONITOR, HP_TIMER, HP_DISK, HP_DMA, HP_ISR,
+	HP_READ_DMEM_IMEM, HP_READ_DISKIN, HP_READ_IRQ2IN,
+	HP_WRITE_DMEMOUT, HP_WRITE_DISKOUT, HP_WRITE_TRACE, HP_WRITE_HWREGTRACE, HP_WRITE_CYCLES_REGOUT,
+	HP_WRITE_MONITOR, HP_WRITE_MONITOR_YUV,
+	HP_PHASE_COUNT
+};
+
+// superinstructions: adjacent groups of a basic block executed by one handler of exec_fused().
+// Picked from the -pairprof profile of the examples (share of the executed cycles):
+// in+bne is the disk WAIT loop (49% of disktest), add+branch the loop counters (circle 20%, mulmat 15%),
+// lw+mac the dot product of mulmat (23%), mac+add and sub+sub+mac the distance of circle (12%, 10%).
+enum FusedGroups {
+	FUSE_NONE, FUSE_IN_BRANCH, FUSE_ADD_BRANCH, FUSE_LW_MAC, FUSE_MAC_ADD, FUSE_SUB_SUB_MAC,
+	FUSE_BREAK, // not a group: a -gdb breakpoint, step() stops before the instruction
+	FUSE_GROUP_COUNT
+};
 
+// HOSTPROF_CALL(phase, call) evaluates call, timing it when the current cycle is sampled
+#ifdef SIM_HOSTPROF
+#define HOSTPROF_CALL(phase, call) \
+    (hostprof_t0[phase] = hostprof_start(), hostprof_ret = (call), hostprof_stop(phase))
+#define HOSTPROF_CYCLE() \
+    (hostprof_sampled = hostprof_enabled && (cycles & HOSTPROF_SAMPLE_MASK) == 0)
+#else
+#define HOSTPROF_CALL(phase, call) (call)
+#define HOSTPROF_CYCLE()
+#endif
 
 // error message macro
 #define err_msg(msg) \
     fprintf(stderr, "\nError: %s\npc: %d\nline: %d\n\n", msg, pc, __LINE__);
 
-uint16_t pc;
-uint8_t irq_busy;
-unsigned long disk_last_cmd_cycle;
+// the state of a core is thread-local, -cores runs each core on its own thread
+THREAD_LOCAL uint16_t pc;
+THREAD_LOCAL uint8_t irq_busy;
+THREAD_LOCAL unsigned long disk_last_cmd_cycle;
+THREAD_LOCAL unsigned long monitor_done_cycle; // last cycle of the running monitor block command, 0 if none
+THREAD_LOCAL unsigned long dma_done_cycle;     // cycle the running DMA command completes at
+unsigned long dma_bandwidth = DMA_BANDWIDTH_DEFAULT;
 uint64_t i_mem[MEMORY_SIZE];
-int32_t d_mem[MEMORY_SIZE];
-int32_t r[REG_SIZE];
-uint32_t IORegister[IO_REG_SIZE];
-uint32_t disk[DISK_SIZE][SECTOR_SIZE];
+struct decoded_inst decoded[MEMORY_SIZE + 2]; // 2 FUSE_NONE guards so a group never wraps around i_mem
+THREAD_LOCAL int32_t d_mem_storage[MEMORY_SIZE];
+THREAD_LOCAL int32_t* d_mem;   // d_mem_storage of the thread, or the d_mem of the running -lanes lane
+THREAD_LOCAL int32_t r[REG_SIZE];
+THREAD_LOCAL uint32_t IORegister[IO_REG_SIZE];
+uint32_t disk_storage[DISK_SIZE][SECTOR_SIZE];
 // disk have 128 sectors, each sector have 512 bytes or 128 lines, each line have 4 bytes
-uint8_t monitor[MONITOR_SIZE][MONITOR_SIZE]; // 256x256 pixel monitor, each pixel 8-bit
-struct log data_log;
-unsigned long cycles;
+uint8_t monitor_storage[MONITOR_SIZE][MONITOR_SIZE]; // 256x256 pixel monitor, each pixel 8-bit
+uint32_t (*disk)[SECTOR_SIZE] = disk_storage;         // -lanes points disk and monitor at those of the running lane
+uint8_t (*monitor)[MONITOR_SIZE] = monitor_storage;
+THREAD_LOCAL struct log data_log;
+THREAD_LOCAL unsigned long cycles;
+
+// -cores
+THREAD_LOCAL int core_id;
+int core_count = 1;
+unsigned long quantum_cycles = QUANTUM_DEFAULT;
+unsigned long quantum_end;      // cycle the current quantum ends at
+struct core* cores;
+int32_t shared_d_mem[MEMORY_SIZE]; // d_mem as of the last quantum barrier
+uint32_t merge_stamp;           // quantum number + 1 the winner of the address was picked in
+uint32_t win_stamp[MEMORY_SIZE];
+unsigned long win_cycle[MEMORY_SIZE];
+uint8_t cores_done;
+struct irq2in* irq2in_list;     // irq2in of core 0
+struct irq2_stream irq2_stream = { .fd = -1 }; // irq2in of core 0 when it is a named pipe or a Unix socket
+char** out_paths;               // the output file arguments, per-core files are derived from them
+#ifdef _WIN32
+SYNCHRONIZATION_BARRIER core_barrier;
+#else
+pthread_barrier_t core_barrier;
+#endif
+
+// -lanes
+char* lanes_file;               // -lanes <file>: dmemin diskin irq2in of the lanes after lane 0, one per line
+int lane_count = 1;
+struct lane* lanes;
+int32_t lane_r[REG_SIZE][LANE_MAX]; // register i of every lane is the vector lane_r[i]
+
+// -memo
+uint8_t memo_on;
+struct memo_call* memo_calls;   // [MEMO_DEPTH] calls being recorded, the innermost last
+int memo_depth;
+struct memo_entry** memo_table; // [MEMO_BUCKETS] chains of cache entries
+uint16_t memo_masks[MEMORY_SIZE][MEMO_MASKS]; // key registers of the entries of a pc, the latest first
+uint8_t memo_mask_count[MEMORY_SIZE];
+uint8_t memo_impure[MEMORY_SIZE];  // impure calls of a pc in a row
+unsigned long memo_call_count, memo_hits, memo_saved_cycles, memo_entry_count, memo_impure_count;
+
+// options
+char* memprof_prefix;      // -memprof <prefix>: write <prefix>.bin heatmap and <prefix>.txt summary
+uint8_t trace_off;         // -notrace: don't log instructions and don't write trace.txt
+uint8_t digest_mode;       // -digest: print a digest of every output instead of writing it
+struct out_file trace_out, hwregtrace_out, leds_out, display7seg_out; // streamed during the run in -digest mode
+uint8_t hwtrace_off;       // don't log hw accesses (-diverge)
+uint8_t irq2in_keep;       // check_irq2in() keeps passed irq2in nodes so saved states stay valid (-diverge)
+char** diverge_inputs;     // -diverge <imemin> <dmemin> <diskin> <irq2in> of the second machine
+unsigned long checkpoint_cycles = CHECKPOINT_DEFAULT;
+unsigned long context_cycles = CONTEXT_DEFAULT;
+uint8_t verify_engine;     // -verify <fuse|memo|lanes>
+unsigned long verify_every; // -verifyevery <cycles>, 0 compares after every block of the engine
+const char* verify_names[VERIFY_ENGINE_COUNT] = { "", "fuse", "memo", "lanes" };
+uint8_t mem_hooks;         // 1 if lw/sw must call mem_access()
+struct mem_profile* memprof;
+uint8_t fuse_off;          // -nofuse: execute every instruction on its own
+struct dcache* dcache;     // -dcache
+char* gdb_address;         // -gdb <port|unix socket path>
+sock_t gdb_sock = INVALID_SOCKET;
+uint8_t breakpoints[MEMORY_SIZE / 8]; // pc bitmap of the software breakpoints, decode_imem() marks them FUSE_BREAK
+uint8_t watchpoints[MEMORY_SIZE];     // d_mem watchpoints, the mem_access() rw bits they stop on
+uint32_t breakpoint_count, watchpoint_count;
+uint8_t debug_stop;        // a breakpoint or watchpoint stops run_until()
+unsigned long break_skip_cycle = ~0UL; // resuming from a breakpoint: it doesn't stop the instruction of this cycle
+uint16_t watch_addr;       // the access that hit a watchpoint
+uint8_t watch_rw;
+THREAD_LOCAL unsigned long stall_cycles; // cycles the core still waits for d_mem
+uint32_t* pairprof;        // -pairprof: [OPCODE_COUNT^3] counts of fall-through triples, followed by the pairs
+uint16_t pairprof_pc[2];   // pc of the previous two cycles, the older one first
+unsigned long pairprof_cycle; // cycle after the last counted instruction
+const uint8_t fuse_length[FUSE_GROUP_COUNT] = { 1, 2, 2, 2, 2, 3, 1 };
+const char* opcode_names[OPCODE_COUNT] = {
+    "add", "sub", "mac", "and", "or", "xor", "sll", "sra", "srl", "beq", "bne",
+    "blt", "bgt", "ble", "bge", "jal", "lw", "sw", "reti", "in", "out", "halt"
+};
+
+#ifdef SIM_HOSTPROF
+uint8_t hostprof_enabled;  // -hostprof
+THREAD_LOCAL uint8_t hostprof_sampled; // time the phases of the current cycle
+THREAD_LOCAL int hostprof_ret;
+THREAD_LOCAL uint64_t hostprof_t0[HP_PHASE_COUNT];
+uint64_t hostprof_ns[HP_PHASE_COUNT];
+uint64_t hostprof_calls[HP_PHASE_COUNT];
+uint64_t hostprof_samples; // sampled run loop cycles
+double hostprof_overhead;  // ns spent in one hostprof_now() call, subtracted from every timed call
+#endif
 
 
 
@@ -83,23 +552,146 @@ int ISR();// handels interrupts-ISR
 int TIMER();//if the timer is enabeld and timercurrent == timermax, return 1, else return 0
 int sec_cpy(uint32_t* dest, uint32_t* src);// copy src to dest for SECTOR_SIZE
 int handle_disk();// copy src to dest for SECTOR_SIZE
-int handle_monitor();//read/write from/to disk instructions
+int handle_dma();//run dmacmd: copy or fill d_mem in the background, irq4 when done
+int handle_monitor();//run monitorcmd: write a pixel, fill a span or rectangle, or blit a rectangle from d_mem
+int monitor_log(uint16_t addr, uint8_t data);//queue a monitor write of this core for merge_quantum()
+int monitor_fill(uint16_t row, uint16_t col, uint32_t width, uint16_t height, uint8_t data);
+int monitor_blit(uint16_t row, uint16_t col, uint16_t width, uint16_t height, uint16_t src);
+int mem_access(uint16_t addr, uint8_t rw);//lw/sw instrumentation hook, rw: read:1, write:2
+int memprof_init(unsigned long ws_window);//allocate the d_mem profiler
+int memprof_advance_window();//account the working set of the cycles before the current one
+int memprof_ws_unlink(uint16_t addr);//remove addr from the list of live working-set addresses
+int memprof_ws_record();//append the peak working set of the last ws_window cycles to ws_series
+int memprof_touch(uint16_t addr);//update first/last cycle and working set of addr
+int memprof_access(uint16_t addr, uint8_t rw);//count a lw/sw access and its stride at the current pc
+int memprof_dma(uint32_t buffer, uint32_t len, uint8_t rw);//count a DMA transfer of len words through d_mem
+const char* memprof_pattern(uint16_t access_pc);//classify the addresses accessed by access_pc
+int write_memprof(char* prefix);//write <prefix>.bin heatmap and <prefix>.txt summary
 int read_diskin(char* diskin_file);//read diskin_file into disk
+int is_image(char* path);//1 if path is a binary memory image
+const uint8_t* map_file(char* path, size_t* size);//map path read-only, NULL on failure
+int unmap_file(const uint8_t* data, size_t size);
+uint32_t image_checksum(const uint8_t* data, size_t size);
+int load_image(char* path, uint32_t type);//copy the sections of type of the binary image at path into i_mem, d_mem or disk
 int write_diskout(char* diskout_file);//parth diskout_file to valid file with disk data
 int write_monitor(char* monitor_file, uint8_t is_binary);//write monitor data to monitor_file
+int digest_init(struct digest* d);
+int digest_update(struct digest* d, const void* data, size_t size);
+uint64_t digest_final(const struct digest* d);
+int out_open(struct out_file* out, char* path, uint8_t is_binary);//open path, or start its digest in -digest mode
+int out_write(struct out_file* out, const void* data, size_t size);
+int out_printf(struct out_file* out, const char* format, ...);
+int out_close(struct out_file* out, char* path);//close the file, or print its digest line in -digest mode
+int format_trace_line(char* line, uint16_t line_pc, uint64_t inst, const int32_t* regs);//format a trace.txt line, return its length
+int format_hw_access(char* line, unsigned long cycle, uint8_t rw, uint8_t IOReg, uint32_t data);//format a hwregtrace.txt line, return its length
+int log_hw_access_outputs(unsigned long cycle, uint8_t rw, uint8_t IOReg, uint32_t data, struct out_file* hwregtrace, struct out_file* leds, struct out_file* display7seg);
+//write one hw access to hwregtrace, leds and display7seg
+int log_status(struct log* log, struct out_file* trace, uint16_t status_pc, const int32_t* regs);//log the trace record of status_pc
 int update_log_status();//update log status to linked list
 int update_log_hw_access(uint8_t rw, uint8_t IOReg);//update log io regester access
 int free_log_status();
 int free_log_hw_access();
 int free_log_irq2in();
 int read_irq2in(char* irq2in_file);//read irq2in_file into linked list each row is a node
+int irq2_stream_open(char* path, uint8_t is_socket);//stream irq2in from a named pipe or a Unix socket
+int irq2_stream_parse();//move the complete numbers of the text read into the ring, return how many
+int irq2_stream_fill();//block until more of the stream is parsed or it ends
+int check_irq2_stream();//check_irq2in() on a stream
+int irq2_stream_close();
 int read_dmem_imem(char* dmem_file, char* imem_file);//read dmem_file,imem_file into d_mem, i_mem
 int write_dmemout(char* dmemout_file);//write d_mem to dmemout_file each line contains 8-hex digits
 int write_trace(char* trace_file);//write trace file containing pc instruction and registers
 int write_hwregtrace_leds_display7seg(char* hwregtrace_file, char* leds_file, char* display7seg_file);//write trace file containing pc instruction and registers
 int write_cycles_regout(char* cycles_file, char* regout_file);//write to files cycles number and registers at the end
+int step(unsigned long limit);//execute one cycle, or the cycles of a superinstruction ending by limit. return 0, 1 on halt, 2 on invalid opcode
+int run_until(unsigned long limit, uint8_t* halted);//step until cycles == limit or halt, return 2 on invalid opcode
+int save_state(struct machine_state* state, uint8_t halted);
+int restore_state(const struct machine_state* state);
+uint64_t state_hash(uint8_t halted);//digest of pc, registers, I/O registers, d_mem, disk, monitor, cycles and timers
+int state_diff(const struct machine_state* a, const struct machine_state* b);//print the components that differ
+int print_context(struct machine_state* state, const char* name, unsigned long from, unsigned long to);//print trace lines of cycles [from, to]
+int diverge(char* inputs_a[], char* inputs_b[]);//find the first cycle where two machines differ
+int verify_reference(unsigned long limit, uint8_t* halted);//step the reference path one instruction at a time until limit
+int verify_fast(uint8_t* halted);//run one block of the fast engine, or -verifyevery cycles of blocks
+int verify_dump(const struct machine_state* ref, const struct machine_state* fast);//print the state of both machines
+int verify(char* inputs[]);//run the fast engine and the reference in lockstep until their states differ
+int parse_args(int argc, char* argv[]);//parse leading options, return the index of the first positional argument or -1
+#ifdef SIM_HOSTPROF
+uint64_t hostprof_now();//monotonic clock in ns
+uint64_t hostprof_start();//start time of a timed call, 0 if the cycle isn't sampled
+int hostprof_stop(uint8_t phase);//add the time since hostprof_start() to phase, return hostprof_ret
+int hostprof_calibrate();//measure hostprof_overhead
+double hostprof_net_ns(uint8_t phase);//time of phase without the clock overhead
+long hostprof_file_size(char* path);//size of an output file, 0 if missing
+int hostprof_report(uint64_t run_ns, char* out_paths[], int out_count);//print MIPS, ns per cycle per phase, peak RSS and bytes written
+#endif
 uint32_t extend_sign(uint32_t reg, uint8_t sign_bit);//write to files cycles number and registers at the end
 int execute_instruction();//execute instruction
+int decode_imem();//decode i_mem into decoded and mark the superinstructions
+int is_branch(uint8_t opcode);//1 for beq, bne, blt, bgt, ble and bge
+int branch_taken(const struct decoded_inst* d);//condition of the branch d
+int fuse_begin(const struct decoded_inst* d);//set r0, imm1, imm2 and log the trace record of the instruction at pc
+int fuse_end_cycle(uint8_t was_busy);//finish a cycle inside a group, return 1 if an interrupt was taken
+int exec_fused();//execute the superinstruction at pc and finish all of its cycles
+int end_cycle();//run the peripherals and interrupts of the current cycle and advance it
+int pairprof_count();//count the instruction at pc in the pair/triple profile
+int pairprof_report();//print the hottest fall-through pairs and triples
+int handle_ipi();//send irq3 to the cores in the ipisend mask
+int dcache_init(const char* spec);//allocate the cache described by <words>,<line words>,<ways>,<wb|wt>,<miss penalty>
+int dcache_access(uint16_t addr, uint8_t rw);//look addr up, update the LRU order and add the stall cycles
+int dcache_report();//print the configuration, the totals and the hit/miss counts per pc
+int update_mem_hooks();//mem_hooks is on while a profiler, the cache, the cores or a watchpoint needs lw/sw
+int set_breakpoint(char type, uint32_t addr, uint32_t len, uint8_t set);//Z/z packet, return 0 or 1 if unsupported
+int gdb_listen(const char* address);//wait for the debugger on a TCP port of 127.0.0.1 or a Unix socket
+int gdb_getc();//blocking read of one byte, -1 when the debugger is gone
+int gdb_recv_packet(char* packet);//read and acknowledge a packet, return its length or -1
+int gdb_send_packet(const char* data);
+int gdb_interrupted();//1 if the debugger sent a ^C
+uint32_t gdb_hex_le32(const char* hex);//8 hex digits of a little endian register value
+int gdb_put_le32(char* hex, uint32_t value);
+uint32_t gdb_read_reg(int n);
+int gdb_write_reg(int n, uint32_t value);
+int gdb_mem_byte(uint32_t addr, uint8_t* value, uint8_t write);//read or write one byte of the address map, 1 if unmapped
+int gdb_target_xml(char* xml);//register description sent with qXfer:features:read
+int gdb_stop_reply(char* reply, uint8_t halted);
+int gdb_resume(uint8_t single_step, uint8_t* halted);//continue or step until a stop, return 2 on invalid opcode
+int gdb_serve(uint8_t* halted);//serve the debugger until the program halts, or it kills or detaches
+int core_mark_write(uint16_t addr);//record a store of the current core to addr for the quantum merge
+int core_barrier_wait();//wait for all cores, return 1 in exactly one of them
+int merge_quantum();//apply the shared effects of the quantum in a deterministic order, run by one core
+int core_path(char* buffer, const char* path, const char* kind, int id);//insert _<kind><id> before the extension of path
+int core_closing();//write the per-core output files of the current core and free its logs
+int core_run(int id);//simulate core id until all cores halted
+int run_cores();//run core_count cores on their own threads
+unsigned long quiet_until();//first cycle end_cycle() may do more than count the cycle in
+int lane_enter(int id);//make lane id the machine of the scalar engine
+int lane_leave(int id);//save the machine of the scalar engine into lane id
+int lane_ready(int id);//1 if lane id can run its next instruction in the SIMD group
+int lane_scalar(int id, uint16_t target);//step lane id on the scalar engine until it is ready at target, return 1 on invalid opcode
+int lanes_alu(uint8_t opcode, uint8_t rd, uint8_t rs, uint8_t rt, uint8_t rm, uint32_t mask);//ALU opcode 0-8 in the lanes of mask
+uint32_t lanes_compare(uint8_t opcode, uint8_t rs, uint8_t rt, uint32_t mask);//lanes of mask where branch opcode is taken
+int lanes_vector(uint32_t mask, uint16_t group_pc, unsigned long budget);//run the lanes of mask from group_pc in lockstep
+int run_lanes(char* paths[]);//load, run and write lane_count machines of the same program
+int memo_init();//allocate the recorded calls and the cache
+int memo_concretize(struct memo_call* call, int8_t base);//make the call depend on the entry value of base
+int memo_use(struct memo_call* call, uint8_t reg);//the value of reg decides something, concretize its base
+struct memo_value memo_add(struct memo_call* call, struct memo_value a, int32_t a_value, struct memo_value b, int32_t b_value);
+struct memo_value memo_sub(struct memo_call* call, struct memo_value a, struct memo_value b, int32_t b_value);
+struct memo_write* memo_find_write(struct memo_call* call, uint16_t addr);
+int memo_find_read(struct memo_call* call, uint16_t addr);//index of addr in the read words or -1
+int memo_add_read(struct memo_call* call, uint16_t addr, int32_t value);//return 1 if the call reads too many words
+int memo_add_write(struct memo_call* call, uint16_t addr, int32_t off, struct memo_value value);//return 1 if it can't
+int memo_record_call(struct memo_call* call, const struct decoded_inst* d);//follow the instruction at pc in a recorded call
+int memo_record();//follow the instruction at pc in every recorded call, before it executes
+uint32_t memo_hash(uint16_t pc, uint16_t mask, const int32_t* regs);
+struct memo_entry* memo_lookup(uint8_t link);//cache entry that applies to the call entered at pc, or NULL
+int memo_insert(struct memo_call* call, uint16_t ret_from);//add the effects of a finished pure call to the cache
+int memo_finish(struct memo_call* call, uint16_t ret_from);//a recorded call returned, return 1 if it wasn't cached
+int memo_compose(struct memo_call* call, const struct memo_entry* entry);//follow a cached call inside a recorded one
+int memo_apply(const struct memo_entry* entry);//execute a cached call entered at pc
+int memo_enter(uint8_t link);//a jal entered a call at pc, apply it from the cache or record it
+int memo_after(uint16_t prev_pc, uint8_t was_busy);//find the calls entered and returned by the instruction at prev_pc
+int memo_report();
 int init(char* imemin_path, char* dmemin_path, char* diskin_path, char* irq_path);//read input files abd put into structures
 int closing(char* dmemout_path, char* regout_path, char* trace_path, char* hwregtrace_path, char* cycles_path, char* leds_path, char* display7seg_path, char* diskout_path, char* monitor_txt_path, char* monitor_yuv_path);
 //write output files and free memory
@@ -128,6 +720,20 @@ const char* get_IO_reg_name(uint8_t io_addr) {
 	case MONITORADDR: return "monitoraddr";
 	case MONITORDATA: return "monitordata";
 	case MONITORCMD: return "monitorcmd";
+	case COREID: return "coreid";
+	case IRQ3ENABLE: return "irq3enable";
+	case IRQ3STATUS: return "irq3status";
+	case IPISEND: return "ipisend";
+	case MONITORLEN: return "monitorlen";
+	case MONITORHEIGHT: return "monitorheight";
+	case MONITORSRC: return "monitorsrc";
+	case DMASRC: return "dmasrc";
+	case DMADST: return "dmadst";
+	case DMALEN: return "dmalen";
+	case DMACMD: return "dmacmd";
+	case DMASTATUS: return "dmastatus";
+	case IRQ4ENABLE: return "irq4enable";
+	case IRQ4STATUS: return "irq4status";
 	default: return "UNKNOWN";
 	}
 }
@@ -136,13 +742,16 @@ int check_irq2in()
 {
     struct irq2in* ptr0;
     struct irq2in* ptr1 = data_log.irq2in_head;
+    if (irq2_stream.fd >= 0 && core_id == 0)
+        return check_irq2_stream();
     while (ptr1 != NULL && (ptr1->cycle) < cycles)
     {
         // free current ptr1 and jump to the next one (current ptr1 doesn't neccessary anymore)
         ptr0 = ptr1;
         ptr1 = ptr1->next;
         data_log.irq2in_head = ptr1;
-        free(ptr0);
+        if (!irq2in_keep)
+            free(ptr0);
     }
 
     if (ptr1 != NULL)
@@ -162,7 +771,9 @@ int ISR()
 
     int irq = (IORegister[IRQ0ENABLE] & IORegister[IRQ0STATUS]) |
         (IORegister[IRQ1ENABLE] & IORegister[IRQ1STATUS]) |
-        (IORegister[IRQ2ENABLE] & IORegister[IRQ2STATUS]);
+        (IORegister[IRQ2ENABLE] & IORegister[IRQ2STATUS]) |
+        (IORegister[IRQ3ENABLE] & IORegister[IRQ3STATUS]) |
+        (IORegister[IRQ4ENABLE] & IORegister[IRQ4STATUS]);
 
     if (irq == 1)
     {
@@ -218,26 +829,120 @@ int handle_disk()
 
     int32_t* buffer = &(d_mem[IORegister[DISKBUFFER]]);
 
-    if (IORegister[DISKCMD] == 1)
+    if (core_count > 1 && (IORegister[DISKCMD] == 1 || IORegister[DISKCMD] == 2))
+    {
+        // the disk is shared: the transfer is done by merge_quantum(), before the command completes
+        struct core* core = &cores[core_id];
+        core->has_disk = 1;
+        core->disk_cycle = cycles;
+        core->disk_cmd = IORegister[DISKCMD];
+        core->disk_sector = IORegister[DISKSECTOR];
+        core->disk_buffer = IORegister[DISKBUFFER];
+        if (IORegister[DISKCMD] == 2)
+            sec_cpy(core->disk_data, (uint32_t*)buffer);
+    }
+    else if (IORegister[DISKCMD] == 1)
         // diskcmd == read
-        sec_cpy(buffer, disk[IORegister[DISKSECTOR]]);
+        sec_cpy((uint32_t*)buffer, disk[IORegister[DISKSECTOR]]);
 
     else if (IORegister[DISKCMD] == 2)
         // diskcmd == write
-        sec_cpy(disk[IORegister[DISKSECTOR]], buffer);
+        sec_cpy(disk[IORegister[DISKSECTOR]], (uint32_t*)buffer);
+
+    if (memprof != NULL && (IORegister[DISKCMD] == 1 || IORegister[DISKCMD] == 2))
+        // disk read writes the buffer, disk write reads it
+        memprof_dma(IORegister[DISKBUFFER], SECTOR_SIZE, IORegister[DISKCMD] == 1 ? 2 : 1);
 
 
     IORegister[DISKCMD] = 0; // set diskcmd=no command
     return 0;
 }
 
+int handle_dma()
+{
+    if (IORegister[DMASTATUS])
+    {
+        if (cycles != dma_done_cycle)
+            // busy
+            return 0;
+        IORegister[DMASTATUS] = 0; // free dmastatus
+        IORegister[DMACMD] = 0;
+        IORegister[IRQ4STATUS] = 1; // Notify the proccessor: the copy or fill is done
+        return 0;
+    }
+
+    uint32_t cmd = IORegister[DMACMD];
+    if (!cmd)
+        return 0;
+    if (cmd != DMA_COPY && cmd != DMA_FILL)
+    {
+        // unknown command: ignored
+        IORegister[DMACMD] = 0;
+        return 0;
+    }
+
+    // dmasrc is the fill value of DMA_FILL. The transfer is done now, like the disk's: the program
+    // must not touch the buffers before dmastatus is free again.
+    uint32_t src = IORegister[DMASRC] & 0xfff;
+    uint32_t dst = IORegister[DMADST] & 0xfff;
+    uint32_t len = IORegister[DMALEN];
+    uint32_t i, n;
+
+    if (len > MEMORY_SIZE - dst)
+        len = MEMORY_SIZE - dst;
+    if (cmd == DMA_COPY)
+    {
+        if (len > MEMORY_SIZE - src)
+            len = MEMORY_SIZE - src;
+        memmove(&d_mem[dst], &d_mem[src], len * sizeof(int32_t));
+        if (memprof != NULL)
+            memprof_dma(src, len, 1);
+    }
+    else if (len != 0)
+    {
+        uint32_t value = IORegister[DMASRC];
+        if ((value & 0xff) * 0x01010101u == value)
+            memset(&d_mem[dst], value & 0xff, len * sizeof(int32_t));
+        else
+        {
+            // double the filled prefix
+            d_mem[dst] = value;
+            for (i = 1; i < len; i += n)
+            {
+                n = i < len - i ? i : len - i;
+                memcpy(&d_mem[dst + i], &d_mem[dst], n * sizeof(int32_t));
+            }
+        }
+    }
+    if (memprof != NULL)
+        memprof_dma(dst, len, 2);
+    if (core_count > 1)
+        for (i = 0; i < len; i++)
+            core_mark_write(dst + i);
+
+    IORegister[DMASTATUS] = 1;
+    dma_done_cycle = cycles + (len + dma_bandwidth - 1) / dma_bandwidth;
+    if (dma_done_cycle == cycles)
+        dma_done_cycle++; // an empty transfer still takes a cycle
+    return 0;
+}
+
 int handle_monitor()
 {
-    if (!IORegister[MONITORCMD])
-        // monitorcmd == 0
+    if (monitor_done_cycle)
+    {
+        // a block command is running, monitorcmd reads nonzero until its last cycle
+        if (cycles < monitor_done_cycle)
+            return 0;
+        monitor_done_cycle = 0;
+        IORegister[MONITORCMD] = 0;
         return 0;
+    }
 
-    IORegister[MONITORCMD] = 0; // reset monitorcmd since the method about to execute write inst'.
+    uint32_t cmd = IORegister[MONITORCMD];
+    if (!cmd)
+        // monitorcmd == 0
+        return 0;
 
     uint16_t monitoraddr = IORegister[MONITORADDR];
     uint8_t monitordata = IORegister[MONITORDATA];
@@ -245,155 +950,778 @@ int handle_monitor()
     uint8_t row = monitoraddr >> 8;   // row is the 8-MSB of monitoraddr
     uint8_t col = monitoraddr & 0xff; // col is the 8-LSB of monitoraddr
 
-    monitor[row][col] = monitordata;
+    // span length or rectangle width, clipped to the screen
+    uint32_t width = IORegister[MONITORLEN];
+    uint32_t height = IORegister[MONITORHEIGHT];
+    unsigned long cost = 1;
+
+    switch (cmd)
+    {
+    case MONITOR_SPAN:
+        // a span runs in raster order and wraps to the next rows
+        // the 16-bit monitoraddr is always on the screen, so the pixels left are in 1..MONITOR_SIZE * MONITOR_SIZE
+        if (width > (uint32_t)MONITOR_SIZE * MONITOR_SIZE - monitoraddr)
+            width = (uint32_t)MONITOR_SIZE * MONITOR_SIZE - monitoraddr;
+        cost = (width + MONITOR_PORT_PIXELS - 1) / MONITOR_PORT_PIXELS;
+        if (monitor_fill(0, monitoraddr, width, 1, monitordata) != 0)
+            return 1;
+        break;
+    case MONITOR_RECT:
+    case MONITOR_BLIT:
+        if (width > (uint32_t)(MONITOR_SIZE - col))
+            width = MONITOR_SIZE - col;
+        if (height > (uint32_t)(MONITOR_SIZE - row))
+            height = MONITOR_SIZE - row;
+        cost = height * ((width + MONITOR_PORT_PIXELS - 1) / MONITOR_PORT_PIXELS);
+        if (cmd == MONITOR_RECT ? monitor_fill(row, col, width, height, monitordata) != 0 :
+            monitor_blit(row, col, width, height, IORegister[MONITORSRC] & 0xfff) != 0)
+            return 1;
+        break;
+    default:
+        // monitorcmd == 1 (and unknown commands, as before): write one pixel
+        if (core_count > 1)
+            // the monitor is shared: merge_quantum() writes it
+            monitor_log(monitoraddr, monitordata);
+        else
+            monitor[row][col] = monitordata;
+        break;
+    }
+
+    if (cost > 1)
+        monitor_done_cycle = cycles + cost - 1;
+    else
+        IORegister[MONITORCMD] = 0; // reset monitorcmd since the command is done
     return 0;
 }
 
-
-int read_diskin(char* diskin_file){
-    FILE* fdiskin;
-    fdiskin = fopen(diskin_file, "r");
-    if (fdiskin == NULL)
+int monitor_log(uint16_t addr, uint8_t data)
+{
+    struct core* core = &cores[core_id];
+    if (core->monitor_count == core->monitor_capacity)
     {
-        err_msg("open file");
-        return 1;
+        uint32_t capacity = core->monitor_capacity ? 2 * core->monitor_capacity : 256;
+        struct monitor_write* writes = (struct monitor_write*)realloc(core->monitor_writes, capacity * sizeof(struct monitor_write));
+        if (writes == NULL)
+        {
+            err_msg("malloc");
+            return 1;
+        }
+        core->monitor_writes = writes;
+        core->monitor_capacity = capacity;
     }
-    int sector, i, eof_flag = 0;
-    for (sector = 0; !eof_flag && sector < DISK_SIZE; sector++)
+    core->monitor_writes[core->monitor_count].cycle = cycles;
+    core->monitor_writes[core->monitor_count].addr = addr;
+    core->monitor_writes[core->monitor_count].data = data;
+    core->monitor_count++;
+    return 0;
+}
+
+int monitor_fill(uint16_t row, uint16_t col, uint32_t width, uint16_t height, uint8_t data)
+{
+    // rows of a span fill start at col = monitoraddr, the monitor is one contiguous array
+    uint8_t* line = &monitor[0][0] + row * MONITOR_SIZE + col;
+    uint32_t i, j;
+
+    for (i = 0; i < height; i++, line += MONITOR_SIZE)
     {
-        for (i = 0; !eof_flag && i < SECTOR_SIZE; i++)
+        if (core_count > 1)
         {
-            if (fscanf(fdiskin, "%X", &(disk[sector][i])) != 1)
-                eof_flag = 1;
+            for (j = 0; j < width; j++)
+                if (monitor_log((uint16_t)(line - &monitor[0][0] + j), data) != 0)
+                    return 1;
         }
+        else
+            memset(line, data, width);
     }
-
-    if (fclose(fdiskin) != 0)
-        err_msg("close file");
     return 0;
 }
 
-int write_diskout(char* diskout_file){
-    FILE* fdiskout;
-    int last_nonzero_line = -1, sector, i, eof_flag = 0;
+int monitor_blit(uint16_t row, uint16_t col, uint16_t width, uint16_t height, uint16_t src)
+{
+    // source rows are packed 4 pixels per d_mem word, lowest byte first, each row starts on a new word
+    uint32_t row_words = (width + MONITOR_PORT_PIXELS - 1) / MONITOR_PORT_PIXELS;
+    uint32_t i, j, len;
 
-    for (sector = 0; sector < DISK_SIZE; sector++)
+    for (i = 0; i < height; i++, src += row_words)
     {
-        for (i = 0; i < SECTOR_SIZE; i++)
+        if (src >= MEMORY_SIZE)
+            break;
+        len = width;
+        if (len > (MEMORY_SIZE - src) * sizeof(int32_t))
+            len = (MEMORY_SIZE - src) * sizeof(int32_t);
+        if (memprof != NULL)
+            memprof_dma(src, (len + MONITOR_PORT_PIXELS - 1) / MONITOR_PORT_PIXELS, 1);
+        if (core_count > 1)
         {
-            if (disk[sector][i] != 0)
-            {
-                last_nonzero_line = SECTOR_SIZE * sector + i;
-            }
+            for (j = 0; j < len; j++)
+                if (monitor_log((row + i) * MONITOR_SIZE + col + j, (uint8_t)(d_mem[src + j / 4] >> (8 * (j % 4)))) != 0)
+                    return 1;
         }
+        else
+            // little-endian host: the bytes of d_mem are the pixels in order
+            memcpy(&monitor[row + i][col], (uint8_t*)&d_mem[src], len);
+    }
+    return 0;
+}
+
+int handle_ipi()
+{
+    uint32_t targets = IORegister[IPISEND];
+
+    IORegister[IPISEND] = 0;
+    if (core_count > 1)
+        // delivered by merge_quantum()
+        cores[core_id].ipi_out |= targets;
+    else if (targets & 1)
+        IORegister[IRQ3STATUS] = 1;
+    return 0;
+}
+
+int mem_access(uint16_t addr, uint8_t rw)
+{
+    if (core_count > 1 && rw == 2)
+        core_mark_write(addr);
+    if (dcache != NULL)
+        dcache_access(addr, rw);
+    if (watchpoint_count != 0 && (watchpoints[addr] & rw))
+    {
+        // stop after this instruction
+        debug_stop = 1;
+        watch_addr = addr;
+        watch_rw = rw;
     }
+    if (memprof != NULL)
+        memprof_access(addr, rw);
+    return 0;
+}
 
-    fdiskout = fopen(diskout_file, "w");
-    if (fdiskout == NULL)
+int memprof_init(unsigned long ws_window)
+{
+    memprof = (struct mem_profile*)calloc(1, sizeof(struct mem_profile));
+    if (memprof == NULL)
     {
-        err_msg("open file");
+        err_msg("malloc");
         return 1;
     }
+    memprof->ws_window = ws_window;
+    memprof->ws_prev[MEMORY_SIZE] = memprof->ws_next[MEMORY_SIZE] = MEMORY_SIZE;
+    memprof->ws_min = ~0u;
+    memset(memprof->first_cycle, 0xff, sizeof(memprof->first_cycle)); // ~0: never accessed
+    mem_hooks = 1;
+    return 0;
+}
 
-    if (last_nonzero_line == -1)
-        eof_flag = 1;
+int memprof_ws_unlink(uint16_t addr)
+{
+    memprof->ws_next[memprof->ws_prev[addr]] = memprof->ws_next[addr];
+    memprof->ws_prev[memprof->ws_next[addr]] = memprof->ws_prev[addr];
+    return 0;
+}
 
-    for (sector = 0; sector < DISK_SIZE && !eof_flag; sector++)
+int memprof_advance_window()
+{
+    unsigned long end;
+    uint16_t oldest;
+
+    // the working set only changes at an access or when an address leaves, so it is accounted a run of cycles at a time
+    for (;;)
     {
-        for (i = 0; i < SECTOR_SIZE && !eof_flag; i++)
+        oldest = memprof->ws_next[MEMORY_SIZE];
+        while (memprof->ws_size != 0 && memprof->last_cycle[oldest] + memprof->ws_window <= memprof->ws_cycle)
         {
-            fprintf(fdiskout, "%08X\n", disk[sector][i]);
-
-            if (SECTOR_SIZE * sector + i >= last_nonzero_line)
-                // this current line is the last line != 0, stop fprintf
-                eof_flag = 1;
+            memprof_ws_unlink(oldest);
+            memprof->ws_live[oldest] = 0;
+            memprof->ws_size--;
+            oldest = memprof->ws_next[MEMORY_SIZE];
+        }
+        if (memprof->ws_cycle >= cycles)
+            break;
 
+        end = (memprof->ws_cycle / memprof->ws_window + 1) * memprof->ws_window;
+        if (end > cycles)
+            end = cycles;
+        if (memprof->ws_size != 0 && memprof->last_cycle[oldest] + memprof->ws_window < end)
+            end = memprof->last_cycle[oldest] + memprof->ws_window;
+        memprof->ws_sum += (uint64_t)memprof->ws_size * (end - memprof->ws_cycle);
+        if (memprof->ws_size < memprof->ws_min)
+            memprof->ws_min = memprof->ws_size;
+        if (memprof->ws_size > memprof->ws_max)
+        {
+            memprof->ws_max = memprof->ws_size;
+            memprof->ws_max_cycle = memprof->ws_cycle;
         }
+        if (memprof->ws_size > memprof->ws_peak)
+            memprof->ws_peak = memprof->ws_size;
+        memprof->ws_cycle = end;
+        if (end % memprof->ws_window == 0 && memprof_ws_record() != 0)
+            return 1;
     }
-
-    if (fclose(fdiskout) != 0)
-        err_msg("close file");
     return 0;
 }
 
-int write_monitor(char* monitor_file, uint8_t is_binary){
-    FILE* fmonitor;
-    if (is_binary)
-        fmonitor = fopen(monitor_file, "wb");
-    else
-        fmonitor = fopen(monitor_file, "w");
-
-    if (fmonitor == NULL)
+int memprof_ws_record()
+{
+    if (memprof->ws_count == memprof->ws_capacity)
     {
-        err_msg("open file");
-        return 1;
+        unsigned long capacity = memprof->ws_capacity ? 2 * memprof->ws_capacity : 1024;
+        uint32_t* series = (uint32_t*)realloc(memprof->ws_series, capacity * sizeof(uint32_t));
+        if (series == NULL)
+        {
+            err_msg("malloc");
+            return 1;
+        }
+        memprof->ws_series = series;
+        memprof->ws_capacity = capacity;
     }
+    memprof->ws_series[memprof->ws_count++] = memprof->ws_peak;
+    memprof->ws_peak = 0;
+    return 0;
+}
 
-    if (is_binary)
-    {
-        fwrite(monitor, sizeof(uint8_t), MONITOR_SIZE * MONITOR_SIZE, fmonitor);
-
-        if(fclose(fmonitor) != 0)
-            err_msg("close file");
+int memprof_touch(uint16_t addr)
+{
+    memprof_advance_window();
+    if (memprof->first_cycle[addr] == ~0UL)
+        memprof->first_cycle[addr] = cycles;
+    memprof->last_cycle[addr] = cycles;
 
-        return 0;
+    // addr becomes the newest live address
+    if (memprof->ws_live[addr])
+        memprof_ws_unlink(addr);
+    else
+    {
+        memprof->ws_live[addr] = 1;
+        memprof->ws_size++;
     }
+    memprof->ws_prev[addr] = memprof->ws_prev[MEMORY_SIZE];
+    memprof->ws_next[addr] = MEMORY_SIZE;
+    memprof->ws_next[memprof->ws_prev[MEMORY_SIZE]] = addr;
+    memprof->ws_prev[MEMORY_SIZE] = addr;
+    return 0;
+}
 
+int memprof_access(uint16_t addr, uint8_t rw)
+{
+    if (rw == 1)
+        memprof->reads[addr]++;
+    else
+        memprof->writes[addr]++;
+    memprof_touch(addr);
 
-    uint16_t i, j;
-    for (i = 0; i < MONITOR_SIZE; i++)
+    if (memprof->pc_accesses[pc]++ != 0)
     {
-        for (j = 0; j < MONITOR_SIZE; j++)
-        {
+        // stride is the 12-bit signed distance from the previous address accessed by this pc
+        int16_t stride = (int16_t)extend_sign((addr - memprof->pc_last_addr[pc]) & 0xfff, 11);
+        if (memprof->pc_accesses[pc] > 2 && stride != memprof->pc_stride[pc])
+            memprof->pc_stride_changes[pc]++;
+        memprof->pc_stride[pc] = stride;
 
-            fprintf(fmonitor, "%02X\n", monitor[i][j]);
+        if (memprof->pc_major_votes[pc] == 0)
+        {
+            memprof->pc_major_stride[pc] = stride;
+            memprof->pc_major_votes[pc] = 1;
+            memprof->pc_major_hits[pc] = 1;
+        }
+        else if (stride == memprof->pc_major_stride[pc])
+        {
+            memprof->pc_major_votes[pc]++;
+            memprof->pc_major_hits[pc]++;
         }
+        else
+            memprof->pc_major_votes[pc]--;
     }
-
-    if (fclose(fmonitor) != 0)
-        err_msg("close file");
+    memprof->pc_last_addr[pc] = addr;
     return 0;
 }
 
-int update_log_status(){
-    int i;
-    struct status* status_p = (struct status*)malloc(sizeof(struct status));
-    if (status_p == NULL)
+int memprof_dma(uint32_t buffer, uint32_t len, uint8_t rw)
+{
+    uint32_t i;
+    uint16_t addr;
+    for (i = 0; i < len; i++)
     {
-        err_msg("malloc");
-        return 1;
+        addr = (buffer + i) & 0xfff;
+        if (rw == 1)
+            memprof->dma_reads[addr]++;
+        else
+            memprof->dma_writes[addr]++;
+        memprof_touch(addr);
     }
-    status_p->pc = pc;
-    status_p->inst = i_mem[pc];
-    status_p->next = NULL;
-    for (i = 0; i < REG_SIZE; i++)
-        status_p->r[i] = r[i];
+    return 0;
+}
+
+
+int is_image(char* path)
+{
+    char magic[4];
+    FILE* f = fopen(path, "rb");
+    if (f == NULL)
+        return 0; // the text reader reports it
+    int found = fread(magic, 1, sizeof(magic), f) == sizeof(magic) && memcmp(magic, IMAGE_MAGIC, sizeof(magic)) == 0;
+    fclose(f);
+    return found;
+}
 
-    if (data_log.status_head == NULL)
+const uint8_t* map_file(char* path, size_t* size)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return NULL;
+    LARGE_INTEGER file_size;
+    HANDLE mapping = NULL;
+    const uint8_t* data = NULL;
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart != 0)
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping != NULL)
     {
-        data_log.status_head = status_p;
-        data_log.status_tail = status_p;
+        data = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(mapping);
     }
-    else
+    CloseHandle(file);
+    *size = (size_t)file_size.QuadPart;
+    return data;
+#else
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
     {
-        data_log.status_tail->next = status_p;
-        data_log.status_tail = status_p;
+        close(fd);
+        return NULL;
     }
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    *size = st.st_size;
+    return data == MAP_FAILED ? NULL : (const uint8_t*)data;
+#endif
+}
 
+int unmap_file(const uint8_t* data, size_t size)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(data);
+#else
+    munmap((void*)data, size);
+#endif
     return 0;
 }
 
-int update_log_hw_access(uint8_t rw, uint8_t IOReg){
-    uint32_t data = IORegister[IOReg];
-    struct hw_access* hw_acc_p = (struct hw_access*)malloc(sizeof(struct hw_access));
-    if (hw_acc_p == NULL)
+uint32_t image_checksum(const uint8_t* data, size_t size)
+{
+    uint32_t hash = 2166136261u;
+    size_t i;
+    for (i = 0; i < size; i++)
     {
-        err_msg("malloc");
-        return 1;
+        hash ^= data[i];
+        hash *= 16777619u;
     }
-    hw_acc_p->cycle = cycles;
-    hw_acc_p->rw = rw;
-    hw_acc_p->IOReg = IOReg;
+    return hash;
+}
+
+int load_image(char* path, uint32_t type)
+{
+    size_t size, offset, bytes;
+    struct image_header header;
+    struct image_section section;
+    uint32_t n, limit, word_size;
+    uint8_t* dest;
+
+    const uint8_t* data = map_file(path, &size);
+    if (data == NULL)
+    {
+        err_msg("open file");
+        return 1;
+    }
+    if (size >= sizeof(header))
+        memcpy(&header, data, sizeof(header));
+    if (size < sizeof(header) || header.version != IMAGE_VERSION || header.size != size ||
+        image_checksum(data + sizeof(header), size - sizeof(header)) != header.checksum)
+    {
+        fprintf(stderr, "%s: bad binary image header or checksum\n", path);
+        unmap_file(data, size);
+        return 1;
+    }
+
+    offset = sizeof(header);
+    for (n = 0; n < header.section_count; n++)
+    {
+        if (size - offset < sizeof(section))
+            break;
+        memcpy(&section, data + offset, sizeof(section));
+        offset += sizeof(section);
+        if (section.type == IMAGE_IMEM)
+        {
+            word_size = sizeof(uint64_t);
+            limit = MEMORY_SIZE;
+            dest = (uint8_t*)i_mem;
+        }
+        else if (section.type == IMAGE_DMEM)
+        {
+            word_size = sizeof(int32_t);
+            limit = MEMORY_SIZE;
+            dest = (uint8_t*)d_mem;
+        }
+        else if (section.type == IMAGE_DISK)
+        {
+            word_size = sizeof(uint32_t);
+            limit = DISK_SIZE * SECTOR_SIZE;
+            dest = (uint8_t*)disk;
+        }
+        else
+            break;
+        bytes = (size_t)section.count * word_size;
+        if (section.start > limit || section.count > limit - section.start || bytes > size - offset)
+            break;
+        if (section.type == type)
+            // the image is little-endian like the host
+            memcpy(dest + (size_t)section.start * word_size, data + offset, bytes);
+        offset += bytes;
+    }
+    unmap_file(data, size);
+    if (n != header.section_count)
+    {
+        fprintf(stderr, "%s: bad binary image section %u\n", path, n);
+        return 1;
+    }
+    return 0;
+}
+
+int read_diskin(char* diskin_file){
+    if (is_image(diskin_file))
+        return load_image(diskin_file, IMAGE_DISK);
+
+    FILE* fdiskin;
+    fdiskin = fopen(diskin_file, "r");
+    if (fdiskin == NULL)
+    {
+        err_msg("open file");
+        return 1;
+    }
+    int sector, i, eof_flag = 0;
+    for (sector = 0; !eof_flag && sector < DISK_SIZE; sector++)
+    {
+        for (i = 0; !eof_flag && i < SECTOR_SIZE; i++)
+        {
+            if (fscanf(fdiskin, "%X", &(disk[sector][i])) != 1)
+                eof_flag = 1;
+        }
+    }
+
+    if (fclose(fdiskin) != 0)
+        err_msg("close file");
+    return 0;
+}
+
+int write_diskout(char* diskout_file){
+    struct out_file fdiskout;
+    int last_nonzero_line = -1, sector, i, eof_flag = 0;
+
+    for (sector = 0; sector < DISK_SIZE; sector++)
+    {
+        for (i = 0; i < SECTOR_SIZE; i++)
+        {
+            if (disk[sector][i] != 0)
+            {
+                last_nonzero_line = SECTOR_SIZE * sector + i;
+            }
+        }
+    }
+
+    if (out_open(&fdiskout, diskout_file, 0) != 0)
+        return 1;
+
+    if (last_nonzero_line == -1)
+        eof_flag = 1;
+
+    for (sector = 0; sector < DISK_SIZE && !eof_flag; sector++)
+    {
+        for (i = 0; i < SECTOR_SIZE && !eof_flag; i++)
+        {
+            out_printf(&fdiskout, "%08X\n", disk[sector][i]);
+
+            if (SECTOR_SIZE * sector + i >= last_nonzero_line)
+                // this current line is the last line != 0, stop fprintf
+                eof_flag = 1;
+
+        }
+    }
+
+    return out_close(&fdiskout, diskout_file);
+}
+
+int write_monitor(char* monitor_file, uint8_t is_binary){
+    struct out_file fmonitor;
+    if (out_open(&fmonitor, monitor_file, is_binary) != 0)
+        return 1;
+
+    if (is_binary)
+    {
+        out_write(&fmonitor, monitor, MONITOR_SIZE * MONITOR_SIZE);
+        return out_close(&fmonitor, monitor_file);
+    }
+
+
+    uint16_t i, j;
+    for (i = 0; i < MONITOR_SIZE; i++)
+    {
+        for (j = 0; j < MONITOR_SIZE; j++)
+        {
+
+            out_printf(&fmonitor, "%02X\n", monitor[i][j]);
+        }
+    }
+
+    return out_close(&fmonitor, monitor_file);
+}
+
+int digest_init(struct digest* d)
+{
+    d->v[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+    d->v[1] = XXH_PRIME64_2;
+    d->v[2] = 0;
+    d->v[3] = 0 - XXH_PRIME64_1;
+    d->buffered = 0;
+    d->total = 0;
+    return 0;
+}
+
+int digest_update(struct digest* d, const void* data, size_t size)
+{
+    const uint8_t* p = (const uint8_t*)data;
+    d->total += size;
+
+    if (d->buffered + size < 32)
+    {
+        memcpy(d->buffer + d->buffered, p, size);
+        d->buffered += (uint32_t)size;
+        return 0;
+    }
+    if (d->buffered)
+    {
+        // complete the buffered stripe
+        uint32_t fill = 32 - d->buffered;
+        memcpy(d->buffer + d->buffered, p, fill);
+        d->v[0] = xxh64_round(d->v[0], xxh_read64(d->buffer));
+        d->v[1] = xxh64_round(d->v[1], xxh_read64(d->buffer + 8));
+        d->v[2] = xxh64_round(d->v[2], xxh_read64(d->buffer + 16));
+        d->v[3] = xxh64_round(d->v[3], xxh_read64(d->buffer + 24));
+        p += fill;
+        size -= fill;
+        d->buffered = 0;
+    }
+    for (; size >= 32; p += 32, size -= 32)
+    {
+        d->v[0] = xxh64_round(d->v[0], xxh_read64(p));
+        d->v[1] = xxh64_round(d->v[1], xxh_read64(p + 8));
+        d->v[2] = xxh64_round(d->v[2], xxh_read64(p + 16));
+        d->v[3] = xxh64_round(d->v[3], xxh_read64(p + 24));
+    }
+    memcpy(d->buffer, p, size);
+    d->buffered = (uint32_t)size;
+    return 0;
+}
+
+uint64_t digest_final(const struct digest* d)
+{
+    const uint8_t* p = d->buffer;
+    uint32_t left = d->buffered;
+    uint64_t h;
+    int i;
+
+    if (d->total >= 32)
+    {
+        h = XXH_ROTL64(d->v[0], 1) + XXH_ROTL64(d->v[1], 7) + XXH_ROTL64(d->v[2], 12) + XXH_ROTL64(d->v[3], 18);
+        for (i = 0; i < 4; i++)
+        {
+            h ^= xxh64_round(0, d->v[i]);
+            h = h * XXH_PRIME64_1 + XXH_PRIME64_4;
+        }
+    }
+    else
+        h = XXH_PRIME64_5;
+    h += d->total;
+
+    for (; left >= 8; p += 8, left -= 8)
+    {
+        h ^= xxh64_round(0, xxh_read64(p));
+        h = XXH_ROTL64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (left >= 4)
+    {
+        h ^= (uint64_t)(p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24) * XXH_PRIME64_1;
+        h = XXH_ROTL64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+        left -= 4;
+    }
+    for (; left > 0; p++, left--)
+    {
+        h ^= *p * XXH_PRIME64_5;
+        h = XXH_ROTL64(h, 11) * XXH_PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+int out_open(struct out_file* out, char* path, uint8_t is_binary)
+{
+    if (digest_mode)
+    {
+        out->f = NULL;
+        return digest_init(&out->digest);
+    }
+
+    out->f = fopen(path, is_binary ? "wb" : "w");
+    if (out->f == NULL)
+    {
+        err_msg("open file");
+        return 1;
+    }
+    return 0;
+}
+
+int out_write(struct out_file* out, const void* data, size_t size)
+{
+    if (out->f == NULL)
+        return digest_update(&out->digest, data, size);
+    fwrite(data, 1, size, out->f);
+    return 0;
+}
+
+int out_printf(struct out_file* out, const char* format, ...)
+{
+    char line[256];
+    int len;
+    va_list args;
+
+    va_start(args, format);
+    if (out->f != NULL)
+        vfprintf(out->f, format, args);
+    else
+    {
+        len = vsnprintf(line, sizeof(line), format, args);
+        digest_update(&out->digest, line, len);
+    }
+    va_end(args);
+    return 0;
+}
+
+int out_close(struct out_file* out, char* path)
+{
+    if (out->f == NULL)
+    {
+        printf("%016llx %llu %s\n", (unsigned long long)digest_final(&out->digest),
+            (unsigned long long)out->digest.total, path);
+        return 0;
+    }
+
+    if (fclose(out->f) != 0)
+        err_msg("close file");
+    return 0;
+}
+
+int format_trace_line(char* line, uint16_t line_pc, uint64_t inst, const int32_t* regs)
+{
+    static const char upper[] = "0123456789ABCDEF", lower[] = "0123456789abcdef";
+    char* p = line;
+    int i, j;
+
+    for (j = 2; j >= 0; j--)
+        *p++ = upper[(line_pc >> (4 * j)) & 0xf];   // pc
+    *p++ = ' ';
+    for (j = 11; j >= 0; j--)
+        *p++ = upper[(inst >> (4 * j)) & 0xf];      // inst
+    for (i = 0; i < REG_SIZE; i++)
+    {
+        *p++ = ' ';
+        for (j = 7; j >= 0; j--)
+            *p++ = lower[((uint32_t)regs[i] >> (4 * j)) & 0xf]; // R[0] ... R[15]
+    }
+    *p++ = '\n';
+    return (int)(p - line);
+}
+
+int format_hw_access(char* line, unsigned long cycle, uint8_t rw, uint8_t IOReg, uint32_t data)
+{
+    return snprintf(line, 64, "%lu %s %s %08x\n", cycle, rw == 1 ? "READ" : "WRITE", get_IO_reg_name(IOReg), data);
+}
+
+int log_hw_access_outputs(unsigned long cycle, uint8_t rw, uint8_t IOReg, uint32_t data, struct out_file* hwregtrace, struct out_file* leds, struct out_file* display7seg)
+{
+    char line[64];
+    int len = format_hw_access(line, cycle, rw, IOReg, data);
+    out_write(hwregtrace, line, len);
+
+    if (rw == 2){
+        if (IOReg == LEDS)
+            out_printf(leds, "%lu %08x\n", cycle, data);
+        else if (IOReg == DISPLAY7SEG)
+            out_printf(display7seg, "%lu %08x\n", cycle, data);
+    }
+    return 0;
+}
+
+int log_status(struct log* log, struct out_file* trace, uint16_t status_pc, const int32_t* regs){
+    int i;
+    if (digest_mode)
+    {
+        char line[TRACE_LINE_SIZE];
+        int len = format_trace_line(line, status_pc, i_mem[status_pc], regs);
+        return digest_update(&trace->digest, line, len);
+    }
+
+    struct status* status_p = (struct status*)malloc(sizeof(struct status));
+    if (status_p == NULL)
+    {
+        err_msg("malloc");
+        return 1;
+    }
+    status_p->pc = status_pc;
+    status_p->inst = i_mem[status_pc];
+    status_p->next = NULL;
+    for (i = 0; i < REG_SIZE; i++)
+        status_p->r[i] = regs[i];
+
+    if (log->status_head == NULL)
+    {
+        log->status_head = status_p;
+        log->status_tail = status_p;
+    }
+    else
+    {
+        log->status_tail->next = status_p;
+        log->status_tail = status_p;
+    }
+
+    return 0;
+}
+
+int update_log_status(){
+    return log_status(&data_log, &trace_out, pc, r);
+}
+
+int update_log_hw_access(uint8_t rw, uint8_t IOReg){
+    uint32_t data = IORegister[IOReg];
+    if (hwtrace_off)
+        return 0;
+    if (digest_mode)
+        return log_hw_access_outputs(cycles, rw, IOReg, data, &hwregtrace_out, &leds_out, &display7seg_out);
+
+    struct hw_access* hw_acc_p = (struct hw_access*)malloc(sizeof(struct hw_access));
+    if (hw_acc_p == NULL)
+    {
+        err_msg("malloc");
+        return 1;
+    }
+    hw_acc_p->cycle = cycles;
+    hw_acc_p->rw = rw;
+    hw_acc_p->IOReg = IOReg;
     hw_acc_p->data = data;
 
     hw_acc_p->next = NULL;
@@ -454,14 +1782,19 @@ int free_log_irq2in(){
 
 int read_irq2in(char* irq2in_file){
     FILE* firq2in;
+    unsigned long i;
+#ifndef _WIN32
+    struct stat st;
+    if (stat(irq2in_file, &st) == 0 && (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode)))
+        return irq2_stream_open(irq2in_file, S_ISSOCK(st.st_mode));
+#endif
     firq2in = fopen(irq2in_file, "r");
     if (firq2in == NULL)
     {
         err_msg("open file");
         return 1;
     }
-    unsigned long i;
-    while (fscanf(firq2in, "%d", &i) == 1)
+    while (fscanf(firq2in, "%lu", &i) == 1)
     {
         // add i to the end of the linked list
         struct irq2in* irq2in_p = (struct irq2in*)malloc(sizeof(struct irq2in));
@@ -490,55 +1823,225 @@ int read_irq2in(char* irq2in_file){
     return 0;
 }
 
-int read_dmem_imem(char* dmem_file, char* imem_file){
-    FILE* fdmem, * fimem;
-    fdmem = fopen(dmem_file, "r");
-    fimem = fopen(imem_file, "r");
-    if (fdmem == NULL || fimem == NULL)
+int irq2_stream_open(char* path, uint8_t is_socket)
+{
+#ifdef _WIN32
+    return 1;
+#else
+    if (irq2in_keep)
+    {
+        // -diverge restores earlier states, a stream can't be read again
+        fprintf(stderr, "-diverge needs irq2in files, %s is a stream\n", path);
+        return 1;
+    }
+    if (lanes_file != NULL)
+    {
+        // the stream state is global, the lanes would share it
+        fprintf(stderr, "-lanes needs irq2in files, %s is a stream\n", path);
+        return 1;
+    }
+    if (is_socket)
+    {
+        struct sockaddr_un addr;
+        if (strlen(path) >= sizeof(addr.sun_path))
+        {
+            fprintf(stderr, "irq2in socket path is too long\n");
+            return 1;
+        }
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path);
+        irq2_stream.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (irq2_stream.fd < 0 || connect(irq2_stream.fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+        {
+            err_msg("connect");
+            return 1;
+        }
+    }
+    else if ((irq2_stream.fd = open(path, O_RDONLY)) < 0) // waits for the producer to open the pipe
     {
         err_msg("open file");
         return 1;
     }
-    uint16_t i;
-    for (i = 0; i < MEMORY_SIZE && fscanf(fdmem, "%x", &d_mem[i]) == 1; i++)
-        ;
-    for (i = 0; i < MEMORY_SIZE && fscanf(fimem, "%llx", &i_mem[i]) == 1; i++)
-        ;
-
-    if (fclose(fdmem) != 0 || fclose(fimem) != 0)
-        err_msg("close file");
+    irq2_stream.head = irq2_stream.count = 0;
+    irq2_stream.settled = 0;
+    irq2_stream.eof = 0;
+    irq2_stream.text_start = irq2_stream.text_len = 0;
+    irq2_stream.events = irq2_stream.stalls = 0;
     return 0;
+#endif
 }
 
-int write_dmemout(char* dmemout_file)
+int irq2_stream_parse()
 {
-    int i;
+    int parsed = 0;
+    while (irq2_stream.count < IRQ2_RING_SIZE)
+    {
+        char* p = irq2_stream.text + irq2_stream.text_start;
+        char* end = irq2_stream.text + irq2_stream.text_len;
+        unsigned long value = 0;
+        uint8_t mark;
 
-    int last_nonzero_line = -1;
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+            p++;
+        irq2_stream.text_start = (uint32_t)(p - irq2_stream.text);
+        if (p == end)
+            break;
+        mark = *p == '@';
+        for (p += mark; p < end && *p >= '0' && *p <= '9'; p++)
+            value = value * 10 + (*p - '0');
+        if (p == end && !irq2_stream.eof)
+            break; // the number may go on in the next batch
+        if (p == irq2_stream.text + irq2_stream.text_start + mark || (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n'))
+        {
+            fprintf(stderr, "irq2in stream: invalid cycle '%.*s'\n", (int)(p - irq2_stream.text - irq2_stream.text_start + 1),
+                irq2_stream.text + irq2_stream.text_start);
+            irq2_stream.eof = 1;
+            irq2_stream.text_start = irq2_stream.text_len = 0;
+            break;
+        }
+        irq2_stream.text_start = (uint32_t)(p - irq2_stream.text);
+        if (mark)
+        {
+            if (value > irq2_stream.settled)
+                irq2_stream.settled = value;
+            continue;
+        }
+        irq2_stream.ring[(irq2_stream.head + irq2_stream.count++) % IRQ2_RING_SIZE] = value;
+        if (value + 1 > irq2_stream.settled)
+            irq2_stream.settled = value + 1;
+        irq2_stream.events++;
+        parsed++;
+    }
+    return parsed;
+}
 
-    for (i = 0; i < MEMORY_SIZE; i++)
+int irq2_stream_fill()
+{
+#ifndef _WIN32
+    unsigned long settled = irq2_stream.settled;
+    while (!irq2_stream.eof)
     {
-        if (d_mem[i] != 0)
-            last_nonzero_line = i;
+        if (irq2_stream_parse() > 0 || irq2_stream.settled != settled)
+            return 0;
+        // keep the incomplete number and read the next batch behind it
+        irq2_stream.text_len -= irq2_stream.text_start;
+        memmove(irq2_stream.text, irq2_stream.text + irq2_stream.text_start, irq2_stream.text_len);
+        irq2_stream.text_start = 0;
+        if (irq2_stream.text_len == IRQ2_BATCH_SIZE)
+        {
+            fprintf(stderr, "irq2in stream: number too long\n");
+            irq2_stream.eof = 1;
+            break;
+        }
+        irq2_stream.stalls++;
+        ssize_t n = read(irq2_stream.fd, irq2_stream.text + irq2_stream.text_len, IRQ2_BATCH_SIZE - irq2_stream.text_len);
+        if (n < 0)
+            err_msg("read irq2in stream");
+        if (n <= 0)
+            irq2_stream.eof = 1; // the last number ends with the stream
+        else
+            irq2_stream.text_len += (uint32_t)n;
     }
+    irq2_stream_parse();
+#endif
+    return 0;
+}
+
+int check_irq2_stream()
+{
+    for (;;)
+    {
+        while (irq2_stream.count > 0 && irq2_stream.ring[irq2_stream.head] < cycles)
+        {
+            irq2_stream.head = (irq2_stream.head + 1) % IRQ2_RING_SIZE;
+            irq2_stream.count--;
+        }
+        if (irq2_stream.count > 0)
+            return irq2_stream.ring[irq2_stream.head] == cycles;
+        if (irq2_stream.settled > cycles || (irq2_stream.eof && irq2_stream.text_start == irq2_stream.text_len))
+            return 0;
+        irq2_stream_fill(); // stall until the producer settles this cycle
+    }
+}
+
+int irq2_stream_close()
+{
+    if (irq2_stream.fd < 0)
+        return 0;
+#ifndef _WIN32
+    close(irq2_stream.fd);
+#endif
+    irq2_stream.fd = -1;
+    fprintf(stderr, "irq2in stream: %lu interrupts received, %lu reads\n", irq2_stream.events, irq2_stream.stalls);
+    return 0;
+}
+
+int read_dmem_imem(char* dmem_file, char* imem_file){
+    FILE* fdmem, * fimem;
+    uint16_t i;
 
-    FILE* fdmemout;
-    fdmemout = fopen(dmemout_file, "w");
+    // either file may be a binary image, the same image can be given for both
+    if (is_image(dmem_file))
+    {
+        if (load_image(dmem_file, IMAGE_DMEM) != 0)
+            return 1;
+    }
+    else
+    {
+        fdmem = fopen(dmem_file, "r");
+        if (fdmem == NULL)
+        {
+            err_msg("open file");
+            return 1;
+        }
+        for (i = 0; i < MEMORY_SIZE && fscanf(fdmem, "%x", &d_mem[i]) == 1; i++)
+            ;
+        if (fclose(fdmem) != 0)
+            err_msg("close file");
+    }
 
-    if (fdmemout == NULL)
+    if (is_image(imem_file))
+        return load_image(imem_file, IMAGE_IMEM);
+    fimem = fopen(imem_file, "r");
+    if (fimem == NULL)
     {
         err_msg("open file");
         return 1;
     }
-    for (i = 0; i <= last_nonzero_line; i++)
-        fprintf(fdmemout, "%08X\n", d_mem[i]);
-
-    if (fclose(fdmemout) != 0)
+    for (i = 0; i < MEMORY_SIZE && fscanf(fimem, "%llx", &i_mem[i]) == 1; i++)
+        ;
+    if (fclose(fimem) != 0)
         err_msg("close file");
     return 0;
 }
 
+int write_dmemout(char* dmemout_file)
+{
+    int i;
+
+    int last_nonzero_line = -1;
+
+    for (i = 0; i < MEMORY_SIZE; i++)
+    {
+        if (d_mem[i] != 0)
+            last_nonzero_line = i;
+    }
+
+    struct out_file fdmemout;
+    if (out_open(&fdmemout, dmemout_file, 0) != 0)
+        return 1;
+    for (i = 0; i <= last_nonzero_line; i++)
+        out_printf(&fdmemout, "%08X\n", d_mem[i]);
+
+    return out_close(&fdmemout, dmemout_file);
+}
+
 int write_trace(char* trace_file){
+    if (digest_mode)
+        // the trace was digested while running
+        return out_close(&trace_out, trace_file);
+
     FILE* ftrace;
     ftrace = fopen(trace_file, "w");
 
@@ -547,16 +2050,12 @@ int write_trace(char* trace_file){
         err_msg("open file");
         return 1;
     }
-    uint8_t i;
+    char line[TRACE_LINE_SIZE];
     struct status* status_p = data_log.status_head;
     while (status_p != NULL)
     {
         // write to trace file
-        fprintf(ftrace, "%03X ", status_p->pc);     // pc
-        fprintf(ftrace, "%012llX ", status_p->inst); // inst
-        for (i = 0; i < REG_SIZE - 1; i++)
-            fprintf(ftrace, "%08x ", status_p->r[i]); // R[0] ... R[14]
-        fprintf(ftrace, "%08x\n", status_p->r[i]);    // R[15]
+        fwrite(line, 1, format_trace_line(line, status_p->pc, status_p->inst, status_p->r), ftrace);
 
         // jump to next status
         status_p = status_p->next;
@@ -569,65 +2068,173 @@ int write_trace(char* trace_file){
 
 int write_hwregtrace_leds_display7seg(char* hwregtrace_file, char* leds_file, char* display7seg_file)
 {
-    FILE* fhwregtrace, * fleds, * fdisplay7seg;
-    fhwregtrace = fopen(hwregtrace_file, "w");
-    fleds = fopen(leds_file, "w");
-    fdisplay7seg = fopen(display7seg_file, "w");
-    if (fhwregtrace == NULL || fleds == NULL || fdisplay7seg == NULL)
+    if (digest_mode)
     {
-        err_msg("open file");
-        return 1;
+        // hw accesses were digested while running
+        out_close(&hwregtrace_out, hwregtrace_file);
+        out_close(&leds_out, leds_file);
+        return out_close(&display7seg_out, display7seg_file);
     }
 
+    struct out_file fhwregtrace, fleds, fdisplay7seg;
+    if (out_open(&fhwregtrace, hwregtrace_file, 0) != 0 ||
+        out_open(&fleds, leds_file, 0) != 0 ||
+        out_open(&fdisplay7seg, display7seg_file, 0) != 0)
+        return 1;
+
     struct hw_access* hw_p = data_log.hw_head;
-    char text_read[] = "READ", text_write[] = "WRITE";
     while (hw_p != NULL)
     {
-        fprintf(fhwregtrace, "%lu ", hw_p->cycle);
-
-        if (hw_p->rw == 1)
-            fprintf(fhwregtrace, "%s ", text_read);
-        else if (hw_p->rw == 2)
-            fprintf(fhwregtrace, "%s ", text_write);
-		fprintf(fhwregtrace, "%s ", get_IO_reg_name(hw_p->IOReg));
-        fprintf(fhwregtrace, "%08x\n", hw_p->data);
-
-        if (hw_p->rw == 2){
-            if (hw_p->IOReg == LEDS){
-                fprintf(fleds, "%lu ", hw_p->cycle);
-                fprintf(fleds, "%08x\n", hw_p->data);
-            }else if (hw_p->IOReg == DISPLAY7SEG) {
-                fprintf(fdisplay7seg, "%lu ", hw_p->cycle);
-                fprintf(fdisplay7seg, "%08x\n", hw_p->data);
-            }
-        }
+        log_hw_access_outputs(hw_p->cycle, hw_p->rw, hw_p->IOReg, hw_p->data, &fhwregtrace, &fleds, &fdisplay7seg);
         hw_p = hw_p->next;
     }
-    if (fclose(fhwregtrace) != 0 || fclose(fleds) != 0 || fclose(fdisplay7seg) != 0)
-        err_msg("close file");
+    out_close(&fhwregtrace, hwregtrace_file);
+    out_close(&fleds, leds_file);
+    out_close(&fdisplay7seg, display7seg_file);
 
     return 0;
 }
 
 int write_cycles_regout(char* cycles_file, char* regout_file){
-    FILE* fcycles, * fregout;
-    fcycles = fopen(cycles_file, "w");
-    fregout = fopen(regout_file, "w");
+    struct out_file fcycles, fregout;
+    if (out_open(&fcycles, cycles_file, 0) != 0 || out_open(&fregout, regout_file, 0) != 0)
+        return 1;
+
+    out_printf(&fcycles, "%lu\n", cycles);
+    uint8_t i;
+    for (i = 3; i < REG_SIZE; i++)
+        out_printf(&fregout, "%08x\n", r[i]);
+
+    out_close(&fcycles, cycles_file);
+    out_close(&fregout, regout_file);
 
-    if (fcycles == NULL || fregout == NULL)
+    return 0;
+}
+
+const char* memprof_pattern(uint16_t access_pc)
+{
+    uint32_t strides = memprof->pc_accesses[access_pc] - 1;
+
+    if (strides == 0)
+        return "single";
+    if (memprof->pc_stride_changes[access_pc] == 0)
+        return memprof->pc_stride[access_pc] == 0 ? "fixed" : "constant";
+    if (2 * memprof->pc_major_hits[access_pc] >= strides)
+        // e.g. an inner loop whose stride is reset once per outer iteration
+        return "mostly-constant";
+    return "random";
+}
+
+int write_memprof(char* prefix)
+{
+    // <prefix>.bin layout (little endian):
+    //   "SIMPHEAT", uint32 version, uint32 MEMORY_SIZE, uint32 ws_window, uint32 ws_count,
+    //   uint32 reads[MEMORY_SIZE], writes[MEMORY_SIZE], dma_reads[MEMORY_SIZE], dma_writes[MEMORY_SIZE],
+    //   uint32 ws_series[ws_count]: peak sliding working set of every ws_window cycles, the last one may be partial
+    char path[FILENAME_MAX];
+    FILE* fbin, * ftxt;
+    uint32_t header[4];
+    int i, j;
+
+    memprof_advance_window();
+    if (memprof->ws_cycle % memprof->ws_window != 0 || memprof->ws_count == 0)
+        memprof_ws_record(); // the last, partial ws_window cycles
+    if (memprof->ws_min == ~0u)
+        memprof->ws_min = 0;
+
+    snprintf(path, sizeof(path), "%s.bin", prefix);
+    fbin = fopen(path, "wb");
+    snprintf(path, sizeof(path), "%s.txt", prefix);
+    ftxt = fopen(path, "w");
+    if (fbin == NULL || ftxt == NULL)
     {
         err_msg("open file");
         return 1;
     }
 
-    fprintf(fcycles, "%lu\n", cycles);
-    uint8_t i;
-    for (i = 3; i < REG_SIZE; i++)
-        fprintf(fregout, "%08x\n", r[i]);
+    header[0] = 2;
+    header[1] = MEMORY_SIZE;
+    header[2] = (uint32_t)memprof->ws_window;
+    header[3] = (uint32_t)memprof->ws_count;
+    fwrite("SIMPHEAT", 1, 8, fbin);
+    fwrite(header, sizeof(uint32_t), 4, fbin);
+    fwrite(memprof->reads, sizeof(uint32_t), MEMORY_SIZE, fbin);
+    fwrite(memprof->writes, sizeof(uint32_t), MEMORY_SIZE, fbin);
+    fwrite(memprof->dma_reads, sizeof(uint32_t), MEMORY_SIZE, fbin);
+    fwrite(memprof->dma_writes, sizeof(uint32_t), MEMORY_SIZE, fbin);
+    fwrite(memprof->ws_series, sizeof(uint32_t), memprof->ws_count, fbin);
+
+    // totals
+    unsigned long total_reads = 0, total_writes = 0, total_dma_reads = 0, total_dma_writes = 0;
+    int distinct = 0;
+    for (i = 0; i < MEMORY_SIZE; i++)
+    {
+        total_reads += memprof->reads[i];
+        total_writes += memprof->writes[i];
+        total_dma_reads += memprof->dma_reads[i];
+        total_dma_writes += memprof->dma_writes[i];
+        if (memprof->first_cycle[i] != ~0UL)
+            distinct++;
+    }
+    fprintf(ftxt, "cycles: %lu\n", cycles);
+    fprintf(ftxt, "accesses: lw %lu, sw %lu, dma read %lu, dma write %lu\n",
+        total_reads, total_writes, total_dma_reads, total_dma_writes);
+    fprintf(ftxt, "distinct addresses: %d\n", distinct);
 
-    if (fclose(fcycles) != 0 || fclose(fregout) != 0)
+    // working set of every cycle
+    fprintf(ftxt, "working set (%lu cycle sliding window): min %u, avg %.1f, max %u (cycle %lu), %lu series samples\n",
+        memprof->ws_window, memprof->ws_min, cycles ? (double)memprof->ws_sum / cycles : 0.0,
+        memprof->ws_max, memprof->ws_max_cycle, memprof->ws_count);
+
+    // hottest addresses, selected by total accesses
+    uint8_t listed[MEMORY_SIZE] = { 0 };
+    fprintf(ftxt, "\nhot addresses:\naddr reads writes dma_reads dma_writes first_cycle last_cycle\n");
+    for (j = 0; j < MEMPROF_HOT_COUNT; j++)
+    {
+        int hot = -1;
+        unsigned long hot_total = 0, total;
+        for (i = 0; i < MEMORY_SIZE; i++)
+        {
+            total = (unsigned long)memprof->reads[i] + memprof->writes[i] + memprof->dma_reads[i] + memprof->dma_writes[i];
+            if (!listed[i] && total > hot_total)
+            {
+                hot = i;
+                hot_total = total;
+            }
+        }
+        if (hot == -1)
+            break;
+        listed[hot] = 1;
+        fprintf(ftxt, "%03X %u %u %u %u %lu %lu\n", hot, memprof->reads[hot], memprof->writes[hot],
+            memprof->dma_reads[hot], memprof->dma_writes[hot], memprof->first_cycle[hot], memprof->last_cycle[hot]);
+    }
+
+    // access patterns of every lw/sw pc
+    fprintf(ftxt, "\naccess patterns:\npc accesses pattern major_stride last_stride stride_changes\n");
+    for (i = 0; i < MEMORY_SIZE; i++)
+    {
+        if (memprof->pc_accesses[i] == 0)
+            continue;
+        fprintf(ftxt, "%03X %u %s %d %d %u\n", i, memprof->pc_accesses[i], memprof_pattern(i),
+            memprof->pc_major_stride[i], memprof->pc_stride[i], memprof->pc_stride_changes[i]);
+    }
+
+    // every accessed address
+    fprintf(ftxt, "\naddresses:\naddr reads writes dma_reads dma_writes first_cycle last_cycle\n");
+    for (i = 0; i < MEMORY_SIZE; i++)
+    {
+        if (memprof->first_cycle[i] == ~0UL)
+            continue;
+        fprintf(ftxt, "%03X %u %u %u %u %lu %lu\n", i, memprof->reads[i], memprof->writes[i],
+            memprof->dma_reads[i], memprof->dma_writes[i], memprof->first_cycle[i], memprof->last_cycle[i]);
+    }
+
+    if (fclose(fbin) != 0 || fclose(ftxt) != 0)
         err_msg("close file");
 
+    free(memprof->ws_series);
+    free(memprof);
+    memprof = NULL;
     return 0;
 }
 
@@ -639,25 +2246,19 @@ uint32_t extend_sign(uint32_t reg, uint8_t sign_bit){
 }
 
 int execute_instruction(){
-    uint64_t inst = i_mem[pc];
+    const struct decoded_inst* d = &decoded[pc];
     uint16_t prev_pc = pc; 
-    uint16_t opcode, rd, rs, rt, rm, imm1, imm2;
-    imm2 = (inst >> 0) & 0xfff;
-    imm1 = (inst >> 12) & 0xfff;
-    rm = (inst >> 24) & 0xf;
-    rt = (inst >> 28) & 0xf;
-    rs = (inst >> 32) & 0xf;
-    rd = (inst >> 36) & 0xf;
-    opcode = (inst >> 40) & 0xff;
-
-    if (opcode < 0 || opcode > 21)
+    uint8_t opcode = d->opcode, rd = d->rd, rs = d->rs, rt = d->rt, rm = d->rm;
+
+    if (opcode >= OPCODE_COUNT)
         return 2;
 
     r[0] = 0;                     
-    r[1] = extend_sign(imm1, 11); 
-    r[2] = extend_sign(imm2, 11); 
+    r[1] = d->imm1; 
+    r[2] = d->imm2; 
 
-    update_log_status();
+    if (!trace_off)
+        HOSTPROF_CALL(HP_TRACE, update_log_status());
 
     switch (opcode)
     { 
@@ -718,9 +2319,13 @@ int execute_instruction(){
         pc = r[rm] & 0xfff;
         break; 
     case 16:// lw
+        if (mem_hooks)
+            mem_access((r[rs] + r[rt]) & 0xfff, 1);
         r[rd] = d_mem[(r[rs] + r[rt]) & 0xfff] + r[rm];
         break;
     case 17:// sw
+        if (mem_hooks)
+            mem_access((r[rs] + r[rt]) & 0xfff, 2);
         d_mem[(r[rs] + r[rt]) & 0xfff] = r[rm] + r[rd];
         break; 
     case 18:// reti
@@ -731,13 +2336,13 @@ int execute_instruction(){
         if (r[rs] + r[rt] >= IO_REG_SIZE)
             break;
         r[rd] = IORegister[r[rs] + r[rt]];
-        update_log_hw_access(1, r[rs] + r[rt]);
+        HOSTPROF_CALL(HP_HWTRACE, update_log_hw_access(1, r[rs] + r[rt]));
         break;
     case 20:// out
         if (r[rs] + r[rt] >= IO_REG_SIZE)
             break;
         IORegister[r[rs] + r[rt]] = r[rm];
-        update_log_hw_access(2, r[rs] + r[rt]);
+        HOSTPROF_CALL(HP_HWTRACE, update_log_hw_access(2, r[rs] + r[rt]));
         break;
         
     case 21:// halt
@@ -749,80 +2354,3041 @@ int execute_instruction(){
     return 0;
 }
 
+int decode_imem()
+{
+    int i;
+    for (i = 0; i < MEMORY_SIZE; i++)
+    {
+        uint64_t inst = i_mem[i];
+        decoded[i].imm2 = extend_sign(inst & 0xfff, 11);
+        decoded[i].imm1 = extend_sign((inst >> 12) & 0xfff, 11);
+        decoded[i].rm = (inst >> 24) & 0xf;
+        decoded[i].rt = (inst >> 28) & 0xf;
+        decoded[i].rs = (inst >> 32) & 0xf;
+        decoded[i].rd = (inst >> 36) & 0xf;
+        decoded[i].opcode = (inst >> 40) & 0xff;
+    }
+    decoded[MEMORY_SIZE].opcode = decoded[MEMORY_SIZE + 1].opcode = 0xff;
+
+    // only the first instruction of a group may be a branch target of the group itself,
+    // so none of the grouped instructions but the last may change pc
+    for (i = 0; i < MEMORY_SIZE; i++)
+    {
+        const struct decoded_inst* d = &decoded[i];
+        decoded[i].fuse = FUSE_NONE;
+        if (fuse_off)
+            continue;
+        if (d[0].opcode == 19 && is_branch(d[1].opcode))
+            decoded[i].fuse = FUSE_IN_BRANCH;
+        else if (d[0].opcode == 0 && is_branch(d[1].opcode))
+            decoded[i].fuse = FUSE_ADD_BRANCH;
+        else if (d[0].opcode == 16 && d[1].opcode == 2 && dcache == NULL && watchpoint_count == 0)
+            // a lw miss stalls, and a watchpoint stops, before the mac
+            decoded[i].fuse = FUSE_LW_MAC;
+        else if (d[0].opcode == 2 && d[1].opcode == 0)
+            decoded[i].fuse = FUSE_MAC_ADD;
+        else if (d[0].opcode == 1 && d[1].opcode == 1 && d[2].opcode == 2)
+            decoded[i].fuse = FUSE_SUB_SUB_MAC;
+    }
+
+    // a breakpoint can't be inside a group
+    for (i = 0; breakpoint_count != 0 && i < MEMORY_SIZE; i++)
+    {
+        if (!(breakpoints[i >> 3] >> (i & 7) & 1))
+            continue;
+        decoded[i].fuse = FUSE_BREAK;
+        if (i >= 1 && fuse_length[decoded[i - 1].fuse] >= 2 && decoded[i - 1].fuse != FUSE_BREAK)
+            decoded[i - 1].fuse = FUSE_NONE;
+        if (i >= 2 && fuse_length[decoded[i - 2].fuse] >= 3)
+            decoded[i - 2].fuse = FUSE_NONE;
+    }
+    return 0;
+}
+
+int is_branch(uint8_t opcode)
+{
+    return opcode >= 9 && opcode <= 14;
+}
+
+int branch_taken(const struct decoded_inst* d)
+{
+    switch (d->opcode)
+    {
+    case 9: return r[d->rs] == r[d->rt];
+    case 10: return r[d->rs] != r[d->rt];
+    case 11: return r[d->rs] < r[d->rt];
+    case 12: return r[d->rs] > r[d->rt];
+    case 13: return r[d->rs] <= r[d->rt];
+    default: return r[d->rs] >= r[d->rt];
+    }
+}
+
+int fuse_begin(const struct decoded_inst* d)
+{
+    r[0] = 0;
+    r[1] = d->imm1;
+    r[2] = d->imm2;
+    if (!trace_off)
+        return HOSTPROF_CALL(HP_TRACE, update_log_status());
+    return 0;
+}
+
+int fuse_end_cycle(uint8_t was_busy)
+{
+    r[0] = 0;
+    pc = (pc + PC_ADDR_SIZE) & 0xfff;
+    end_cycle();
+    if (irq_busy != was_busy)
+        // ISR() jumped to the handler, the rest of the group is not executed
+        return 1;
+    HOSTPROF_CYCLE();
+    return 0;
+}
+
+int exec_fused()
+{
+    const struct decoded_inst* d = &decoded[pc];
+    uint8_t group = d->fuse;
+    uint8_t was_busy = irq_busy;
+    int32_t io;
+    uint16_t target;
+
+    // every instruction behaves as in execute_instruction(), followed by its own end_cycle()
+    fuse_begin(d);
+    switch (group)
+    {
+    case FUSE_IN_BRANCH:
+        io = r[d->rs] + r[d->rt];
+        if (io < IO_REG_SIZE)
+        {
+            r[d->rd] = IORegister[io];
+            HOSTPROF_CALL(HP_HWTRACE, update_log_hw_access(1, io));
+        }
+        break;
+    case FUSE_ADD_BRANCH:
+#if SIM_FAULT == 1
+        r[1] = d->imm2;
+#endif
+        r[d->rd] = r[d->rs] + r[d->rt] + r[d->rm];
+        break;
+    case FUSE_LW_MAC:
+        if (mem_hooks)
+            mem_access((r[d->rs] + r[d->rt]) & 0xfff, 1);
+        r[d->rd] = d_mem[(r[d->rs] + r[d->rt]) & 0xfff] + r[d->rm];
+        break;
+    case FUSE_MAC_ADD:
+        r[d->rd] = r[d->rs] * r[d->rt] + r[d->rm];
+        break;
+    case FUSE_SUB_SUB_MAC:
+        r[d->rd] = r[d->rs] - r[d->rt] - r[d->rm];
+        if (fuse_end_cycle(was_busy))
+            return 0;
+        d++;
+        fuse_begin(d);
+        r[d->rd] = r[d->rs] - r[d->rt] - r[d->rm];
+        break;
+    }
+    if (fuse_end_cycle(was_busy))
+        return 0;
+
+    // last instruction of the group
+    d++;
+    fuse_begin(d);
+    switch (group)
+    {
+    case FUSE_IN_BRANCH:
+    case FUSE_ADD_BRANCH:
+        target = r[d->rm] & 0xfff;
+        if (branch_taken(d) && target != pc)
+        {
+            pc = target;
+            r[0] = 0;
+            return end_cycle();
+        }
+        break;
+    case FUSE_LW_MAC:
+    case FUSE_SUB_SUB_MAC:
+        r[d->rd] = r[d->rs] * r[d->rt] + r[d->rm];
+        break;
+    case FUSE_MAC_ADD:
+        r[d->rd] = r[d->rs] + r[d->rt] + r[d->rm];
+        break;
+    }
+    r[0] = 0;
+    pc = (pc + PC_ADDR_SIZE) & 0xfff;
+    return end_cycle();
+}
+
 int init(char* imemin_path, char* dmemin_path, char* diskin_path, char* irq_path){
     pc = 0;
     cycles = 0;
+    memset(r, 0, sizeof(r));
+    memset(IORegister, 0, sizeof(IORegister));
+    memset(i_mem, 0, sizeof(i_mem));
+    memset(d_mem, 0, MEMORY_SIZE * sizeof(*d_mem));
+    memset(disk, 0, DISK_SIZE * sizeof(*disk));
+    memset(monitor, 0, MONITOR_SIZE * sizeof(*monitor));
     data_log.status_head = NULL;
     data_log.hw_head = NULL;
     data_log.irq2in_head = NULL;
     irq_busy = 0;
     disk_last_cmd_cycle = ~0;
+    monitor_done_cycle = 0;
+    dma_done_cycle = 0;
 
-    if (read_dmem_imem(dmemin_path, imemin_path) != 0 ||
-        read_diskin(diskin_path) != 0 ||
-        read_irq2in(irq_path))
+    if (digest_mode)
+    {
+        digest_init(&trace_out.digest);
+        digest_init(&hwregtrace_out.digest);
+        digest_init(&leds_out.digest);
+        digest_init(&display7seg_out.digest);
+    }
+
+#ifdef SIM_HOSTPROF
+    hostprof_sampled = hostprof_enabled;
+#endif
+    if (HOSTPROF_CALL(HP_READ_DMEM_IMEM, read_dmem_imem(dmemin_path, imemin_path)) != 0 ||
+        HOSTPROF_CALL(HP_READ_DISKIN, read_diskin(diskin_path)) != 0 ||
+        HOSTPROF_CALL(HP_READ_IRQ2IN, read_irq2in(irq_path)))
         return 1;
 
-    return 0;
+    return decode_imem();
 }
 
 int closing(char* dmemout_path, char* regout_path, char* trace_path, char* hwregtrace_path, char* cycles_path,char* leds_path, char* display7seg_path, char* diskout_path, char* monitor_txt_path, char* monitor_yuv_path){
 
-    if (write_dmemout(dmemout_path) != 0 ||
-        write_diskout(diskout_path) != 0 ||
-        write_trace(trace_path) != 0 ||
-        write_hwregtrace_leds_display7seg(hwregtrace_path, leds_path, display7seg_path) != 0 ||
-        write_cycles_regout(cycles_path, regout_path) != 0 ||
-        write_monitor(monitor_txt_path, 0) != 0 ||
-        write_monitor(monitor_yuv_path, 1) != 0)
+#ifdef SIM_HOSTPROF
+    hostprof_sampled = hostprof_enabled;
+#endif
+    if (core_count > 1)
+        // the cores wrote their own files, the shared memories are left
+        return write_dmemout(dmemout_path) != 0 || write_diskout(diskout_path) != 0 ||
+            write_monitor(monitor_txt_path, 0) != 0 || write_monitor(monitor_yuv_path, 1) != 0;
+
+    if (HOSTPROF_CALL(HP_WRITE_DMEMOUT, write_dmemout(dmemout_path)) != 0 ||
+        HOSTPROF_CALL(HP_WRITE_DISKOUT, write_diskout(diskout_path)) != 0 ||
+        (!trace_off && HOSTPROF_CALL(HP_WRITE_TRACE, write_trace(trace_path)) != 0) ||
+        HOSTPROF_CALL(HP_WRITE_HWREGTRACE, write_hwregtrace_leds_display7seg(hwregtrace_path, leds_path, display7seg_path)) != 0 ||
+        HOSTPROF_CALL(HP_WRITE_CYCLES_REGOUT, write_cycles_regout(cycles_path, regout_path)) != 0 ||
+        HOSTPROF_CALL(HP_WRITE_MONITOR, write_monitor(monitor_txt_path, 0)) != 0 ||
+        HOSTPROF_CALL(HP_WRITE_MONITOR_YUV, write_monitor(monitor_yuv_path, 1)) != 0)
+        return 1;
+
+    if (memprof != NULL && write_memprof(memprof_prefix) != 0)
         return 1;
 
     free_log_status();
     free_log_hw_access();
     free_log_irq2in();
+    irq2_stream_close();
     return 0;
 }
 
-int main(int argc, char* argv[])
+#ifdef SIM_HOSTPROF
+uint64_t hostprof_now()
 {
-    if (argc != 15){
-        printf("Usage: %s imemin.txt dmemin.txt diskin.txt irq2in.txt dmemout.txt regout.txt trace.txt hwregtrace.txt cycles.txt leds.txt display7seg.txt diskout.txt monitor.txt monitor.yuv\n", argv[0]);
-        return 1;
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    if (freq.QuadPart == 0)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000000ULL +
+        (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000000ULL / freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+uint64_t hostprof_start()
+{
+    return hostprof_sampled ? hostprof_now() : 0;
+}
 
+int hostprof_stop(uint8_t phase)
+{
+    if (hostprof_sampled)
+    {
+        hostprof_ns[phase] += hostprof_now() - hostprof_t0[phase];
+        hostprof_calls[phase]++;
+        if (phase == HP_EXECUTE)
+            hostprof_samples++;
     }
-        
+    return hostprof_ret;
+}
 
-    if (init(argv[1], argv[2], argv[3], argv[4]) != 0)
-        return 1;
-    int halt_flag = 0;
+int hostprof_calibrate()
+{
+    int i;
+    uint64_t start = hostprof_now();
+    for (i = 0; i < 1000; i++)
+        hostprof_now();
+    hostprof_overhead = (hostprof_now() - start) / 1001.0;
+    return 0;
+}
+
+double hostprof_net_ns(uint8_t phase)
+{
+    double ns = hostprof_ns[phase] - hostprof_calls[phase] * hostprof_overhead;
+    if (phase == HP_EXECUTE)
+        // execute_instruction() contains the trace calls and their clock reads
+        ns -= hostprof_ns[HP_TRACE] + hostprof_ns[HP_HWTRACE] +
+            (hostprof_calls[HP_TRACE] + hostprof_calls[HP_HWTRACE]) * hostprof_overhead;
+    return ns > 0 ? ns : 0;
+}
+
+long hostprof_file_size(char* path)
+{
+    long size;
+    FILE* f = fopen(path, "rb");
+    if (f == NULL)
+        return 0;
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fclose(f);
+    return size;
+}
+
+int hostprof_report(uint64_t run_ns, char* out_paths[], int out_count)
+{
+    static const char* names[HP_PHASE_COUNT] = {
+        "execute", "trace", "hwtrace", "monitor", "timer", "disk", "dma", "isr",
+        "read_dmem_imem", "read_diskin", "read_irq2in",
+        "write_dmemout", "write_diskout", "write_trace", "write_hwregtrace", "write_cycles_regout",
+        "write_monitor", "write_monitor_yuv"
+    };
+    uint64_t samples = hostprof_samples ? hostprof_samples : 1;
+    long bytes = 0, peak_rss_kb;
+    int i;
+
+    printf("hostprof: %lu instructions in %.3f s, %.2f MIPS\n", cycles, run_ns / 1e9,
+        run_ns ? cycles * 1e3 / run_ns : 0.0);
+
+    printf("hostprof: run loop ns/cycle (%llu sampled cycles, clock overhead %.1f ns removed):",
+        (unsigned long long)hostprof_samples, hostprof_overhead);
+    for (i = HP_EXECUTE; i <= HP_ISR; i++)
+        printf(" %s %.1f", names[i], hostprof_net_ns(i) / samples);
+    printf("\nhostprof: input ms:");
+    for (i = HP_READ_DMEM_IMEM; i <= HP_READ_IRQ2IN; i++)
+        printf(" %s %.3f", names[i], hostprof_net_ns(i) / 1e6);
+    printf("\nhostprof: output ms:");
+    for (i = HP_WRITE_DMEMOUT; i < HP_PHASE_COUNT; i++)
+        printf(" %s %.3f", names[i], hostprof_net_ns(i) / 1e6);
+    printf("\n");
+
+    for (i = 0; i < out_count; i++)
+        bytes += hostprof_file_size(out_paths[i]);
+
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc));
+    peak_rss_kb = (long)(pmc.PeakWorkingSetSize / 1024);
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    peak_rss_kb = usage.ru_maxrss; // KB on Linux
+#endif
+    printf("hostprof: peak rss %ld KB, bytes written %ld\n", peak_rss_kb, bytes);
+    return 0;
+}
+#endif
+
+int end_cycle()
+{
+    if (IORegister[IPISEND])
+        handle_ipi();
+    HOSTPROF_CALL(HP_MONITOR, handle_monitor());
+    HOSTPROF_CALL(HP_TIMER, TIMER());
+    HOSTPROF_CALL(HP_DISK, handle_disk());
+    HOSTPROF_CALL(HP_DMA, handle_dma());
+
+    HOSTPROF_CALL(HP_ISR, ISR());
+
+    IORegister[CLKS]++;
+    cycles++;
+    return 0;
+}
+
+int step(unsigned long limit)
+{
+    int status;
+    uint8_t fuse = decoded[pc].fuse;
+    uint16_t prev_pc = pc;
+    uint8_t was_busy = irq_busy;
+
+    HOSTPROF_CYCLE();
+    if (stall_cycles)
+    {
+        // d_mem miss of the last lw/sw, the peripherals and interrupts go on
+        stall_cycles--;
+        end_cycle();
+        return 0;
+    }
+    if (core_count > 1 && (decoded[pc].opcode == 16 || decoded[pc].opcode == 17) && cycles % core_count != (unsigned long)core_id)
+    {
+        // the bus is time-sliced, core i owns the cycles where cycles % core_count == i.
+        // The lw/sw waits for the slot of this core.
+        end_cycle();
+        return 0;
+    }
+    if (fuse != FUSE_NONE && limit - cycles >= fuse_length[fuse])
+    {
+        if (fuse != FUSE_BREAK)
+            return exec_fused();
+        if (cycles != break_skip_cycle)
+        {
+            // software breakpoint, stop before the instruction
+            debug_stop = 1;
+            return 0;
+        }
+    }
+
+    if (pairprof != NULL)
+        pairprof_count();
+    if (memo_depth != 0)
+        memo_record();
+    status = HOSTPROF_CALL(HP_EXECUTE, execute_instruction());
+    if (status == 2)
+        //invalid opcode.
+        return 2;
 
-    while (pc < MEMORY_SIZE && !halt_flag)
+    end_cycle();
+    if (memo_on)
+        memo_after(prev_pc, was_busy);
+    return status;
+}
+
+int run_until(unsigned long limit, uint8_t* halted)
+{
+    while (!*halted && !debug_stop && pc < MEMORY_SIZE && cycles < limit)
     {
-        switch (execute_instruction())
+        switch (step(limit))
         {
         case 1:
-            // HALT
-            halt_flag = 1;
+            *halted = 1;
             break;
-
         case 2:
-            //invalid opcode.
             err_msg("Invalid opcode");
-            return 1;
+            return 2;
         }
+    }
+    return 0;
+}
+
+int save_state(struct machine_state* state, uint8_t halted)
+{
+    state->pc = pc;
+    state->irq_busy = irq_busy;
+    state->halted = halted;
+    state->disk_last_cmd_cycle = disk_last_cmd_cycle;
+    state->monitor_done_cycle = monitor_done_cycle;
+    state->dma_done_cycle = dma_done_cycle;
+    state->cycles = cycles;
+    memcpy(state->r, r, sizeof(r));
+    memcpy(state->IORegister, IORegister, sizeof(IORegister));
+    memcpy(state->i_mem, i_mem, sizeof(i_mem));
+    memcpy(state->d_mem, d_mem, sizeof(state->d_mem));
+    memcpy(state->disk, disk, sizeof(state->disk));
+    memcpy(state->monitor, monitor, sizeof(state->monitor));
+    state->irq2in_head = data_log.irq2in_head;
+    return 0;
+}
 
-        handle_monitor();
-        TIMER();
-        handle_disk();
+int restore_state(const struct machine_state* state)
+{
+    pc = state->pc;
+    irq_busy = state->irq_busy;
+    disk_last_cmd_cycle = state->disk_last_cmd_cycle;
+    monitor_done_cycle = state->monitor_done_cycle;
+    dma_done_cycle = state->dma_done_cycle;
+    cycles = state->cycles;
+    memcpy(r, state->r, sizeof(r));
+    memcpy(IORegister, state->IORegister, sizeof(IORegister));
+    memcpy(i_mem, state->i_mem, sizeof(i_mem));
+    memcpy(d_mem, state->d_mem, sizeof(state->d_mem));
+    memcpy(disk, state->disk, sizeof(state->disk));
+    memcpy(monitor, state->monitor, sizeof(state->monitor));
+    data_log.irq2in_head = state->irq2in_head;
+    return decode_imem();
+}
 
-        ISR();
+uint64_t state_hash(uint8_t halted)
+{
+    // i_mem is left out: two images may differ in code that is never reached
+    struct digest d;
+    digest_init(&d);
+    digest_update(&d, &pc, sizeof(pc));
+    digest_update(&d, &irq_busy, sizeof(irq_busy));
+    digest_update(&d, &halted, sizeof(halted));
+    digest_update(&d, &cycles, sizeof(cycles));
+    digest_update(&d, &disk_last_cmd_cycle, sizeof(disk_last_cmd_cycle));
+    digest_update(&d, &monitor_done_cycle, sizeof(monitor_done_cycle));
+    digest_update(&d, &dma_done_cycle, sizeof(dma_done_cycle));
+    digest_update(&d, r, sizeof(r));
+    digest_update(&d, IORegister, sizeof(IORegister));
+    digest_update(&d, d_mem, MEMORY_SIZE * sizeof(*d_mem));
+    digest_update(&d, disk, DISK_SIZE * sizeof(*disk));
+    digest_update(&d, monitor, MONITOR_SIZE * sizeof(*monitor));
+    return digest_final(&d);
+}
 
-        IORegister[CLKS]++;
-        cycles++;
-    }
+int state_diff(const struct machine_state* a, const struct machine_state* b)
+{
+    int i, j;
 
-    if (closing(argv[5], argv[6], argv[7], argv[8], argv[9], argv[10], argv[11], argv[12], argv[13], argv[14]) != 0)
+    if (a->halted != b->halted)
+        printf("  halted: A %d, B %d\n", a->halted, b->halted);
+    if (a->cycles != b->cycles)
+        printf("  cycles: A %lu, B %lu\n", a->cycles, b->cycles);
+    if (a->pc != b->pc)
+        printf("  pc: A %03X, B %03X\n", a->pc, b->pc);
+    if (a->irq_busy != b->irq_busy)
+        printf("  irq_busy: A %d, B %d\n", a->irq_busy, b->irq_busy);
+    if (a->disk_last_cmd_cycle != b->disk_last_cmd_cycle)
+        printf("  disk_last_cmd_cycle: A %ld, B %ld\n", (long)a->disk_last_cmd_cycle, (long)b->disk_last_cmd_cycle);
+    if (a->monitor_done_cycle != b->monitor_done_cycle)
+        printf("  monitor_done_cycle: A %lu, B %lu\n", a->monitor_done_cycle, b->monitor_done_cycle);
+    if (a->dma_done_cycle != b->dma_done_cycle)
+        printf("  dma_done_cycle: A %lu, B %lu\n", a->dma_done_cycle, b->dma_done_cycle);
+    for (i = 0; i < REG_SIZE; i++)
+        if (a->r[i] != b->r[i])
+            printf("  r[%d]: A %08x, B %08x\n", i, a->r[i], b->r[i]);
+    for (i = 0; i < IO_REG_SIZE; i++)
+        if (a->IORegister[i] != b->IORegister[i])
+            printf("  %s: A %08x, B %08x\n", get_IO_reg_name(i), a->IORegister[i], b->IORegister[i]);
+    for (i = 0; i < MEMORY_SIZE; i++)
+        if (a->d_mem[i] != b->d_mem[i])
+            printf("  d_mem[%03X]: A %08X, B %08X\n", i, a->d_mem[i], b->d_mem[i]);
+    for (i = 0; i < DISK_SIZE; i++)
+        for (j = 0; j < SECTOR_SIZE; j++)
+            if (a->disk[i][j] != b->disk[i][j])
+                printf("  disk[%d][%d]: A %08X, B %08X\n", i, j, a->disk[i][j], b->disk[i][j]);
+    for (i = 0; i < MONITOR_SIZE; i++)
+        for (j = 0; j < MONITOR_SIZE; j++)
+            if (a->monitor[i][j] != b->monitor[i][j])
+                printf("  monitor[%d][%d]: A %02X, B %02X\n", i, j, a->monitor[i][j], b->monitor[i][j]);
+    return 0;
+}
+
+int print_context(struct machine_state* state, const char* name, unsigned long from, unsigned long to)
+{
+    char line[TRACE_LINE_SIZE];
+    uint8_t halted = state->halted;
+
+    restore_state(state);
+    if (run_until(from, &halted) != 0)
         return 1;
+    while (!halted && cycles <= to)
+    {
+        // registers as the instruction sees them, like trace.txt
+        int32_t regs[REG_SIZE];
+        uint64_t inst = i_mem[pc];
+        memcpy(regs, r, sizeof(regs));
+        regs[0] = 0;
+        regs[1] = extend_sign((inst >> 12) & 0xfff, 11);
+        regs[2] = extend_sign(inst & 0xfff, 11);
+        line[format_trace_line(line, pc, inst, regs) - 1] = '\0';
+        printf("%s %lu %s\n", name, cycles, line);
+        if (run_until(cycles + 1, &halted) != 0)
+            return 1;
+    }
+    if (halted)
+        printf("%s %lu halted\n", name, cycles);
+    return 0;
+}
+
+int diverge(char* inputs_a[], char* inputs_b[])
+{
+    // states at the last checkpoint where A and B were equal, and at the current one
+    struct machine_state* a_prev = (struct machine_state*)malloc(sizeof(struct machine_state));
+    struct machine_state* b_prev = (struct machine_state*)malloc(sizeof(struct machine_state));
+    struct machine_state* a_cur = (struct machine_state*)malloc(sizeof(struct machine_state));
+    struct machine_state* b_cur = (struct machine_state*)malloc(sizeof(struct machine_state));
+    struct machine_state* a_ckpt = (struct machine_state*)malloc(sizeof(struct machine_state));
+    struct machine_state* b_ckpt = (struct machine_state*)malloc(sizeof(struct machine_state));
+    struct irq2in* irq2in_a, * irq2in_b;
+    unsigned long lo, hi, mid;
+    uint64_t hash_a, hash_b;
+    uint8_t halted;
+    int result = 1;
+
+    if (a_prev == NULL || b_prev == NULL || a_cur == NULL || b_cur == NULL || a_ckpt == NULL || b_ckpt == NULL)
+    {
+        err_msg("malloc");
+        return 2;
+    }
+
+    // the logs would grow with the run and the irq2in lists must survive restore_state()
+    trace_off = 1;
+    hwtrace_off = 1;
+    irq2in_keep = 1;
+
+    if (init(inputs_a[0], inputs_a[1], inputs_a[2], inputs_a[3]) != 0)
+        return 2;
+    irq2in_a = data_log.irq2in_head;
+    hash_a = state_hash(0);
+    save_state(a_cur, 0);
+    if (init(inputs_b[0], inputs_b[1], inputs_b[2], inputs_b[3]) != 0)
+        return 2;
+    irq2in_b = data_log.irq2in_head;
+    hash_b = state_hash(0);
+    save_state(b_cur, 0);
+
+    if (hash_a != hash_b)
+    {
+        printf("first divergence: the initial states differ at cycle 0\n");
+        state_diff(a_cur, b_cur);
+        goto done;
+    }
+
+    // run both machines checkpoint by checkpoint until their state hashes differ
+    for (;;)
+    {
+        memcpy(a_prev, a_cur, sizeof(struct machine_state));
+        memcpy(b_prev, b_cur, sizeof(struct machine_state));
+        hi = a_cur->cycles + checkpoint_cycles;
+
+        restore_state(a_cur);
+        halted = a_cur->halted;
+        if (run_until(hi, &halted) != 0)
+            goto done;
+        hash_a = state_hash(halted);
+        save_state(a_cur, halted);
+
+        restore_state(b_cur);
+        halted = b_cur->halted;
+        if (run_until(hi, &halted) != 0)
+            goto done;
+        hash_b = state_hash(halted);
+        save_state(b_cur, halted);
+
+        if (hash_a != hash_b)
+            break;
+        if (a_cur->halted && b_cur->halted)
+        {
+            printf("no divergence: both machines halted at cycle %lu\n", a_cur->cycles);
+            result = 0;
+            goto done;
+        }
+    }
+
+    // binary search (lo, hi] for the first cycle whose state differs, moving the equal states forward
+    memcpy(a_ckpt, a_prev, sizeof(struct machine_state));
+    memcpy(b_ckpt, b_prev, sizeof(struct machine_state));
+    lo = a_prev->cycles;
+    while (hi - lo > 1)
+    {
+        mid = lo + (hi - lo) / 2;
+
+        restore_state(a_prev);
+        halted = a_prev->halted;
+        if (run_until(mid, &halted) != 0)
+            goto done;
+        hash_a = state_hash(halted);
+        save_state(a_cur, halted);
+
+        restore_state(b_prev);
+        halted = b_prev->halted;
+        if (run_until(mid, &halted) != 0)
+            goto done;
+        hash_b = state_hash(halted);
+        save_state(b_cur, halted);
+
+        if (hash_a == hash_b)
+        {
+            memcpy(a_prev, a_cur, sizeof(struct machine_state));
+            memcpy(b_prev, b_cur, sizeof(struct machine_state));
+            lo = mid;
+        }
+        else
+            hi = mid;
+    }
+
+    printf("first divergence: the cycle %lu instruction leaves different state at cycle %lu\n", lo, hi);
+    restore_state(a_prev);
+    halted = a_prev->halted;
+    run_until(hi, &halted);
+    save_state(a_cur, halted);
+    restore_state(b_prev);
+    halted = b_prev->halted;
+    run_until(hi, &halted);
+    save_state(b_cur, halted);
+    state_diff(a_cur, b_cur);
+
+    // the context is replayed from the checkpoint before the divergence
+    mid = lo - a_ckpt->cycles > context_cycles ? lo - context_cycles : a_ckpt->cycles;
+    printf("context (machine cycle pc inst r0..r15):\n");
+    print_context(a_ckpt, "A", mid, hi);
+    print_context(b_ckpt, "B", mid, hi);
+
+done:
+    data_log.irq2in_head = irq2in_a;
+    free_log_irq2in();
+    data_log.irq2in_head = irq2in_b;
+    free_log_irq2in();
+    free(a_prev);
+    free(b_prev);
+    free(a_cur);
+    free(b_cur);
+    free(a_ckpt);
+    free(b_ckpt);
+    return result;
+}
+
+int verify_reference(unsigned long limit, uint8_t* halted)
+{
+    // the calls -memo is recording belong to the fast machine
+    uint8_t on = memo_on;
+    int depth = memo_depth, result = 0;
+
+    memo_on = 0;
+    memo_depth = 0;
+    while (!*halted && pc < MEMORY_SIZE && cycles < limit)
+    {
+        // a limit one cycle ahead keeps step() from starting a superinstruction
+        switch (step(cycles + 1))
+        {
+        case 1:
+            *halted = 1;
+            break;
+        case 2:
+            err_msg("Invalid opcode");
+            result = 2;
+            *halted = 1;
+            break;
+        }
+    }
+    memo_on = on;
+    memo_depth = depth;
+    return result;
+}
+
+int verify_fast(uint8_t* halted)
+{
+    unsigned long start = cycles, budget;
+    int status;
+
+    do
+    {
+        if (verify_engine == VERIFY_LANES)
+        {
+            // a round of run_lanes() with a single lane
+            lane_leave(0);
+            lanes[0].halted = 0;
+            if (!lane_ready(0))
+                status = lane_scalar(0, MEMORY_SIZE) ? 2 : lanes[0].halted;
+            else
+            {
+                budget = lanes[0].quiet_until - cycles;
+                if (budget > LANE_BURST)
+                    budget = LANE_BURST;
+                if (verify_every != 0 && start + verify_every - cycles < budget)
+                    budget = start + verify_every - cycles;
+                status = lanes_vector(1, pc, budget);
+            }
+            lane_enter(0);
+        }
+        else
+        {
+            status = step(verify_every != 0 ? start + verify_every : ~0UL);
+            if (status == 2)
+                err_msg("Invalid opcode");
+        }
+        if (status == 2)
+            return 2;
+        if (status == 1)
+            *halted = 1;
+    } while (verify_every != 0 && !*halted && pc < MEMORY_SIZE && cycles < start + verify_every);
+    return 0;
+}
+
+int verify_dump(const struct machine_state* ref, const struct machine_state* fast)
+{
+    const char* name = verify_names[verify_engine];
+    int i, j, first = -1, words = 0, disk_words = 0, pixels = 0;
+
+    printf("  %-13s %8s %8s\n", "", "ref", name);
+    printf("  %-13s %8d %8d%s\n", "halted", ref->halted, fast->halted, ref->halted != fast->halted ? " *" : "");
+    printf("  %-13s %8lu %8lu%s\n", "cycles", ref->cycles, fast->cycles, ref->cycles != fast->cycles ? " *" : "");
+    printf("  %-13s %8X %8X%s\n", "pc", ref->pc, fast->pc, ref->pc != fast->pc ? " *" : "");
+    printf("  %-13s %8d %8d%s\n", "irq_busy", ref->irq_busy, fast->irq_busy, ref->irq_busy != fast->irq_busy ? " *" : "");
+    printf("  %-13s %8ld %8ld%s\n", "disk_cmd", (long)ref->disk_last_cmd_cycle, (long)fast->disk_last_cmd_cycle,
+        ref->disk_last_cmd_cycle != fast->disk_last_cmd_cycle ? " *" : "");
+    printf("  %-13s %8lu %8lu%s\n", "monitor_done", ref->monitor_done_cycle, fast->monitor_done_cycle,
+        ref->monitor_done_cycle != fast->monitor_done_cycle ? " *" : "");
+    printf("  %-13s %8lu %8lu%s\n", "dma_done", ref->dma_done_cycle, fast->dma_done_cycle,
+        ref->dma_done_cycle != fast->dma_done_cycle ? " *" : "");
+    for (i = 0; i < REG_SIZE; i++)
+        printf("  r%-12d %08X %08X%s\n", i, ref->r[i], fast->r[i], ref->r[i] != fast->r[i] ? " *" : "");
+    for (i = 0; i < IO_REG_SIZE; i++)
+        printf("  %-13s %08X %08X%s\n", get_IO_reg_name(i), ref->IORegister[i], fast->IORegister[i],
+            ref->IORegister[i] != fast->IORegister[i] ? " *" : "");
+    for (i = 0; i < MEMORY_SIZE; i++)
+        if (ref->d_mem[i] != fast->d_mem[i])
+        {
+            if (first < 0)
+                first = i;
+            words++;
+        }
+    if (first >= 0)
+        printf("  d_mem[%03X]    %08X %08X * first of %d differing words\n", first, ref->d_mem[first], fast->d_mem[first], words);
+    for (i = 0; i < DISK_SIZE; i++)
+        for (j = 0; j < SECTOR_SIZE; j++)
+            disk_words += ref->disk[i][j] != fast->disk[i][j];
+    for (i = 0; i < MONITOR_SIZE; i++)
+        for (j = 0; j < MONITOR_SIZE; j++)
+            pixels += ref->monitor[i][j] != fast->monitor[i][j];
+    if (disk_words != 0 || pixels != 0)
+        printf("  %d disk words and %d monitor pixels differ\n", disk_words, pixels);
+    return 0;
+}
+
+int verify(char* inputs[])
+{
+    // the reference and the fast machine after the last block, and the reference before it
+    struct machine_state* ref = (struct machine_state*)malloc(sizeof(struct machine_state));
+    struct machine_state* fast = (struct machine_state*)malloc(sizeof(struct machine_state));
+    struct machine_state* block = (struct machine_state*)malloc(sizeof(struct machine_state));
+    const char* name = verify_names[verify_engine];
+    struct irq2in* irq2in;
+    unsigned long blocks = 0, from;
+    uint64_t hash_ref, hash_fast;
+    uint8_t halted;
+    int result = 2;
+
+    if (ref == NULL || fast == NULL || block == NULL)
+    {
+        err_msg("malloc");
+        return 2;
+    }
+
+    // the logs would grow with the run and the irq2in list must survive restore_state()
+    trace_off = 1;
+    hwtrace_off = 1;
+    irq2in_keep = 1;
+    // restore_state() decodes i_mem without superinstructions unless they are under test
+    fuse_off = verify_engine != VERIFY_FUSE;
+    if (verify_engine == VERIFY_MEMO && memo_init() != 0)
+        return 2;
+    if (verify_engine == VERIFY_LANES)
+    {
+        lanes = (struct lane*)calloc(1, sizeof(struct lane));
+        if (lanes == NULL)
+        {
+            err_msg("malloc");
+            return 2;
+        }
+        // both machines live in the memories of lane 0, lane_enter() and lane_leave() move the rest
+        d_mem = lanes[0].d_mem;
+        disk = lanes[0].disk;
+        monitor = lanes[0].monitor;
+    }
+
+    if (init(inputs[0], inputs[1], inputs[2], inputs[3]) != 0)
+        return 2;
+    irq2in = data_log.irq2in_head;
+    save_state(ref, 0);
+    save_state(fast, 0);
+
+    for (;;)
+    {
+        memcpy(block, ref, sizeof(struct machine_state));
+
+        restore_state(fast);
+        halted = fast->halted;
+        if (verify_fast(&halted) != 0)
+            goto done;
+        hash_fast = state_hash(halted);
+        save_state(fast, halted);
+
+        // the reference runs the cycles of the block one instruction at a time
+        restore_state(ref);
+        halted = ref->halted;
+        if (verify_reference(fast->cycles, &halted) != 0)
+            goto done;
+        hash_ref = state_hash(halted);
+        save_state(ref, halted);
+        blocks++;
+
+        if (hash_ref != hash_fast)
+            break;
+        if (ref->halted)
+        {
+            printf("verify: %s matches the reference in %lu blocks, both halted at cycle %lu\n", name, blocks, ref->cycles);
+            result = 0;
+            goto done;
+        }
+    }
+
+    printf("verify: %s differs from the reference after block %lu, cycles %lu to %lu\n", name, blocks, block->cycles,
+        fast->cycles - 1);
+    verify_dump(ref, fast);
+
+    // the reference trace of the end of the block
+    fuse_off = 1;
+    memo_on = 0;
+    memo_depth = 0;
+    from = fast->cycles - block->cycles > context_cycles ? fast->cycles - context_cycles : block->cycles;
+    printf("context (machine cycle pc inst r0..r15):\n");
+    print_context(block, "ref", from, fast->cycles - 1);
+    result = 1;
+
+done:
+    data_log.irq2in_head = irq2in;
+    free_log_irq2in();
+    free(ref);
+    free(fast);
+    free(block);
+    return result;
+}
+
+int dcache_init(const char* spec)
+{
+    char policy[3];
+    uint32_t size, line, ways, penalty;
+
+    if (sscanf(spec, "%u,%u,%u,%2[a-z],%u", &size, &line, &ways, policy, &penalty) != 5 ||
+        (strcmp(policy, "wb") != 0 && strcmp(policy, "wt") != 0))
+    {
+        fprintf(stderr, "-dcache expects <words>,<line words>,<ways>,<wb|wt>,<miss penalty>\n");
+        return 1;
+    }
+    if (size == 0 || line == 0 || ways == 0 || (size & (size - 1)) || (line & (line - 1)) || (ways & (ways - 1)) ||
+        size > MEMORY_SIZE || line * ways > size)
+    {
+        fprintf(stderr, "-dcache size, line and ways must be powers of 2 with line * ways <= size <= %d\n", MEMORY_SIZE);
+        return 1;
+    }
+
+    dcache = (struct dcache*)calloc(1, sizeof(struct dcache));
+    if (dcache == NULL)
+    {
+        err_msg("malloc");
+        return 1;
+    }
+    dcache->size = size;
+    dcache->line = line;
+    dcache->ways = ways;
+    dcache->sets = size / (line * ways);
+    for (dcache->line_shift = 0; (1u << dcache->line_shift) < line; dcache->line_shift++)
+        ;
+    dcache->set_mask = dcache->sets - 1;
+    dcache->write_back = strcmp(policy, "wb") == 0;
+    dcache->penalty = penalty;
+    dcache->tags = (uint16_t*)calloc(dcache->sets * ways, sizeof(uint16_t));
+    if (dcache->tags == NULL)
+    {
+        err_msg("malloc");
+        return 1;
+    }
+    return 0;
+}
+
+int dcache_access(uint16_t addr, uint8_t rw)
+{
+    struct dcache* c = dcache;
+    uint16_t line = addr >> c->line_shift;
+    uint16_t* set = &c->tags[(line & c->set_mask) * c->ways];
+    uint16_t entry;
+    uint32_t i, stall = 0;
+
+    for (i = 0; i < c->ways; i++)
+        if ((set[i] & (DCACHE_VALID | DCACHE_LINE_MASK)) == (DCACHE_VALID | line))
+            break;
+
+    if (i < c->ways)
+    {
+        c->hits[pc]++;
+        entry = set[i];
+        if (rw == 2 && c->write_back)
+            entry |= DCACHE_DIRTY;
+        else if (rw == 2)
+            stall = c->penalty;
+    }
+    else
+    {
+        c->misses[pc]++;
+        stall = c->penalty;
+        if (rw == 2 && !c->write_back)
+        {
+            // write-through doesn't allocate on a store miss
+            stall_cycles += stall;
+            c->stalls += stall;
+            return 0;
+        }
+        i = c->ways - 1;
+        if ((set[i] & (DCACHE_VALID | DCACHE_DIRTY)) == (DCACHE_VALID | DCACHE_DIRTY))
+        {
+            // the evicted line is written back first
+            stall += c->penalty;
+            c->writebacks++;
+        }
+        entry = DCACHE_VALID | line | (rw == 2 ? DCACHE_DIRTY : 0);
+    }
+
+    // move to the front of the LRU order
+    memmove(set + 1, set, i * sizeof(uint16_t));
+    set[0] = entry;
+    stall_cycles += stall;
+    c->stalls += stall;
+    return 0;
+}
+
+int dcache_report()
+{
+    unsigned long hits = 0, misses = 0;
+    int i;
+
+    for (i = 0; i < MEMORY_SIZE; i++)
+    {
+        hits += dcache->hits[i];
+        misses += dcache->misses[i];
+    }
+    printf("dcache: %u words, %u-word lines, %u ways, %s, %u cycle miss penalty\n", dcache->size, dcache->line,
+        dcache->ways, dcache->write_back ? "write-back" : "write-through", dcache->penalty);
+    printf("dcache: %lu accesses, %lu hits, %lu misses (%.1f%%), %lu writebacks, %lu stall cycles of %lu\n",
+        hits + misses, hits, misses, hits + misses ? 100.0 * misses / (hits + misses) : 0.0,
+        dcache->writebacks, dcache->stalls, cycles);
+    printf("  pc    accesses       hits     misses  miss%%\n");
+    for (i = 0; i < MEMORY_SIZE; i++)
+        if (dcache->hits[i] + dcache->misses[i] != 0)
+            printf("  %03X %10u %10u %10u %5.1f%%\n", i, dcache->hits[i] + dcache->misses[i], dcache->hits[i],
+                dcache->misses[i], 100.0 * dcache->misses[i] / (dcache->hits[i] + dcache->misses[i]));
+    return 0;
+}
+
+int update_mem_hooks()
+{
+    mem_hooks = memprof != NULL || dcache != NULL || core_count > 1 || watchpoint_count != 0;
+    return 0;
+}
+
+int set_breakpoint(char type, uint32_t addr, uint32_t len, uint8_t set)
+{
+    uint32_t i;
+
+    if (type == '0' || type == '1')
+    {
+        // software and hardware breakpoints are both kept in the pc bitmap
+        if (addr % 8 != 0 || addr / 8 >= MEMORY_SIZE)
+            return 1;
+        i = addr / 8;
+        if (set && !(breakpoints[i >> 3] >> (i & 7) & 1))
+            breakpoint_count++;
+        else if (!set && (breakpoints[i >> 3] >> (i & 7) & 1))
+            breakpoint_count--;
+        breakpoints[i >> 3] = set ? breakpoints[i >> 3] | 1 << (i & 7) : breakpoints[i >> 3] & ~(1 << (i & 7));
+    }
+    else if (type >= '2' && type <= '4')
+    {
+        // write, read and access watchpoints of the d_mem words covered by [addr, addr + len)
+        uint8_t rw = type == '2' ? 2 : type == '3' ? 1 : 3;
+        if (addr < GDB_DMEM_BASE || len == 0 || addr - GDB_DMEM_BASE + len > 4 * MEMORY_SIZE)
+            return 1;
+        for (i = (addr - GDB_DMEM_BASE) / 4; i <= (addr - GDB_DMEM_BASE + len - 1) / 4; i++)
+        {
+            if (set && !watchpoints[i])
+                watchpoint_count++;
+            watchpoints[i] = set ? watchpoints[i] | rw : watchpoints[i] & ~rw;
+            if (!set && !watchpoints[i])
+                watchpoint_count--;
+        }
+        update_mem_hooks();
+    }
+    else
+        return 1;
+
+    return decode_imem();
+}
+
+int gdb_listen(const char* address)
+{
+    sock_t server;
+    const char* p;
+    int one = 1;
+
+    for (p = address; *p >= '0' && *p <= '9'; p++)
+        ;
+    if (*p == '\0')
+    {
+        struct sockaddr_in addr;
+#ifdef _WIN32
+        WSADATA wsa;
+        if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+        {
+            err_msg("WSAStartup");
+            return 1;
+        }
+#endif
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons((uint16_t)atoi(address));
+        server = socket(AF_INET, SOCK_STREAM, 0);
+        if (server == INVALID_SOCKET)
+        {
+            err_msg("socket");
+            return 1;
+        }
+        setsockopt(server, SOL_SOCKET, SO_REUSEADDR, (const char*)&one, sizeof(one));
+        if (bind(server, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+        {
+            err_msg("bind");
+            close_socket(server);
+            return 1;
+        }
+    }
+    else
+    {
+#ifdef _WIN32
+        fprintf(stderr, "-gdb takes a TCP port on Windows\n");
+        return 1;
+#else
+        struct sockaddr_un addr;
+        if (strlen(address) >= sizeof(addr.sun_path))
+        {
+            fprintf(stderr, "-gdb socket path is too long\n");
+            return 1;
+        }
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, address);
+        unlink(address);
+        server = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (server == INVALID_SOCKET || bind(server, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+        {
+            err_msg("bind");
+            return 1;
+        }
+#endif
+    }
+
+    fprintf(stderr, "gdb: waiting for the debugger on %s\n", address);
+    if (listen(server, 1) != 0 || (gdb_sock = accept(server, NULL, NULL)) == INVALID_SOCKET)
+    {
+        err_msg("accept");
+        close_socket(server);
+        return 1;
+    }
+    close_socket(server);
+    if (*p == '\0')
+        setsockopt(gdb_sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one));
+#ifndef _WIN32
+    else
+        unlink(address);
+#endif
+    return 0;
+}
+
+int gdb_getc()
+{
+    unsigned char c;
+    if (recv(gdb_sock, (char*)&c, 1, 0) != 1)
+        return -1;
+    return c;
+}
+
+int gdb_recv_packet(char* packet)
+{
+    int c, len;
+    uint8_t sum;
+    char ack = '+';
+
+    for (;;)
+    {
+        // skip acks, and ^C while the target is already stopped
+        do
+        {
+            if ((c = gdb_getc()) < 0)
+                return -1;
+        } while (c != '$');
+
+        len = 0;
+        sum = 0;
+        while ((c = gdb_getc()) >= 0 && c != '#')
+        {
+            if (len < GDB_PACKET_SIZE - 1)
+                packet[len++] = (char)c;
+            sum += (uint8_t)c;
+        }
+        char hex[3] = { 0 };
+        if (c < 0 || (c = gdb_getc()) < 0)
+            return -1;
+        hex[0] = (char)c;
+        if ((c = gdb_getc()) < 0)
+            return -1;
+        hex[1] = (char)c;
+        packet[len] = '\0';
+        if (strtoul(hex, NULL, 16) == sum)
+            break;
+        ack = '-';
+        send(gdb_sock, &ack, 1, 0);
+        ack = '+';
+    }
+    send(gdb_sock, &ack, 1, 0);
+    return len;
+}
+
+int gdb_send_packet(const char* data)
+{
+    static char frame[2 * GDB_PACKET_SIZE + 4];
+    size_t len = strlen(data), i;
+    uint8_t sum = 0;
+    int c;
+
+    for (i = 0; i < len; i++)
+        sum += (uint8_t)data[i];
+    frame[0] = '$';
+    memcpy(frame + 1, data, len);
+    sprintf(frame + 1 + len, "#%02x", sum);
+    do
+    {
+        if (send(gdb_sock, frame, (int)len + 4, 0) != (int)len + 4)
+            return 1;
+        c = gdb_getc();
+    } while (c == '-');
+    return c < 0;
+}
+
+int gdb_interrupted()
+{
+    fd_set fds;
+    struct timeval timeout = { 0, 0 };
+
+    FD_ZERO(&fds);
+    FD_SET(gdb_sock, &fds);
+    if (select((int)gdb_sock + 1, &fds, NULL, NULL, &timeout) <= 0)
+        return 0;
+    return gdb_getc() == 0x03;
+}
+
+uint32_t gdb_hex_le32(const char* hex)
+{
+    uint32_t value = 0;
+    int i;
+    for (i = 0; i < 4; i++)
+    {
+        char byte[3] = { hex[2 * i], hex[2 * i + 1], 0 };
+        value |= (uint32_t)strtoul(byte, NULL, 16) << (8 * i);
+    }
+    return value;
+}
+
+int gdb_put_le32(char* hex, uint32_t value)
+{
+    return sprintf(hex, "%02x%02x%02x%02x", value & 0xff, value >> 8 & 0xff, value >> 16 & 0xff, value >> 24);
+}
+
+uint32_t gdb_read_reg(int n)
+{
+    if (n < REG_SIZE)
+        return r[n];
+    if (n == REG_SIZE)
+        return pc * 8;
+    return IORegister[n - REG_SIZE - 1];
+}
+
+int gdb_write_reg(int n, uint32_t value)
+{
+    if (n < REG_SIZE)
+        r[n] = value;
+    else if (n == REG_SIZE)
+        pc = (value / 8) & 0xfff;
+    else
+        IORegister[n - REG_SIZE - 1] = value;
+    return 0;
+}
+
+int gdb_mem_byte(uint32_t addr, uint8_t* value, uint8_t write)
+{
+    int shift;
+
+    if (addr < 8 * MEMORY_SIZE)
+    {
+        uint64_t* word = &i_mem[addr / 8];
+        shift = 8 * (addr % 8);
+        if (!write)
+            *value = (uint8_t)(*word >> shift);
+        else if (shift < 48)
+            // instructions are 48-bit, the upper 2 bytes read as 0
+            *word = (*word & ~((uint64_t)0xff << shift)) | (uint64_t)*value << shift;
+        return 0;
+    }
+
+    uint32_t* word;
+    if (addr >= GDB_DMEM_BASE && addr < GDB_DMEM_BASE + 4 * MEMORY_SIZE)
+        word = (uint32_t*)&d_mem[(addr - GDB_DMEM_BASE) / 4];
+    else if (addr >= GDB_IO_BASE && addr < GDB_IO_BASE + 4 * IO_REG_SIZE)
+        word = &IORegister[(addr - GDB_IO_BASE) / 4];
+    else
+        return 1;
+    shift = 8 * (addr % 4);
+    if (write)
+        *word = (*word & ~((uint32_t)0xff << shift)) | (uint32_t)*value << shift;
+    else
+        *value = (uint8_t)(*word >> shift);
+    return 0;
+}
+
+int gdb_target_xml(char* xml)
+{
+    const char* names[REG_SIZE] = { "zero", "imm1", "imm2", "v0", "a0", "a1", "a2", "t0", "t1", "t2",
+        "s0", "s1", "s2", "gp", "sp", "ra" };
+    int i, len;
+
+    len = sprintf(xml, "<?xml version=\"1.0\"?>\n<!DOCTYPE target SYSTEM \"gdb-target.dtd\">\n"
+        "<target version=\"1.0\">\n<feature name=\"sim.core\">\n");
+    for (i = 0; i < REG_SIZE; i++)
+        len += sprintf(xml + len, "<reg name=\"%s\" bitsize=\"32\" type=\"int32\" regnum=\"%d\"/>\n", names[i], i);
+    len += sprintf(xml + len, "<reg name=\"pc\" bitsize=\"32\" type=\"code_ptr\" regnum=\"%d\"/>\n", REG_SIZE);
+    for (i = 0; i < IO_REG_SIZE; i++)
+        len += sprintf(xml + len, "<reg name=\"%s\" bitsize=\"32\" type=\"uint32\" regnum=\"%d\" group=\"io\"/>\n",
+            i == RESERVED0 ? "reserved0" : i == RESERVED1 ? "reserved1" : get_IO_reg_name(i), REG_SIZE + 1 + i);
+    len += sprintf(xml + len, "</feature>\n</target>\n");
+    return len;
+}
+
+int gdb_stop_reply(char* reply, uint8_t halted)
+{
+    if (halted)
+        return sprintf(reply, "W00");
+    if (watch_rw != 0)
+    {
+        uint8_t kind = watchpoints[watch_addr];
+        watch_rw = 0;
+        return sprintf(reply, "T05%s:%x;", kind == 3 ? "awatch" : kind == 1 ? "rwatch" : "watch",
+            GDB_DMEM_BASE + 4 * watch_addr);
+    }
+    return sprintf(reply, "T05");
+}
+
+int gdb_resume(uint8_t single_step, uint8_t* halted)
+{
+    // the breakpoint at the current pc, if any, is the one being resumed from
+    break_skip_cycle = cycles;
+    debug_stop = 0;
+    if (single_step)
+        return run_until(cycles + 1, halted);
+
+    while (!*halted && !debug_stop)
+    {
+        if (run_until(cycles + GDB_POLL_CYCLES, halted) != 0)
+            return 2;
+        if (!debug_stop && gdb_interrupted())
+            break;
+    }
+    return 0;
+}
+
+int gdb_serve(uint8_t* halted)
+{
+    static char packet[GDB_PACKET_SIZE], reply[2 * GDB_PACKET_SIZE], xml[8192];
+    int len, xml_len, n, i;
+    unsigned long addr, size;
+    uint8_t byte;
+    char* p;
+
+    if (gdb_listen(gdb_address) != 0)
+        return 1;
+    xml_len = gdb_target_xml(xml);
+
+    while ((len = gdb_recv_packet(packet)) >= 0)
+    {
+        reply[0] = '\0';
+        switch (packet[0])
+        {
+        case '?':
+            gdb_stop_reply(reply, *halted);
+            break;
+        case 'g':
+            for (n = 0; n < GDB_REG_COUNT; n++)
+                gdb_put_le32(reply + 8 * n, gdb_read_reg(n));
+            break;
+        case 'G':
+            for (n = 0, p = packet + 1; n < GDB_REG_COUNT && strlen(p) >= 8; n++, p += 8)
+                gdb_write_reg(n, gdb_hex_le32(p));
+            strcpy(reply, "OK");
+            break;
+        case 'P':
+            n = (int)strtoul(packet + 1, &p, 16);
+            if (n >= GDB_REG_COUNT || *p != '=' || strlen(p + 1) < 8)
+                strcpy(reply, "E01");
+            else
+            {
+                gdb_write_reg(n, gdb_hex_le32(p + 1));
+                strcpy(reply, "OK");
+            }
+            break;
+        case 'p':
+            n = (int)strtoul(packet + 1, NULL, 16);
+            if (n >= GDB_REG_COUNT)
+                strcpy(reply, "E01");
+            else
+                gdb_put_le32(reply, gdb_read_reg(n));
+            break;
+        case 'm':
+            addr = strtoul(packet + 1, &p, 16);
+            size = strtoul(p + 1, NULL, 16);
+            if (size > GDB_PACKET_SIZE / 2 - 1)
+                size = GDB_PACKET_SIZE / 2 - 1;
+            for (i = 0; i < (int)size; i++)
+            {
+                if (gdb_mem_byte((uint32_t)(addr + i), &byte, 0) != 0)
+                    break;
+                sprintf(reply + 2 * i, "%02x", byte);
+            }
+            if (i == 0 && size != 0)
+                strcpy(reply, "E01");
+            break;
+        case 'M':
+            addr = strtoul(packet + 1, &p, 16);
+            size = strtoul(p + 1, &p, 16);
+            p++; // skip ':'
+            for (i = 0; i < (int)size && p[0] && p[1]; i++, p += 2)
+            {
+                char hex[3] = { p[0], p[1], 0 };
+                byte = (uint8_t)strtoul(hex, NULL, 16);
+                if (gdb_mem_byte((uint32_t)(addr + i), &byte, 1) != 0)
+                    break;
+            }
+            if (addr < 8 * MEMORY_SIZE)
+                decode_imem();
+            strcpy(reply, i == (int)size ? "OK" : "E01");
+            break;
+        case 'Z':
+        case 'z':
+            addr = strtoul(packet + 3, &p, 16);
+            size = strtoul(p + 1, NULL, 16);
+            if (set_breakpoint(packet[1], (uint32_t)addr, (uint32_t)size, packet[0] == 'Z') == 0)
+                strcpy(reply, "OK");
+            break;
+        case 'c':
+        case 's':
+            if (packet[1])
+                pc = (strtoul(packet + 1, NULL, 16) / 8) & 0xfff;
+            if (gdb_resume(packet[0] == 's', halted) != 0)
+            {
+                gdb_send_packet("X04");
+                close_socket(gdb_sock);
+                return 1;
+            }
+            gdb_stop_reply(reply, *halted);
+            if (*halted)
+            {
+                gdb_send_packet(reply);
+                close_socket(gdb_sock);
+                return 0;
+            }
+            break;
+        case 'k':
+            // kill: the outputs are written as of now
+            close_socket(gdb_sock);
+            return 0;
+        case 'D':
+            gdb_send_packet("OK");
+            len = -1;
+            break;
+        case 'H':
+        case 'T':
+            strcpy(reply, "OK");
+            break;
+        case 'q':
+            if (strncmp(packet, "qSupported", 10) == 0)
+                sprintf(reply, "PacketSize=%x;qXfer:features:read+", GDB_PACKET_SIZE);
+            else if (strncmp(packet, "qXfer:features:read:target.xml:", 31) == 0)
+            {
+                addr = strtoul(packet + 31, &p, 16);
+                size = strtoul(p + 1, NULL, 16);
+                if (size > GDB_PACKET_SIZE - 2)
+                    size = GDB_PACKET_SIZE - 2;
+                if ((long)addr >= xml_len)
+                    strcpy(reply, "l");
+                else
+                {
+                    n = xml_len - (int)addr < (int)size ? xml_len - (int)addr : (int)size;
+                    reply[0] = (int)addr + n >= xml_len ? 'l' : 'm';
+                    memcpy(reply + 1, xml + addr, n);
+                    reply[1 + n] = '\0';
+                }
+            }
+            else if (strcmp(packet, "qAttached") == 0)
+                strcpy(reply, "1");
+            else if (strcmp(packet, "qC") == 0)
+                strcpy(reply, "QC1");
+            else if (strcmp(packet, "qfThreadInfo") == 0)
+                strcpy(reply, "m1");
+            else if (strcmp(packet, "qsThreadInfo") == 0)
+                strcpy(reply, "l");
+            break;
+        case 'v':
+            if (strncmp(packet, "vKill", 5) == 0)
+            {
+                gdb_send_packet("OK");
+                close_socket(gdb_sock);
+                return 0;
+            }
+            break;
+        }
+        if (len < 0)
+            break;
+        if (gdb_send_packet(reply) != 0)
+            break;
+    }
+
+    // the debugger detached or went away: finish the run without it
+    close_socket(gdb_sock);
+    memset(breakpoints, 0, sizeof(breakpoints));
+    memset(watchpoints, 0, sizeof(watchpoints));
+    breakpoint_count = watchpoint_count = 0;
+    update_mem_hooks();
+    decode_imem();
+    debug_stop = 0;
+    break_skip_cycle = cycles;
+    return run_until(~0UL, halted) != 0;
+}
+
+int core_mark_write(uint16_t addr)
+{
+    struct core* core = &cores[core_id];
+    core->write_cycle[addr] = cycles;
+    if (!core->is_dirty[addr])
+    {
+        core->is_dirty[addr] = 1;
+        core->dirty[core->dirty_count++] = addr;
+    }
+    return 0;
+}
+
+int core_barrier_wait()
+{
+#ifdef _WIN32
+    return EnterSynchronizationBarrier(&core_barrier, 0) ? 1 : 0;
+#else
+    return pthread_barrier_wait(&core_barrier) == PTHREAD_BARRIER_SERIAL_THREAD;
+#endif
+}
+
+int merge_quantum()
+{
+    int c, best;
+    uint32_t i, n, next[MAX_CORES];
+
+    // stores: the latest store of the quantum to an address wins, the higher core on the same cycle
+    merge_stamp++;
+    for (c = 0; c < core_count; c++)
+    {
+        struct core* core = &cores[c];
+        for (i = 0; i < core->dirty_count; i++)
+        {
+            uint16_t addr = core->dirty[i];
+            if (win_stamp[addr] != merge_stamp || core->write_cycle[addr] >= win_cycle[addr])
+            {
+                win_stamp[addr] = merge_stamp;
+                win_cycle[addr] = core->write_cycle[addr];
+                shared_d_mem[addr] = core->d_mem[addr];
+            }
+            core->is_dirty[addr] = 0;
+        }
+        core->dirty_count = 0;
+    }
+
+    // disk transfers in (cycle, core) order. A read fills the words of its buffer that no store of a later
+    // cycle won, a store in the cycle of the command is overwritten like in handle_disk()
+    for (;;)
+    {
+        best = -1;
+        for (c = 0; c < core_count; c++)
+            if (cores[c].has_disk && (best < 0 || cores[c].disk_cycle < cores[best].disk_cycle))
+                best = c;
+        if (best < 0)
+            break;
+        struct core* core = &cores[best];
+        if (core->disk_cmd == 1)
+            for (i = 0; i < SECTOR_SIZE; i++)
+            {
+                uint16_t addr = core->disk_buffer + i;
+                if (win_stamp[addr] != merge_stamp || win_cycle[addr] <= core->disk_cycle)
+                {
+                    win_stamp[addr] = merge_stamp;
+                    win_cycle[addr] = core->disk_cycle;
+                    shared_d_mem[addr] = disk[core->disk_sector][i];
+                }
+            }
+        else
+            sec_cpy(disk[core->disk_sector], core->disk_data);
+        core->has_disk = 0;
+    }
+
+    // monitor writes in (cycle, core) order
+    for (c = 0; c < core_count; c++)
+        next[c] = 0;
+    for (;;)
+    {
+        best = -1;
+        for (c = 0; c < core_count; c++)
+            if (next[c] < cores[c].monitor_count && (best < 0 ||
+                cores[c].monitor_writes[next[c]].cycle < cores[best].monitor_writes[next[best]].cycle))
+                best = c;
+        if (best < 0)
+            break;
+        n = next[best]++;
+        monitor[cores[best].monitor_writes[n].addr >> 8][cores[best].monitor_writes[n].addr & 0xff] = cores[best].monitor_writes[n].data;
+    }
+    for (c = 0; c < core_count; c++)
+        cores[c].monitor_count = 0;
+
+    // inter-core interrupts, raised at the start of the next quantum
+    for (c = 0; c < core_count; c++)
+    {
+        for (n = 0; n < (uint32_t)core_count; n++)
+            if (cores[c].ipi_out >> n & 1)
+                cores[n].ipi_in = 1;
+        cores[c].ipi_out = 0;
+    }
+
+    cores_done = 1;
+    for (c = 0; c < core_count; c++)
+    {
+        if (cores[c].failed)
+        {
+            cores_done = 1;
+            break;
+        }
+        if (!cores[c].halted)
+            cores_done = 0;
+    }
+    quantum_end += quantum_cycles;
+    return 0;
+}
+
+int core_path(char* buffer, const char* path, const char* kind, int id)
+{
+    const char* dot = strrchr(path, '.');
+    const char* slash = strrchr(path, '/');
+    const char* backslash = strrchr(path, '\\');
+    if (dot == NULL || (slash != NULL && slash > dot) || (backslash != NULL && backslash > dot))
+        dot = path + strlen(path);
+    sprintf(buffer, "%.*s_%s%d%s", (int)(dot - path), path, kind, id, dot);
+    return 0;
+}
+
+int core_closing()
+{
+    // out_paths: dmemout regout trace hwregtrace cycles leds display7seg ...
+    char regout[FILENAME_MAX], trace[FILENAME_MAX], hwregtrace[FILENAME_MAX], cycles_file[FILENAME_MAX];
+    char leds[FILENAME_MAX], display7seg[FILENAME_MAX];
+    int result = 0;
+
+    core_path(regout, out_paths[1], "core", core_id);
+    core_path(trace, out_paths[2], "core", core_id);
+    core_path(hwregtrace, out_paths[3], "core", core_id);
+    core_path(cycles_file, out_paths[4], "core", core_id);
+    core_path(leds, out_paths[5], "core", core_id);
+    core_path(display7seg, out_paths[6], "core", core_id);
+    if ((!trace_off && write_trace(trace) != 0) ||
+        write_hwregtrace_leds_display7seg(hwregtrace, leds, display7seg) != 0 ||
+        write_cycles_regout(cycles_file, regout) != 0)
+        result = 1;
+
+    free_log_status();
+    free_log_hw_access();
+    free_log_irq2in();
+    return result;
+}
+
+int core_run(int id)
+{
+    struct core* core = &cores[id];
+    uint8_t done = 0;
+
+    core_id = id;
+    d_mem = d_mem_storage;
+    core->d_mem = d_mem;
+    pc = 0;
+    cycles = 0;
+    irq_busy = 0;
+    disk_last_cmd_cycle = ~0;
+    monitor_done_cycle = 0;
+    dma_done_cycle = 0;
+    memset(r, 0, sizeof(r));
+    memset(IORegister, 0, sizeof(IORegister));
+    IORegister[COREID] = id;
+    data_log.status_head = NULL;
+    data_log.hw_head = NULL;
+    data_log.irq2in_head = id == 0 ? irq2in_list : NULL;
+
+    while (!done)
+    {
+        // the stores of all cores become visible at the quantum boundary
+        memcpy(d_mem, shared_d_mem, sizeof(shared_d_mem));
+        if (core->ipi_in)
+        {
+            IORegister[IRQ3STATUS] = 1;
+            core->ipi_in = 0;
+        }
+        if (run_until(quantum_end, &core->halted) != 0)
+            core->failed = 1;
+
+        if (core_barrier_wait())
+            merge_quantum();
+        core_barrier_wait();
+        done = cores_done;
+    }
+
+    core->result = core->failed ? 1 : core_closing();
+    return 0;
+}
+
+#ifdef _WIN32
+DWORD WINAPI core_thread(LPVOID arg)
+{
+    core_run((int)(intptr_t)arg);
+    return 0;
+}
+#else
+void* core_thread(void* arg)
+{
+    core_run((int)(intptr_t)arg);
+    return NULL;
+}
+#endif
+
+int run_cores()
+{
+    int c, result = 0;
+#ifdef _WIN32
+    HANDLE threads[MAX_CORES];
+#else
+    pthread_t threads[MAX_CORES];
+#endif
+
+    cores = (struct core*)calloc(core_count, sizeof(struct core));
+    if (cores == NULL)
+    {
+        err_msg("malloc");
+        return 1;
+    }
+    // the loaded d_mem and irq2in of this thread are handed to the cores
+    memcpy(shared_d_mem, d_mem, sizeof(shared_d_mem));
+    irq2in_list = data_log.irq2in_head;
+    data_log.irq2in_head = NULL;
+    quantum_end = quantum_cycles;
+
+#ifdef _WIN32
+    InitializeSynchronizationBarrier(&core_barrier, core_count, -1);
+    for (c = 0; c < core_count; c++)
+        threads[c] = CreateThread(NULL, 0, core_thread, (LPVOID)(intptr_t)c, 0, NULL);
+    WaitForMultipleObjects(core_count, threads, TRUE, INFINITE);
+    for (c = 0; c < core_count; c++)
+        CloseHandle(threads[c]);
+    DeleteSynchronizationBarrier(&core_barrier);
+#else
+    pthread_barrier_init(&core_barrier, NULL, core_count);
+    for (c = 0; c < core_count; c++)
+        pthread_create(&threads[c], NULL, core_thread, (void*)(intptr_t)c);
+    for (c = 0; c < core_count; c++)
+        pthread_join(threads[c], NULL);
+    pthread_barrier_destroy(&core_barrier);
+#endif
+
+    for (c = 0; c < core_count; c++)
+    {
+        result |= cores[c].result;
+        free(cores[c].monitor_writes);
+    }
+    free(cores);
+    cores = NULL;
+    memcpy(d_mem, shared_d_mem, sizeof(shared_d_mem));
+    return result;
+}
+
+unsigned long quiet_until()
+{
+    // the lane runs in the SIMD group while end_cycle() only counts the cycle: no command starts, no
+    // running one completes, the timer doesn't wrap and no interrupt is taken
+    unsigned long until = ~0UL, event;
+    struct irq2in* next;
+
+    if (IORegister[IPISEND] || (IORegister[MONITORCMD] && !monitor_done_cycle) ||
+        (IORegister[DISKCMD] && !IORegister[DISKSTATUS]) || (IORegister[DMACMD] && !IORegister[DMASTATUS]))
+        return cycles;
+    if (monitor_done_cycle)
+        until = monitor_done_cycle;
+    if (IORegister[TIMERENABLE])
+    {
+        event = cycles + (uint32_t)(IORegister[TIMERMAX] - IORegister[TIMERCURRENT]);
+        if (event < until)
+            until = event;
+    }
+    // handle_disk() also raises irq1 in cycle 1023 before the first command, disk_last_cmd_cycle is ~0
+    event = disk_last_cmd_cycle + DISK_CYCLES;
+    if (event >= cycles && event < until)
+        until = event;
+    if (IORegister[DMASTATUS] && dma_done_cycle >= cycles && dma_done_cycle < until)
+        until = dma_done_cycle;
+    if (!irq_busy)
+    {
+        // irq2status reads 0 in the cycles before the next irq2in
+        if (((IORegister[IRQ0ENABLE] & IORegister[IRQ0STATUS]) | (IORegister[IRQ1ENABLE] & IORegister[IRQ1STATUS]) |
+            (IORegister[IRQ3ENABLE] & IORegister[IRQ3STATUS]) | (IORegister[IRQ4ENABLE] & IORegister[IRQ4STATUS])) == 1)
+            return cycles;
+        for (next = data_log.irq2in_head; next != NULL && next->cycle < cycles; next = next->next)
+            ;
+        if (next != NULL && next->cycle < until)
+            until = next->cycle;
+    }
+    return until;
+}
+
+int lane_enter(int id)
+{
+    struct lane* lane = &lanes[id];
+    int i;
+
+    for (i = 0; i < REG_SIZE; i++)
+        r[i] = lane_r[i][id];
+    memcpy(IORegister, lane->IORegister, sizeof(IORegister));
+    pc = lane->pc;
+    irq_busy = lane->irq_busy;
+    cycles = lane->cycles;
+    disk_last_cmd_cycle = lane->disk_last_cmd_cycle;
+    monitor_done_cycle = lane->monitor_done_cycle;
+    dma_done_cycle = lane->dma_done_cycle;
+    d_mem = lane->d_mem;
+    disk = lane->disk;
+    monitor = lane->monitor;
+    data_log = lane->log;
+    trace_out = lane->trace_out;
+    hwregtrace_out = lane->hwregtrace_out;
+    leds_out = lane->leds_out;
+    display7seg_out = lane->display7seg_out;
+    return 0;
+}
+
+int lane_leave(int id)
+{
+    struct lane* lane = &lanes[id];
+    int i;
+
+    for (i = 0; i < REG_SIZE; i++)
+        lane_r[i][id] = r[i];
+    memcpy(lane->IORegister, IORegister, sizeof(IORegister));
+    lane->pc = pc;
+    lane->irq_busy = irq_busy;
+    lane->cycles = cycles;
+    lane->disk_last_cmd_cycle = disk_last_cmd_cycle;
+    lane->monitor_done_cycle = monitor_done_cycle;
+    lane->dma_done_cycle = dma_done_cycle;
+    lane->log = data_log;
+    lane->trace_out = trace_out;
+    lane->hwregtrace_out = hwregtrace_out;
+    lane->leds_out = leds_out;
+    lane->display7seg_out = display7seg_out;
+    lane->quiet_until = quiet_until();
+    return 0;
+}
+
+int lane_ready(int id)
+{
+    return decoded[lanes[id].pc].opcode <= LANE_LAST_OPCODE && lanes[id].cycles < lanes[id].quiet_until;
+}
+
+int lane_scalar(int id, uint16_t target)
+{
+    // target MEMORY_SIZE: ready at any pc
+    int n, status = 0;
+
+    lane_enter(id);
+    for (n = 0; n < LANE_BURST && status == 0; n++)
+    {
+        status = step(~0UL);
+        if (status == 0 && decoded[pc].opcode <= LANE_LAST_OPCODE && (target == MEMORY_SIZE || pc == target) &&
+            cycles < quiet_until())
+            break;
+    }
+    if (status == 2)
+        err_msg("Invalid opcode");
+    lanes[id].halted = status == 1;
+    lane_leave(id);
+    return status == 2;
+}
+
+int lanes_alu(uint8_t opcode, uint8_t rd, uint8_t rs, uint8_t rt, uint8_t rm, uint32_t mask)
+{
+    int i;
+
+    if (opcode >= 6)
+    {
+        // shift counts of 32 or more are left to the host, like in execute_instruction()
+        for (i = 0; i < lane_count; i++)
+        {
+            if (!(mask >> i & 1))
+                continue;
+            if (opcode == 6)
+                lane_r[rd][i] = lane_r[rs][i] << lane_r[rt][i];
+            else
+            {
+                lane_r[rd][i] = lane_r[rs][i] >> lane_r[rt][i];
+                if (opcode == 7)
+                    lane_r[rd][i] = extend_sign(lane_r[rd][i], 31 - lane_r[rt][i]);
+#if SIM_FAULT == 2
+                if (opcode == 7)
+                    lane_r[rd][i] = (uint32_t)lane_r[rs][i] >> lane_r[rt][i];
+#endif
+            }
+        }
+        return 0;
+    }
+
+#if defined(__AVX512F__)
+    __m512i a = _mm512_loadu_si512(lane_r[rs]), b = _mm512_loadu_si512(lane_r[rt]), c = _mm512_loadu_si512(lane_r[rm]);
+    __m512i v;
+    switch (opcode)
+    {
+    case 0: v = _mm512_add_epi32(_mm512_add_epi32(a, b), c); break;
+    case 1: v = _mm512_sub_epi32(_mm512_sub_epi32(a, b), c); break;
+    case 2: v = _mm512_add_epi32(_mm512_mullo_epi32(a, b), c); break;
+    case 3: v = _mm512_and_si512(_mm512_and_si512(a, b), c); break;
+    case 4: v = _mm512_or_si512(_mm512_or_si512(a, b), c); break;
+    default: v = _mm512_xor_si512(_mm512_xor_si512(a, b), c); break;
+    }
+    _mm512_mask_storeu_epi32(lane_r[rd], (__mmask16)mask, v);
+#elif defined(__AVX2__)
+    const __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    for (i = 0; i < LANE_MAX; i += 8)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i*)&lane_r[rs][i]);
+        __m256i b = _mm256_loadu_si256((const __m256i*)&lane_r[rt][i]);
+        __m256i c = _mm256_loadu_si256((const __m256i*)&lane_r[rm][i]);
+        __m256i v;
+        switch (opcode)
+        {
+        case 0: v = _mm256_add_epi32(_mm256_add_epi32(a, b), c); break;
+        case 1: v = _mm256_sub_epi32(_mm256_sub_epi32(a, b), c); break;
+        case 2: v = _mm256_add_epi32(_mm256_mullo_epi32(a, b), c); break;
+        case 3: v = _mm256_and_si256(_mm256_and_si256(a, b), c); break;
+        case 4: v = _mm256_or_si256(_mm256_or_si256(a, b), c); break;
+        default: v = _mm256_xor_si256(_mm256_xor_si256(a, b), c); break;
+        }
+        // lane i + j is stored if bit j of its byte of mask is set
+        __m256i m = _mm256_set1_epi32(mask >> i);
+        _mm256_maskstore_epi32((int*)&lane_r[rd][i], _mm256_cmpeq_epi32(_mm256_and_si256(m, bits), bits), v);
+    }
+#else
+    int32_t v[LANE_MAX];
+    for (i = 0; i < LANE_MAX; i++)
+    {
+        switch (opcode)
+        {
+        case 0: v[i] = lane_r[rs][i] + lane_r[rt][i] + lane_r[rm][i]; break;
+        case 1: v[i] = lane_r[rs][i] - lane_r[rt][i] - lane_r[rm][i]; break;
+        case 2: v[i] = lane_r[rs][i] * lane_r[rt][i] + lane_r[rm][i]; break;
+        case 3: v[i] = lane_r[rs][i] & lane_r[rt][i] & lane_r[rm][i]; break;
+        case 4: v[i] = lane_r[rs][i] | lane_r[rt][i] | lane_r[rm][i]; break;
+        default: v[i] = lane_r[rs][i] ^ lane_r[rt][i] ^ lane_r[rm][i]; break;
+        }
+    }
+    for (i = 0; i < LANE_MAX; i++)
+        if (mask >> i & 1)
+            lane_r[rd][i] = v[i];
+#endif
+    return 0;
+}
+
+uint32_t lanes_compare(uint8_t opcode, uint8_t rs, uint8_t rt, uint32_t mask)
+{
+#if defined(__AVX512F__)
+    __m512i a = _mm512_loadu_si512(lane_r[rs]), b = _mm512_loadu_si512(lane_r[rt]);
+    switch (opcode)
+    {
+    case 9: return _mm512_mask_cmpeq_epi32_mask((__mmask16)mask, a, b);
+    case 10: return _mm512_mask_cmpneq_epi32_mask((__mmask16)mask, a, b);
+    case 11: return _mm512_mask_cmplt_epi32_mask((__mmask16)mask, a, b);
+    case 12: return _mm512_mask_cmpgt_epi32_mask((__mmask16)mask, a, b);
+    case 13: return _mm512_mask_cmple_epi32_mask((__mmask16)mask, a, b);
+    default: return _mm512_mask_cmpge_epi32_mask((__mmask16)mask, a, b);
+    }
+#elif defined(__AVX2__)
+    uint32_t taken = 0, bits;
+    int i;
+    for (i = 0; i < LANE_MAX; i += 8)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i*)&lane_r[rs][i]);
+        __m256i b = _mm256_loadu_si256((const __m256i*)&lane_r[rt][i]);
+        if (opcode == 9 || opcode == 10)
+            bits = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(a, b)));
+        else if (opcode == 11 || opcode == 14)
+            bits = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(b, a)));
+        else
+            bits = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(a, b)));
+        if (opcode == 10 || opcode == 13 || opcode == 14)
+            // bne, ble and bge are the complements of beq, bgt and blt
+            bits ^= 0xff;
+        taken |= bits << i;
+    }
+    return taken & mask;
+#else
+    uint32_t taken = 0;
+    int i, cond;
+    for (i = 0; i < LANE_MAX; i++)
+    {
+        switch (opcode)
+        {
+        case 9: cond = lane_r[rs][i] == lane_r[rt][i]; break;
+        case 10: cond = lane_r[rs][i] != lane_r[rt][i]; break;
+        case 11: cond = lane_r[rs][i] < lane_r[rt][i]; break;
+        case 12: cond = lane_r[rs][i] > lane_r[rt][i]; break;
+        case 13: cond = lane_r[rs][i] <= lane_r[rt][i]; break;
+        default: cond = lane_r[rs][i] >= lane_r[rt][i]; break;
+        }
+        taken |= (uint32_t)cond << i;
+    }
+    return taken & mask;
+#endif
+}
+
+int lanes_vector(uint32_t mask, uint16_t group_pc, unsigned long budget)
+{
+    // every lane of mask is ready at group_pc for budget cycles. The group runs until a lane must go to
+    // the scalar engine or the lanes branch to different pcs, then each lane gets its own pc.
+    const struct decoded_inst* d;
+    uint16_t next_pc[LANE_MAX];
+    int32_t regs[REG_SIZE];
+    unsigned long n = 0;
+    uint32_t taken;
+    uint8_t split = 0;
+    int i, j, first = -1;
+
+    for (i = 0; i < lane_count; i++)
+        if (mask >> i & 1)
+        {
+            if (first < 0)
+                first = i;
+            next_pc[i] = group_pc;
+        }
+
+    while (n < budget && !split && decoded[group_pc].opcode <= LANE_LAST_OPCODE)
+    {
+        d = &decoded[group_pc];
+        for (i = 0; i < LANE_MAX; i++)
+        {
+            lane_r[0][i] = 0;
+            lane_r[1][i] = d->imm1;
+            lane_r[2][i] = d->imm2;
+        }
+        if (!trace_off)
+            for (i = 0; i < lane_count; i++)
+                if (mask >> i & 1)
+                {
+                    for (j = 0; j < REG_SIZE; j++)
+                        regs[j] = lane_r[j][i];
+                    log_status(&lanes[i].log, &lanes[i].trace_out, group_pc, regs);
+                }
+
+        taken = 0;
+        if (d->opcode <= 8)
+            lanes_alu(d->opcode, d->rd, d->rs, d->rt, d->rm, mask);
+        else if (d->opcode <= 14)
+            taken = lanes_compare(d->opcode, d->rs, d->rt, mask);
+        else if (d->opcode == 15)
+        {
+            // jal: rm is read after rd is written
+            for (i = 0; i < lane_count; i++)
+                if (mask >> i & 1)
+                    lane_r[d->rd][i] = (group_pc + 1) & 0xfff;
+            taken = mask;
+        }
+        else if (d->opcode == 16)
+        {
+            for (i = 0; i < lane_count; i++)
+                if (mask >> i & 1)
+                    lane_r[d->rd][i] = lanes[i].d_mem[(lane_r[d->rs][i] + lane_r[d->rt][i]) & 0xfff] + lane_r[d->rm][i];
+        }
+        else
+        {
+            for (i = 0; i < lane_count; i++)
+                if (mask >> i & 1)
+                    lanes[i].d_mem[(lane_r[d->rs][i] + lane_r[d->rt][i]) & 0xfff] = lane_r[d->rm][i] + lane_r[d->rd][i];
+        }
+
+        for (i = 0; i < LANE_MAX; i++)
+            lane_r[0][i] = 0;
+        n++;
+        if (taken == 0)
+        {
+            group_pc = (group_pc + PC_ADDR_SIZE) & 0xfff;
+            continue;
+        }
+        for (i = 0; i < lane_count; i++)
+            if (mask >> i & 1)
+            {
+                next_pc[i] = taken >> i & 1 ? lane_r[d->rm][i] & 0xfff : group_pc;
+                if (next_pc[i] == group_pc)
+                    next_pc[i] = (group_pc + PC_ADDR_SIZE) & 0xfff;
+                if (next_pc[i] != next_pc[first])
+                    split = 1;
+            }
+        group_pc = next_pc[first];
+    }
+
+    // the cycles only counted: the timer can't reach timermax in them and irq2status reads 0
+    for (i = 0; i < lane_count; i++)
+        if (mask >> i & 1)
+        {
+            struct lane* lane = &lanes[i];
+            lane->pc = split ? next_pc[i] : group_pc;
+            lane->cycles += n;
+            lane->IORegister[CLKS] += n;
+            if (lane->IORegister[TIMERENABLE])
+                lane->IORegister[TIMERCURRENT] += n;
+            if (!lane->irq_busy && n)
+                lane->IORegister[IRQ2STATUS] = 0;
+        }
+    return 0;
+}
+
+int run_lanes(char* paths[])
+{
+    // paths: the 14 positional arguments, the inputs of lane 0 and the output names
+    char line[FILENAME_MAX], out[10][FILENAME_MAX];
+    int id, i, count, best, best_count, line_number = 0, result = 0;
+    unsigned long budget;
+    uint32_t mask;
+    uint16_t group_pc;
+    uint8_t running = 1;
+    FILE* f;
+
+    lanes = (struct lane*)calloc(LANE_MAX, sizeof(struct lane));
+    if (lanes == NULL)
+    {
+        err_msg("malloc");
+        return 1;
+    }
+    for (i = 0; i < 3; i++)
+        strcpy(lanes[0].inputs[i], paths[i + 1]);
+    f = fopen(lanes_file, "r");
+    if (f == NULL)
+    {
+        err_msg("open file");
+        return 1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        line_number++;
+        if (sscanf(line, "%s", out[0]) != 1)
+            // blank line
+            continue;
+        if (lane_count == LANE_MAX || sscanf(line, "%s %s %s", lanes[lane_count].inputs[0], lanes[lane_count].inputs[1],
+            lanes[lane_count].inputs[2]) != 3)
+        {
+            fprintf(stderr, "%s line %d: expected <dmemin> <diskin> <irq2in>, at most %d lanes after lane 0\n",
+                lanes_file, line_number, LANE_MAX - 1);
+            fclose(f);
+            return 1;
+        }
+        lane_count++;
+    }
+    fclose(f);
+
+    for (id = 0; id < lane_count; id++)
+    {
+        lane_enter(id);
+        if (init(paths[0], lanes[id].inputs[0], lanes[id].inputs[1], lanes[id].inputs[2]) != 0)
+            return 1;
+        lane_leave(id);
+    }
+
+    while (running && result == 0)
+    {
+        // the lanes that can't run in the SIMD group step on the scalar engine until they can
+        for (id = 0; id < lane_count && result == 0; id++)
+            if (!lanes[id].halted && !lane_ready(id))
+                result = lane_scalar(id, MEMORY_SIZE);
+
+        // the group runs from the pc most ready lanes are at, the others catch up with it on the scalar engine
+        best = -1;
+        best_count = 0;
+        for (id = 0; id < lane_count; id++)
+        {
+            if (lanes[id].halted || !lane_ready(id))
+                continue;
+            for (count = 0, i = 0; i < lane_count; i++)
+                count += !lanes[i].halted && lane_ready(i) && lanes[i].pc == lanes[id].pc;
+            if (count > best_count)
+            {
+                best = id;
+                best_count = count;
+            }
+        }
+        if (best >= 0)
+        {
+            group_pc = lanes[best].pc;
+            for (id = 0; id < lane_count && result == 0; id++)
+                if (!lanes[id].halted && lane_ready(id) && lanes[id].pc != group_pc)
+                    result = lane_scalar(id, group_pc);
+
+            mask = 0;
+            budget = LANE_BURST;
+            for (id = 0; id < lane_count; id++)
+                if (!lanes[id].halted && lane_ready(id) && lanes[id].pc == group_pc)
+                {
+                    mask |= 1u << id;
+                    if (lanes[id].quiet_until - lanes[id].cycles < budget)
+                        budget = lanes[id].quiet_until - lanes[id].cycles;
+                }
+            if (mask != 0 && result == 0)
+                lanes_vector(mask, group_pc, budget);
+        }
+
+        running = 0;
+        for (id = 0; id < lane_count; id++)
+            running |= !lanes[id].halted;
+    }
+    if (result != 0)
+        return 1;
+
+    for (id = 0; id < lane_count && result == 0; id++)
+    {
+        lane_enter(id);
+        for (i = 0; i < 10; i++)
+            core_path(out[i], paths[i + 4], "lane", id);
+        result = closing(out[0], out[1], out[2], out[3], out[4], out[5], out[6], out[7], out[8], out[9]);
+    }
+    d_mem = d_mem_storage;
+    disk = disk_storage;
+    monitor = monitor_storage;
+    free(lanes);
+    lanes = NULL;
+    return result;
+}
+
+int memo_init()
+{
+    memo_calls = (struct memo_call*)malloc(MEMO_DEPTH * sizeof(struct memo_call));
+    memo_table = (struct memo_entry**)calloc(MEMO_BUCKETS, sizeof(struct memo_entry*));
+    if (memo_calls == NULL || memo_table == NULL)
+    {
+        err_msg("malloc");
+        return 1;
+    }
+    memo_on = 1;
+    return 0;
+}
+
+int memo_concretize(struct memo_call* call, int8_t base)
+{
+    uint32_t i;
+
+    call->mask |= 1 << base;
+    for (i = 0; i < REG_SIZE; i++)
+        if (call->regs[i].base == base)
+            call->regs[i].base = -1;
+    for (i = 0; i < call->write_count; i++)
+        if (call->writes[i].value.base == base)
+            call->writes[i].value.base = -1;
+    return 0;
+}
+
+int memo_use(struct memo_call* call, uint8_t reg)
+{
+    if (call->regs[reg].base >= 0)
+        memo_concretize(call, call->regs[reg].base);
+    return 0;
+}
+
+struct memo_value memo_add(struct memo_call* call, struct memo_value a, int32_t a_value, struct memo_value b, int32_t b_value)
+{
+    struct memo_value sum = { -1, 0 };
+
+    if (a.base >= 0 && b.base >= 0)
+    {
+        // a sum of two entry values is kept only by value
+        memo_concretize(call, a.base);
+        memo_concretize(call, b.base);
+    }
+    else if (a.base >= 0)
+    {
+        sum.base = a.base;
+        sum.off = a.off + b_value;
+    }
+    else if (b.base >= 0)
+    {
+        sum.base = b.base;
+        sum.off = b.off + a_value;
+    }
+    return sum;
+}
+
+struct memo_value memo_sub(struct memo_call* call, struct memo_value a, struct memo_value b, int32_t b_value)
+{
+    if (b.base >= 0)
+        memo_concretize(call, b.base);
+    if (a.base >= 0)
+        a.off -= b_value;
+    return a;
+}
+
+struct memo_write* memo_find_write(struct memo_call* call, uint16_t addr)
+{
+    uint32_t i;
+
+    for (i = 0; i < call->write_count; i++)
+        if (call->writes[i].addr == addr)
+            return &call->writes[i];
+    return NULL;
+}
+
+int memo_find_read(struct memo_call* call, uint16_t addr)
+{
+    uint32_t i;
+
+    for (i = 0; i < call->read_count; i++)
+        if (call->read_addr[i] == addr)
+            return i;
+    return -1;
+}
+
+int memo_add_read(struct memo_call* call, uint16_t addr, int32_t value)
+{
+    if (memo_find_read(call, addr) >= 0)
+        return 0;
+    if (call->read_count == MEMO_READS)
+        return 1;
+    call->read_addr[call->read_count] = addr;
+    call->read_value[call->read_count++] = value;
+    return 0;
+}
+
+int memo_add_write(struct memo_call* call, uint16_t addr, int32_t off, struct memo_value value)
+{
+    struct memo_write* w;
+
+    // only the stack below $sp at the entry, and no word the call read by its address
+    if (off >= 0 || off <= -MEMORY_SIZE || memo_find_read(call, addr) >= 0)
+        return 1;
+    w = memo_find_write(call, addr);
+    if (w == NULL)
+    {
+        if (call->write_count == MEMO_WRITES)
+            return 1;
+        w = &call->writes[call->write_count++];
+        w->addr = addr;
+        w->off = off;
+    }
+    w->value = value;
+    return 0;
+}
+
+int memo_record_call(struct memo_call* call, const struct decoded_inst* d)
+{
+    struct memo_value value = { -1, 0 }, addr_value;
+    struct memo_write* w;
+    uint16_t addr;
+
+    call->regs[0] = call->regs[1] = call->regs[2] = value;
+    if (cycles >= call->quiet)
+    {
+        // end_cycle() may start or finish I/O or take an interrupt in this cycle
+        call->pure = 0;
+        call->transient = 1;
+        return 0;
+    }
+    switch (d->opcode)
+    {
+    case 0: // add
+        value = memo_add(call, memo_add(call, call->regs[d->rs], r[d->rs], call->regs[d->rt], r[d->rt]),
+            r[d->rs] + r[d->rt], call->regs[d->rm], r[d->rm]);
+        break;
+    case 1: // sub
+        value = memo_sub(call, memo_sub(call, call->regs[d->rs], call->regs[d->rt], r[d->rt]), call->regs[d->rm], r[d->rm]);
+        break;
+    case 2: // mac
+        memo_use(call, d->rs);
+        memo_use(call, d->rt);
+        value = memo_add(call, value, (int32_t)((uint32_t)r[d->rs] * (uint32_t)r[d->rt]), call->regs[d->rm], r[d->rm]);
+        break;
+    case 3: case 4: case 5: // and, or, xor
+        memo_use(call, d->rm);
+        /* fall through */
+    case 6: case 7: case 8: // shifts
+        memo_use(call, d->rs);
+        memo_use(call, d->rt);
+        break;
+    case 9: case 10: case 11: case 12: case 13: case 14:
+        memo_use(call, d->rs);
+        memo_use(call, d->rt);
+        if (!branch_taken(d))
+            return 0;
+        if (call->regs[d->rm].base == call->link && call->regs[d->rm].off == 0)
+            call->returning = 1;
+        else
+            memo_use(call, d->rm);
+        return 0;
+    case 15: // jal writes rd before it reads rm
+        if (d->rm != d->rd)
+        {
+            if (call->regs[d->rm].base == call->link && call->regs[d->rm].off == 0)
+                call->returning = 1;
+            else
+                memo_use(call, d->rm);
+        }
+        break;
+    case 16: // lw
+    case 17: // sw
+        addr_value = memo_add(call, call->regs[d->rs], r[d->rs], call->regs[d->rt], r[d->rt]);
+        addr = (r[d->rs] + r[d->rt]) & 0xfff;
+        w = memo_find_write(call, addr);
+        if (d->opcode == 17)
+        {
+            value = memo_add(call, call->regs[d->rm], r[d->rm], call->regs[d->rd], r[d->rd]);
+            if (addr_value.base != SP_REG || memo_add_write(call, addr, addr_value.off, value) != 0)
+                call->pure = 0;
+            return 0;
+        }
+        if (addr_value.base == SP_REG)
+        {
+            // the stack frame, only words the call stored itself
+            if (w == NULL)
+            {
+                call->pure = 0;
+                return 0;
+            }
+            value = w->value;
+        }
+        else
+        {
+            if (addr_value.base >= 0)
+                memo_concretize(call, addr_value.base);
+            if (w != NULL || memo_add_read(call, addr, d_mem[addr]) != 0)
+            {
+                call->pure = 0;
+                return 0;
+            }
+        }
+        value = memo_add(call, value, d_mem[addr], call->regs[d->rm], r[d->rm]);
+        break;
+    default:
+        // reti, in, out and halt
+        call->pure = 0;
+        return 0;
+    }
+    if (d->rd > 2)
+        call->regs[d->rd] = value;
+    return 0;
+}
+
+int memo_record()
+{
+    const struct decoded_inst* d = &decoded[pc];
+    int i;
+
+    // the values execute_instruction() sees
+    r[0] = 0;
+    r[1] = d->imm1;
+    r[2] = d->imm2;
+    for (i = 0; i < memo_depth; i++)
+        if (memo_calls[i].pure)
+            memo_record_call(&memo_calls[i], d);
+    return 0;
+}
+
+uint32_t memo_hash(uint16_t pc, uint16_t mask, const int32_t* regs)
+{
+    uint32_t hash = pc * 2654435761u;
+    int i;
+
+    for (i = 3; i < REG_SIZE; i++)
+        if (mask & (1 << i))
+            hash = (hash ^ (uint32_t)regs[i]) * 2654435761u;
+    return (hash >> 16) & (MEMO_BUCKETS - 1);
+}
+
+struct memo_entry* memo_lookup(uint8_t link)
+{
+    struct memo_entry* entry;
+    uint16_t mask;
+    uint32_t i, j, m;
+    int reg;
+
+    for (m = 0; m < memo_mask_count[pc]; m++)
+    for (mask = memo_masks[pc][m], entry = memo_table[memo_hash(pc, mask, r)]; entry != NULL; entry = entry->next)
+    {
+        if (entry->pc != pc || entry->link != link || entry->mask != mask || (r[link] & 0xfff) == entry->ret_from)
+            continue;
+        for (reg = 3; reg < REG_SIZE; reg++)
+            if ((mask & (1 << reg)) && r[reg] != entry->key[reg])
+                break;
+        if (reg < REG_SIZE)
+            continue;
+        for (i = 0; i < entry->read_count; i++)
+        {
+            if (d_mem[entry->read_addr[i]] != entry->read_value[i])
+                break;
+            // a store of this call must not land on a word it reads
+            for (j = 0; j < entry->write_count; j++)
+                if (((r[SP_REG] + entry->writes[j].off) & 0xfff) == entry->read_addr[i])
+                    break;
+            if (j < entry->write_count)
+                break;
+        }
+        if (i == entry->read_count)
+            return entry;
+    }
+    return NULL;
+}
+
+int memo_insert(struct memo_call* call, uint16_t ret_from)
+{
+    struct memo_entry* entry, * next;
+    uint16_t* masks;
+    uint32_t i, hash;
+
+    if (memo_entry_count == MEMO_ENTRIES_MAX)
+    {
+        for (i = 0; i < MEMO_BUCKETS; i++)
+            for (entry = memo_table[i]; entry != NULL; entry = next)
+            {
+                next = entry->next;
+                free(entry);
+            }
+        memset(memo_table, 0, MEMO_BUCKETS * sizeof(struct memo_entry*));
+        memset(memo_mask_count, 0, sizeof(memo_mask_count));
+        memo_entry_count = 0;
+    }
+    entry = (struct memo_entry*)malloc(sizeof(struct memo_entry) + call->write_count * sizeof(struct memo_write));
+    if (entry == NULL)
+        return 1;
+    entry->pc = call->pc;
+    entry->ret_from = ret_from;
+    entry->link = call->link;
+    entry->mask = call->mask;
+    memcpy(entry->key, call->entry, sizeof(entry->key));
+    entry->read_count = call->read_count;
+    memcpy(entry->read_addr, call->read_addr, sizeof(entry->read_addr));
+    memcpy(entry->read_value, call->read_value, sizeof(entry->read_value));
+    for (i = 0; i < REG_SIZE; i++)
+    {
+        entry->regs[i] = call->regs[i];
+        if (entry->regs[i].base < 0)
+            entry->regs[i].off = r[i];
+    }
+    entry->cycles = cycles - call->start_cycle;
+    entry->write_count = call->write_count;
+    for (i = 0; i < call->write_count; i++)
+    {
+        entry->writes[i] = call->writes[i];
+        if (entry->writes[i].value.base < 0)
+            entry->writes[i].value.off = d_mem[call->writes[i].addr];
+    }
+
+    hash = memo_hash(call->pc, call->mask, call->entry);
+    entry->next = memo_table[hash];
+    memo_table[hash] = entry;
+    // the mask moves to the front, the oldest one is dropped when there are MEMO_MASKS
+    masks = memo_masks[call->pc];
+    for (i = 0; i < memo_mask_count[call->pc] && masks[i] != call->mask; i++)
+        ;
+    if (i == MEMO_MASKS)
+        i--;
+    else if (i == memo_mask_count[call->pc])
+        memo_mask_count[call->pc]++;
+    memmove(masks + 1, masks, i * sizeof(uint16_t));
+    masks[0] = call->mask;
+    memo_impure[call->pc] = 0;
+    memo_entry_count++;
+    return 0;
+}
+
+int memo_compose(struct memo_call* call, const struct memo_entry* entry)
+{
+    // the values of the registers at the inner entry, in terms of the outer one
+    struct memo_value at[REG_SIZE], value;
+    const struct memo_write* w;
+    uint32_t i;
+    int reg;
+
+    memcpy(at, call->regs, sizeof(at));
+    for (reg = 3; reg < REG_SIZE; reg++)
+        if ((entry->mask & (1 << reg)) && at[reg].base >= 0)
+            memo_concretize(call, at[reg].base);
+    for (i = 0; i < entry->read_count; i++)
+        if (memo_find_write(call, entry->read_addr[i]) != NULL ||
+            memo_add_read(call, entry->read_addr[i], entry->read_value[i]) != 0)
+        {
+            call->pure = 0;
+            return 0;
+        }
+    for (i = 0; i < entry->write_count; i++)
+    {
+        w = &entry->writes[i];
+        value.base = -1;
+        value.off = 0;
+        if (w->value.base >= 0 && at[w->value.base].base >= 0)
+        {
+            value.base = at[w->value.base].base;
+            value.off = at[w->value.base].off + w->value.off;
+        }
+        if (at[SP_REG].base != SP_REG ||
+            memo_add_write(call, (r[SP_REG] + w->off) & 0xfff, at[SP_REG].off + w->off, value) != 0)
+        {
+            call->pure = 0;
+            return 0;
+        }
+    }
+    for (reg = 0; reg < REG_SIZE; reg++)
+    {
+        value.base = -1;
+        value.off = 0;
+        if (entry->regs[reg].base >= 0 && at[entry->regs[reg].base].base >= 0)
+        {
+            value.base = at[entry->regs[reg].base].base;
+            value.off = at[entry->regs[reg].base].off + entry->regs[reg].off;
+        }
+        call->regs[reg] = value;
+    }
+    return 0;
+}
+
+int memo_apply(const struct memo_entry* entry)
+{
+    int32_t regs[REG_SIZE];
+    const struct memo_value* value;
+    unsigned long n = entry->cycles - (SIM_FAULT == 3);
+    uint32_t i;
+    int depth;
+
+    for (depth = 0; depth < memo_depth; depth++)
+        if (memo_calls[depth].pure)
+            memo_compose(&memo_calls[depth], entry);
+
+    memcpy(regs, r, sizeof(regs));
+    for (i = 0; i < entry->write_count; i++)
+    {
+        value = &entry->writes[i].value;
+        d_mem[(regs[SP_REG] + entry->writes[i].off) & 0xfff] = value->base < 0 ? value->off : regs[value->base] + value->off;
+    }
+    for (i = 0; i < REG_SIZE; i++)
+    {
+        value = &entry->regs[i];
+        r[i] = value->base < 0 ? value->off : regs[value->base] + value->off;
+    }
+    pc = regs[entry->link] & 0xfff;
+
+    // end_cycle() of every cycle of the call only counts it, see quiet_until()
+    cycles += n;
+    IORegister[CLKS] += n;
+    if (IORegister[TIMERENABLE])
+        IORegister[TIMERCURRENT] += n;
+    if (!irq_busy)
+        IORegister[IRQ2STATUS] = 0;
+    memo_hits++;
+    memo_saved_cycles += entry->cycles;
+    return 0;
+}
+
+int memo_enter(uint8_t link)
+{
+    struct memo_entry* entry = memo_lookup(link);
+    struct memo_call* call;
+    int i;
+
+    memo_call_count++;
+    if (entry != NULL && cycles + entry->cycles <= quiet_until())
+        return memo_apply(entry);
+    if (memo_depth == MEMO_DEPTH || memo_impure[pc] >= MEMO_RETRIES)
+        return 0;
+
+    call = &memo_calls[memo_depth++];
+    call->pc = pc;
+    call->ret_pc = r[link] & 0xfff;
+    call->link = link;
+    call->pure = 1;
+    call->transient = 0;
+    call->returning = 0;
+    call->mask = 0;
+    memcpy(call->entry, r, sizeof(call->entry));
+    call->start_cycle = cycles;
+    call->quiet = quiet_until();
+    for (i = 0; i < REG_SIZE; i++)
+    {
+        call->regs[i].base = i < 3 ? -1 : i;
+        call->regs[i].off = 0;
+    }
+    call->read_count = call->write_count = 0;
+    return 0;
+}
+
+int memo_finish(struct memo_call* call, uint16_t ret_from)
+{
+    if (call->pure && pc == call->ret_pc && memo_insert(call, ret_from) == 0)
+        return 0;
+    // a call whose own code is impure is recorded MEMO_RETRIES times in a row at most
+    if (!call->transient && memo_impure[call->pc] < 255)
+        memo_impure[call->pc]++;
+    memo_impure_count++;
+    return 1;
+}
+
+int memo_after(uint16_t prev_pc, uint8_t was_busy)
+{
+    const struct decoded_inst* d = &decoded[prev_pc];
+    struct memo_call* call;
+    int i;
+
+    if (irq_busy != was_busy)
+    {
+        // an interrupt was taken or a reti left one, no recorded call is pure
+        memo_impure_count += memo_depth;
+        memo_depth = 0;
+        return 0;
+    }
+    if (d->opcode >= 9 && d->opcode <= 15)
+        for (i = memo_depth - 1; i >= 0; i--)
+        {
+            // a pure call returns through the entry value of its link register, the others when the jump
+            // reaches the return address with $sp back at its entry value. The calls inside it are dropped.
+            call = &memo_calls[i];
+            if (call->pure ? !call->returning : pc != call->ret_pc || r[SP_REG] != call->entry[SP_REG])
+                continue;
+            memo_finish(call, prev_pc);
+            memo_depth = i;
+            break;
+        }
+    if (d->opcode == 15 && d->rd > 2)
+        memo_enter(d->rd);
+    return 0;
+}
+
+int memo_report()
+{
+    printf("memo: %lu calls, %lu from the cache skipping %lu of %lu cycles, %lu entries, %lu impure calls\n",
+        memo_call_count, memo_hits, memo_saved_cycles, cycles, memo_entry_count, memo_impure_count);
+    return 0;
+}
+
+int pairprof_count()
+{
+    uint8_t op = decoded[pc].opcode;
+    if (op >= OPCODE_COUNT)
+        return 0;
+    if (pairprof_cycle != cycles || pc != ((pairprof_pc[1] + 1) & 0xfff))
+        // a branch or an interrupt, a new run of fall-through instructions starts here
+        pairprof_pc[0] = pairprof_pc[1] = 0xffff;
+    else
+    {
+        uint8_t prev = decoded[pairprof_pc[1]].opcode;
+        pairprof[OPCODE_COUNT * OPCODE_COUNT * OPCODE_COUNT + prev * OPCODE_COUNT + op]++;
+        if (pairprof_pc[0] != 0xffff && pairprof_pc[1] == ((pairprof_pc[0] + 1) & 0xfff))
+            pairprof[(decoded[pairprof_pc[0]].opcode * OPCODE_COUNT + prev) * OPCODE_COUNT + op]++;
+    }
+    pairprof_pc[0] = pairprof_pc[1];
+    pairprof_pc[1] = pc;
+    pairprof_cycle = cycles + 1;
+    return 0;
+}
+
+int pairprof_report()
+{
+    // triples are indexed first, pairs follow them
+    uint32_t* pairs = pairprof + OPCODE_COUNT * OPCODE_COUNT * OPCODE_COUNT;
+    int n, i, best, kind;
+
+    printf("pairprof: %lu cycles, hottest fall-through groups (share of the cycles):\n", cycles);
+    for (kind = 0; kind < 2; kind++)
+    {
+        uint32_t* counts = kind == 0 ? pairs : pairprof;
+        int size = kind == 0 ? OPCODE_COUNT * OPCODE_COUNT : OPCODE_COUNT * OPCODE_COUNT * OPCODE_COUNT;
+        for (n = 0; n < PAIRPROF_TOP; n++)
+        {
+            best = 0;
+            for (i = 1; i < size; i++)
+                if (counts[i] > counts[best])
+                    best = i;
+            if (counts[best] == 0)
+                break;
+            if (kind == 0)
+                printf("  %-4s %-4s      %10u %5.1f%%\n", opcode_names[best / OPCODE_COUNT],
+                    opcode_names[best % OPCODE_COUNT], counts[best], 100.0 * counts[best] / cycles);
+            else
+                printf("  %-4s %-4s %-4s %10u %5.1f%%\n", opcode_names[best / (OPCODE_COUNT * OPCODE_COUNT)],
+                    opcode_names[best / OPCODE_COUNT % OPCODE_COUNT], opcode_names[best % OPCODE_COUNT],
+                    counts[best], 100.0 * counts[best] / cycles);
+            counts[best] = 0; // the report is printed once, take the next hottest
+        }
+    }
+    return 0;
+}
+
+int parse_args(int argc, char* argv[])
+{
+    int i;
+    unsigned long ws_window = WS_WINDOW_DEFAULT;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++)
+    {
+        if (strcmp(argv[i], "-memprof") == 0 && i + 1 < argc)
+            memprof_prefix = argv[++i];
+        else if (strcmp(argv[i], "-wswindow") == 0 && i + 1 < argc)
+            ws_window = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-notrace") == 0)
+            trace_off = 1;
+        else if (strcmp(argv[i], "-diverge") == 0 && i + 4 < argc)
+        {
+            diverge_inputs = argv + i + 1;
+            i += 4;
+        }
+        else if (strcmp(argv[i], "-checkpoint") == 0 && i + 1 < argc)
+            checkpoint_cycles = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-context") == 0 && i + 1 < argc)
+            context_cycles = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-digest") == 0)
+            digest_mode = 1;
+        else if (strcmp(argv[i], "-cores") == 0 && i + 1 < argc)
+            core_count = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-quantum") == 0 && i + 1 < argc)
+            quantum_cycles = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-dcache") == 0 && i + 1 < argc)
+        {
+            if (dcache_init(argv[++i]) != 0)
+                return -1;
+            mem_hooks = 1;
+        }
+        else if (strcmp(argv[i], "-dmabw") == 0 && i + 1 < argc)
+            dma_bandwidth = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-gdb") == 0 && i + 1 < argc)
+            gdb_address = argv[++i];
+        else if (strcmp(argv[i], "-nofuse") == 0)
+            fuse_off = 1;
+        else if (strcmp(argv[i], "-lanes") == 0 && i + 1 < argc)
+            lanes_file = argv[++i];
+        else if (strcmp(argv[i], "-memo") == 0)
+        {
+            if (memo_init() != 0)
+                return -1;
+            fuse_off = 1; // every instruction goes through step()
+        }
+        else if (strcmp(argv[i], "-verify") == 0 && i + 1 < argc)
+        {
+            i++;
+            for (verify_engine = VERIFY_FUSE; verify_engine < VERIFY_ENGINE_COUNT; verify_engine++)
+                if (strcmp(argv[i], verify_names[verify_engine]) == 0)
+                    break;
+            if (verify_engine == VERIFY_ENGINE_COUNT)
+            {
+                fprintf(stderr, "-verify expects fuse, memo or lanes\n");
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "-verifyevery") == 0 && i + 1 < argc)
+            verify_every = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-pairprof") == 0)
+        {
+            pairprof = (uint32_t*)calloc(OPCODE_COUNT * OPCODE_COUNT * (OPCODE_COUNT + 1), sizeof(uint32_t));
+            if (pairprof == NULL)
+            {
+                err_msg("malloc");
+                return -1;
+            }
+            fuse_off = 1; // every instruction must be seen on its own
+        }
+        else if (strcmp(argv[i], "-hostprof") == 0)
+        {
+#ifdef SIM_HOSTPROF
+            hostprof_enabled = 1;
+            hostprof_calibrate();
+#else
+            fprintf(stderr, "-hostprof requires a build with SIM_HOSTPROF defined\n");
+            return -1;
+#endif
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return -1;
+        }
+    }
+
+    if (ws_window == 0 || checkpoint_cycles == 0)
+    {
+        fprintf(stderr, "-wswindow and -checkpoint must be positive\n");
+        return -1;
+    }
+    if (diverge_inputs != NULL && (memprof_prefix != NULL || digest_mode || dcache != NULL))
+    {
+        fprintf(stderr, "-diverge can't be combined with -memprof, -digest or -dcache\n");
+        return -1;
+    }
+    if (core_count < 1 || core_count > MAX_CORES || quantum_cycles == 0 || quantum_cycles > DISK_CYCLES)
+    {
+        fprintf(stderr, "-cores must be 1 to %d and -quantum 1 to %d\n", MAX_CORES, DISK_CYCLES);
+        return -1;
+    }
+    if (dma_bandwidth == 0)
+    {
+        fprintf(stderr, "-dmabw must be at least 1\n");
+        return -1;
+    }
+    if (gdb_address != NULL && diverge_inputs != NULL)
+    {
+        fprintf(stderr, "-gdb can't be combined with -diverge\n");
+        return -1;
+    }
+    if (core_count > 1)
+    {
+        if (diverge_inputs != NULL || memprof_prefix != NULL || digest_mode || pairprof != NULL || dcache != NULL ||
+            gdb_address != NULL)
+        {
+            fprintf(stderr, "-cores can't be combined with -diverge, -memprof, -digest, -pairprof, -dcache or -gdb\n");
+            return -1;
+        }
+#ifdef SIM_HOSTPROF
+        if (hostprof_enabled)
+        {
+            fprintf(stderr, "-cores can't be combined with -hostprof\n");
+            return -1;
+        }
+#endif
+        mem_hooks = 1; // stores are merged at the quantum barrier
+    }
+    if (lanes_file != NULL)
+    {
+        if (core_count > 1 || diverge_inputs != NULL || memprof_prefix != NULL || pairprof != NULL || dcache != NULL ||
+            gdb_address != NULL)
+        {
+            fprintf(stderr, "-lanes can't be combined with -cores, -diverge, -memprof, -pairprof, -dcache or -gdb\n");
+            return -1;
+        }
+#ifdef SIM_HOSTPROF
+        if (hostprof_enabled)
+        {
+            fprintf(stderr, "-lanes can't be combined with -hostprof\n");
+            return -1;
+        }
+#endif
+    }
+    if (verify_engine != VERIFY_NONE && (core_count > 1 || lanes_file != NULL || memo_on || diverge_inputs != NULL ||
+        memprof_prefix != NULL || pairprof != NULL || dcache != NULL || gdb_address != NULL || digest_mode))
+    {
+        fprintf(stderr, "-verify can't be combined with -cores, -lanes, -memo, -diverge, -memprof, -pairprof, -dcache, -gdb or -digest\n");
+        return -1;
+    }
+    if (memo_on)
+    {
+        // a cached call has no trace records
+        if (!trace_off)
+        {
+            fprintf(stderr, "-memo needs -notrace\n");
+            return -1;
+        }
+        if (core_count > 1 || lanes_file != NULL || diverge_inputs != NULL || memprof_prefix != NULL ||
+            pairprof != NULL || dcache != NULL || gdb_address != NULL)
+        {
+            fprintf(stderr, "-memo can't be combined with -cores, -lanes, -diverge, -memprof, -pairprof, -dcache or -gdb\n");
+            return -1;
+        }
+    }
+    if (memprof_prefix != NULL && memprof_init(ws_window) != 0)
+        return -1;
+    return i;
+}
+
+int main(int argc, char* argv[])
+{
+    d_mem = d_mem_storage;
+    int argi = parse_args(argc, argv);
+    if (argi >= 0 && diverge_inputs != NULL && argc - argi == 4)
+        return diverge(argv + argi, diverge_inputs);
+    if (argi >= 0 && verify_engine != VERIFY_NONE && argc - argi == 4)
+        return verify(argv + argi);
+
+    if (argi < 0 || argc - argi != 14 || verify_engine != VERIFY_NONE){
+        printf("Usage: %s [options] imemin.txt dmemin.txt diskin.txt irq2in.txt dmemout.txt regout.txt trace.txt hwregtrace.txt cycles.txt leds.txt display7seg.txt diskout.txt monitor.txt monitor.yuv\n", argv[0]);
+        printf("       %s -diverge imemin.txt dmemin.txt diskin.txt irq2in.txt [-checkpoint <cycles>] [-context <cycles>] imemin.txt dmemin.txt diskin.txt irq2in.txt\n", argv[0]);
+        printf("       %s -verify <fuse|memo|lanes> [-verifyevery <cycles>] [-context <cycles>] imemin.txt dmemin.txt diskin.txt irq2in.txt\n", argv[0]);
+        printf("imemin, dmemin and diskin may also be a binary image written by asm -image, its matching section is loaded\n");
+        printf("irq2in may also be a named pipe or a Unix socket streaming the interrupt cycles while the program runs,\n");
+        printf("\"@<cycle>\" tells that no interrupt comes before <cycle>. The run waits only for cycles not settled yet\n");
+        printf("Options:\n");
+        printf("  -memprof <prefix>  profile d_mem accesses into <prefix>.bin (heatmap) and <prefix>.txt (summary)\n");
+        printf("  -wswindow <cycles> sliding working-set window of -memprof, also its sample period (default %d)\n", WS_WINDOW_DEFAULT);
+        printf("  -notrace           don't record the instruction trace, trace.txt is not written\n");
+        printf("  -digest            print an XXH64 digest line per output file instead of writing the files\n");
+        printf("  -cores <n>         run n cores (up to %d) on their own threads, all from the same inputs. Each core\n", MAX_CORES);
+        printf("                     has its own registers and writes its own regout, trace, hwregtrace, cycles, leds\n");
+        printf("                     and display7seg files named <file>_core<id>.<ext>. d_mem, disk and monitor are shared\n");
+        printf("  -quantum <cycles>  -cores makes the shared memory effects visible every <cycles> cycles (default %d)\n", QUANTUM_DEFAULT);
+        printf("  -dcache <words>,<line words>,<ways>,<wb|wt>,<miss penalty>\n");
+        printf("                     model a set-associative LRU cache in front of d_mem: a miss, a dirty eviction (wb)\n");
+        printf("                     and a store (wt) stall the core for the miss penalty. Prints hit/miss counts per pc\n");
+        printf("  -dmabw <words>     d_mem words the DMA engine copies or fills per cycle (default %d)\n", DMA_BANDWIDTH_DEFAULT);
+        printf("  -gdb <port|path>   wait for a GDB remote protocol debugger on 127.0.0.1:<port> or a Unix socket.\n");
+        printf("                     i_mem word i is at address 8*i (pc too), d_mem word i at 0x%x+4*i,\n", GDB_DMEM_BASE);
+        printf("                     I/O register i at 0x%x+4*i; registers r0-r15, pc and the I/O registers\n", GDB_IO_BASE);
+        printf("  -nofuse            don't execute the superinstructions (in+branch, add+branch, lw+mac, mac+add, sub+sub+mac)\n");
+        printf("  -pairprof          print the hottest fall-through instruction pairs and triples (implies -nofuse)\n");
+        printf("  -lanes <file>      run up to %d machines of the same imemin in SIMD lockstep. Each line of <file> is the\n", LANE_MAX);
+        printf("                     dmemin diskin irq2in of one more lane, lane 0 runs the positional inputs. Lane i\n");
+        printf("                     writes every output file as <file>_lane<i>.<ext>. Lanes whose pcs differ or that use\n");
+        printf("                     I/O or take an interrupt run on the scalar engine; build with -mavx2 or -mavx512f\n");
+        printf("  -memo              cache the effects of pure calls (entered by jal, returning through its link register,\n");
+        printf("                     no in/out, no stores above $sp, no interrupt) by pc and the registers and words\n");
+        printf("                     they depend on, and skip the calls found in the cache. Needs -notrace, implies -nofuse\n");
+        printf("  -diverge <imemin> <dmemin> <diskin> <irq2in>\n");
+        printf("                     run a second machine B from these inputs in lockstep with A (the positional inputs)\n");
+        printf("                     and report the first cycle where their states differ, exit status 1 if they do\n");
+        printf("  -checkpoint <cycles> -diverge state hash interval (default %lu)\n", CHECKPOINT_DEFAULT);
+        printf("  -context <cycles>  -diverge and -verify trace lines printed before the difference (default %d)\n", CONTEXT_DEFAULT);
+        printf("  -verify <engine>   run a fast engine (fuse: the superinstructions, memo: -memo, lanes: the -lanes SIMD\n");
+        printf("                     group with one lane) next to the reference execute_instruction() path and compare\n");
+        printf("                     the machines after every block of the engine. At the first difference print both\n");
+        printf("                     states and the reference trace of the block, exit status 1\n");
+        printf("  -verifyevery <cycles> -verify compares every <cycles> cycles instead of after every block\n");
+        printf("  -hostprof          report host time per phase, MIPS, peak RSS and bytes written (SIM_HOSTPROF builds)\n");
+        return 1;
+
+    }
+    argv += argi - 1; // argv[1] is the first positional argument
+
+    if (lanes_file != NULL)
+        // every lane is loaded, run and written by run_lanes()
+        return run_lanes(argv + 1) != 0;
+
+    if (init(argv[1], argv[2], argv[3], argv[4]) != 0)
+        return 1;
+    uint8_t halted = 0;
+
+#ifdef SIM_HOSTPROF
+    uint64_t run_start = hostprof_enabled ? hostprof_now() : 0;
+#endif
+
+    out_paths = argv + 5;
+    if (gdb_address != NULL)
+    {
+        if (gdb_serve(&halted) != 0)
+            return 1;
+    }
+    else if (core_count > 1 ? run_cores() != 0 : run_until(~0UL, &halted) != 0)
+        return 1;
+
+#ifdef SIM_HOSTPROF
+    uint64_t run_ns = hostprof_enabled ? hostprof_now() - run_start : 0;
+#endif
+
+    if (closing(argv[5], argv[6], argv[7], argv[8], argv[9], argv[10], argv[11], argv[12], argv[13], argv[14]) != 0)
+        return 1;
+
+#ifdef SIM_HOSTPROF
+    if (hostprof_enabled)
+        hostprof_report(run_ns, argv + 5, 10);
+#endif
+    if (pairprof != NULL)
+        pairprof_report();
+    if (dcache != NULL)
+        dcache_report();
+    if (memo_on)
+        memo_report();
 
     return 0;
 }